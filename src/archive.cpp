@@ -0,0 +1,311 @@
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+
+#include "archive.h"
+#include "texture_registry.h"
+
+template <typename T>
+static bool table_in_bounds(const mapped_file& file, const uint64_t offset, const uint32_t count)
+{
+    return offset % 8 == 0 && offset <= file.size && (file.size - offset) / sizeof(T) >= count;
+}
+
+static bool string_in_bounds(const archive_header& header, const uint32_t offset)
+{
+    return offset == archive_none || offset < header.strings_size;
+}
+
+static bool blob_in_bounds(const archive_header& header, const uint32_t blob)
+{
+    return blob == archive_none || blob < header.blob_count;
+}
+
+/*
+ * Checks every offset and index in the table of contents, so nothing read
+ * through it later can land outside the mapping.
+ */
+static bool valid_contents(const asset_archive& archive)
+{
+    const auto& header = *archive.header;
+    const auto& file = archive.file;
+
+    if (
+        !table_in_bounds<archive_model>(file, header.models_offset, header.model_count) ||
+        !table_in_bounds<archive_mesh>(file, header.meshes_offset, header.mesh_count) ||
+        !table_in_bounds<archive_blob>(file, header.blobs_offset, header.blob_count) ||
+        !table_in_bounds<char>(file, header.strings_offset, header.strings_size)
+    )
+    {
+        return false;
+    }
+
+    //every string ends before the table does
+    if (header.strings_size > 0 && archive.strings[header.strings_size - 1] != 0) return false;
+
+    for (uint32_t i = 0; i < header.model_count; i++)
+    {
+        const auto& model = archive.models[i];
+
+        if (
+            !string_in_bounds(header, model.author) || !string_in_bounds(header, model.name) ||
+            !string_in_bounds(header, model.url) || model.first_mesh > header.mesh_count ||
+            header.mesh_count - model.first_mesh < model.mesh_count
+        )
+        {
+            return false;
+        }
+    }
+
+    for (uint32_t i = 0; i < header.mesh_count; i++)
+    {
+        const auto& mesh = archive.meshes[i];
+
+        //every mesh has geometry and a diffuse map, the first of the maps
+        if (mesh.geometry == archive_none || mesh.maps[0] == archive_none) return false;
+        if (!blob_in_bounds(header, mesh.geometry)) return false;
+
+        for (auto map = 0; map < archive_mesh_maps; map++)
+        {
+            if (!blob_in_bounds(header, mesh.maps[map])) return false;
+        }
+
+        //the loader names geometry and maps by their blob's path
+        if (archive.blobs[mesh.geometry].path == archive_none) return false;
+
+        for (auto map = 0; map < archive_mesh_maps; map++)
+        {
+            if (mesh.maps[map] != archive_none && archive.blobs[mesh.maps[map]].path == archive_none) return false;
+        }
+    }
+
+    for (uint32_t i = 0; i < header.blob_count; i++)
+    {
+        const auto& blob = archive.blobs[i];
+
+        if (
+            blob.alignment == 0 || blob.offset % blob.alignment != 0 || !string_in_bounds(header, blob.path) ||
+            blob.offset > file.size || file.size - blob.offset < blob.size
+        )
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool is_archive(const char* path)
+{
+    FILE* f = nullptr;
+    open_binary_file(path, f);
+    if (f == nullptr) return false;
+
+    char magic[sizeof(archive_magic)]{};
+    const auto num_read = fread(magic, 1, sizeof(magic), f);
+    fclose(f);
+
+    return num_read == sizeof(magic) && memcmp(magic, archive_magic, sizeof(magic)) == 0;
+}
+
+bool open_archive(const char* path, asset_archive& out)
+{
+    out = asset_archive{};
+
+    mapped_file file;
+
+    if (!map_file(path, file))
+    {
+        printf("Could not open %s.\n", path);
+        return false;
+    }
+
+    if (file.size < sizeof(archive_header) || memcmp(file.data, archive_magic, sizeof(archive_magic)) != 0)
+    {
+        printf("%s is not an archive.\n", path);
+        unmap_file(file);
+        return false;
+    }
+
+    const auto* header = reinterpret_cast<const archive_header*>(file.data);
+
+    if (header->version != archive_version)
+    {
+        printf("%s is a version %u archive, expected version %u.\n", path, header->version, archive_version);
+        unmap_file(file);
+        return false;
+    }
+
+    out.file = file;
+    out.header = header;
+    out.models = reinterpret_cast<const archive_model*>(file.data + header->models_offset);
+    out.meshes = reinterpret_cast<const archive_mesh*>(file.data + header->meshes_offset);
+    out.blobs = reinterpret_cast<const archive_blob*>(file.data + header->blobs_offset);
+    out.strings = reinterpret_cast<const char*>(file.data + header->strings_offset);
+
+    if (!valid_contents(out))
+    {
+        printf("%s is damaged.\n", path);
+        close_archive(out);
+        return false;
+    }
+
+    return true;
+}
+
+void close_archive(asset_archive& archive)
+{
+    unmap_file(archive.file);
+    archive = asset_archive{};
+}
+
+const char* archive_string(const asset_archive& archive, const uint32_t offset)
+{
+    return offset != archive_none ? archive.strings + offset : nullptr;
+}
+
+const unsigned char* archive_blob_data(const asset_archive& archive, const uint32_t blob)
+{
+    assert(blob < archive.header->blob_count);
+    return archive.file.data + archive.blobs[blob].offset;
+}
+
+uint32_t add_archive_string(archive_writer& writer, const char* str)
+{
+    if (str == nullptr) return archive_none;
+
+    const auto offset = static_cast<uint32_t>(writer.strings.size());
+    writer.strings.insert(writer.strings.end(), str, str + strlen(str) + 1);
+
+    return offset;
+}
+
+uint32_t add_archive_file(archive_writer& writer, const char* path)
+{
+    char normalised[1024];
+    normalise_path(path, normalised, sizeof(normalised));
+
+    for (size_t i = 0; i < writer.blobs.size(); i++)
+    {
+        if (strcmp(writer.strings.data() + writer.blobs[i].path, normalised) == 0) return static_cast<uint32_t>(i);
+    }
+
+    FILE* f = nullptr;
+    open_binary_file(normalised, f);
+    if (f == nullptr) return archive_none;
+
+    std::vector<unsigned char> data;
+    unsigned char chunk[65536];
+
+    for (;;)
+    {
+        const auto num_read = fread(chunk, 1, sizeof(chunk), f);
+        data.insert(data.end(), chunk, chunk + num_read);
+        if (num_read < sizeof(chunk)) break;
+    }
+
+    fclose(f);
+
+    archive_blob blob{};
+    blob.size = data.size();
+    blob.alignment = archive_blob_alignment;
+    blob.path = add_archive_string(writer, normalised);
+
+    writer.blobs.push_back(blob);
+    writer.blob_data.push_back(std::move(data));
+
+    return static_cast<uint32_t>(writer.blobs.size() - 1);
+}
+
+static uint64_t align_offset(const uint64_t offset, const uint64_t alignment)
+{
+    return (offset + alignment - 1) / alignment * alignment;
+}
+
+/*
+ * Writes size bytes at offset, padding with zeros from where the file is.
+ */
+static bool write_at(FILE* f, uint64_t& position, const uint64_t offset, const void* data, const size_t size)
+{
+    assert(offset >= position);
+
+    static const unsigned char padding[archive_blob_alignment]{};
+
+    while (position < offset)
+    {
+        const auto pad = static_cast<size_t>(std::min<uint64_t>(offset - position, sizeof(padding)));
+        if (fwrite(padding, 1, pad, f) != pad) return false;
+        position += pad;
+    }
+
+    if (size > 0 && fwrite(data, 1, size, f) != size) return false;
+    position += size;
+
+    return true;
+}
+
+bool write_archive(const archive_writer& writer, const char* path)
+{
+    archive_header header{};
+    memcpy(header.magic, archive_magic, sizeof(archive_magic));
+    header.version = archive_version;
+    header.model_count = static_cast<uint32_t>(writer.models.size());
+    header.mesh_count = static_cast<uint32_t>(writer.meshes.size());
+    header.blob_count = static_cast<uint32_t>(writer.blobs.size());
+    header.strings_size = static_cast<uint32_t>(writer.strings.size());
+
+    //table of contents, then the blobs
+    header.models_offset = align_offset(sizeof(header), 8);
+    header.meshes_offset = align_offset(header.models_offset + sizeof(archive_model) * writer.models.size(), 8);
+    header.blobs_offset = align_offset(header.meshes_offset + sizeof(archive_mesh) * writer.meshes.size(), 8);
+    header.strings_offset = align_offset(header.blobs_offset + sizeof(archive_blob) * writer.blobs.size(), 8);
+
+    auto blobs = writer.blobs;
+    auto end = header.strings_offset + writer.strings.size();
+
+    for (auto& blob : blobs)
+    {
+        blob.offset = align_offset(end, blob.alignment);
+        end = blob.offset + blob.size;
+    }
+
+    FILE* f = nullptr;
+    create_binary_file(path, f);
+
+    if (f == nullptr)
+    {
+        printf("Could not open %s for writing.\n", path);
+        return false;
+    }
+
+    uint64_t position = 0;
+
+    auto written =
+        write_at(f, position, 0, &header, sizeof(header)) &&
+        write_at(f, position, header.models_offset, writer.models.data(), sizeof(archive_model) * writer.models.size()) &&
+        write_at(f, position, header.meshes_offset, writer.meshes.data(), sizeof(archive_mesh) * writer.meshes.size()) &&
+        write_at(f, position, header.blobs_offset, blobs.data(), sizeof(archive_blob) * blobs.size()) &&
+        write_at(f, position, header.strings_offset, writer.strings.data(), writer.strings.size());
+
+    for (size_t i = 0; i < blobs.size() && written; i++)
+    {
+        written = write_at(f, position, blobs[i].offset, writer.blob_data[i].data(), writer.blob_data[i].size());
+    }
+
+    written = fclose(f) == 0 && written;
+
+    if (!written)
+    {
+        printf("Could not write %s.\n", path);
+        return false;
+    }
+
+    printf(
+        "Packed %u models, %u meshes and %u files into %s, %u KB\n",
+        header.model_count, header.mesh_count, header.blob_count, path,
+        static_cast<unsigned>(position / 1024)
+    );
+
+    return true;
+}
@@ -0,0 +1,153 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <cstdint>
+#include <vector>
+
+#include "image.h"
+#include "maths.h"
+#include "platform_specific.h"
+
+/*
+ * Every asset the app loads, packed into one file that is read through a
+ * single mapping. Run the app with "--pack <path>" to build one from
+ * obj/conf.bin and the files it lists.
+ *
+ * The file starts with an archive_header, whose offsets point at the table
+ * of contents: the models, their meshes, and the blobs those refer to. Blobs
+ * are mesh .bin files, stored as is so meshes point straight into the
+ * mapping, and encoded textures. Strings (model credits and the path each
+ * blob was packed from) are null terminated and referred to by their offset
+ * into the string table.
+ *
+ * Tables are 8 byte aligned and each blob starts at a multiple of its
+ * alignment. All values are little endian, as every platform we build for
+ * is. The version changes whenever the layout does, older archives are
+ * rejected rather than misread.
+ */
+static const char archive_magic[4] = { 'S', 'R', 'P', 'K' };
+static const uint32_t archive_version = 1;
+
+//blobs are cache line aligned, which covers every element type stored in them
+static const uint32_t archive_blob_alignment = 64;
+
+//for optional maps and strings that are missing
+static const uint32_t archive_none = 0xffffffffu;
+
+struct archive_header
+{
+    char magic[4];
+    uint32_t version;
+
+    uint32_t model_count;
+    uint32_t mesh_count;
+    uint32_t blob_count;
+    uint32_t strings_size;
+
+    uint64_t models_offset;
+    uint64_t meshes_offset;
+    uint64_t blobs_offset;
+    uint64_t strings_offset;
+};
+
+struct archive_model
+{
+    hsla background;
+    rgba text_col;
+    v3 initial_rot;
+
+    //strings
+    uint32_t author;
+    uint32_t name;
+    uint32_t url;
+
+    //this model's meshes are [first_mesh, first_mesh + mesh_count)
+    uint32_t first_mesh;
+    uint32_t mesh_count;
+};
+
+/*
+ * Maps are blob indices in the order diffuse, normal, spec, emission.
+ */
+static const int archive_mesh_maps = 4;
+
+struct archive_mesh
+{
+    uint32_t allow_lighting;
+    uint32_t geometry;
+    uint32_t maps[archive_mesh_maps];
+};
+
+struct archive_blob
+{
+    uint64_t offset;
+    uint64_t size;
+    uint32_t alignment;
+
+    //string
+    uint32_t path;
+};
+
+static_assert(sizeof(archive_header) == 56, "archive_header is part of the file format");
+static_assert(sizeof(archive_model) == 52, "archive_model is part of the file format");
+static_assert(sizeof(archive_mesh) == 24, "archive_mesh is part of the file format");
+static_assert(sizeof(archive_blob) == 24, "archive_blob is part of the file format");
+
+/*
+ * An archive mapped into memory. The tables point into the mapping, which
+ * stays open for as long as anything loaded from it is in use.
+ */
+struct asset_archive
+{
+    mapped_file file;
+
+    const archive_header* header{};
+    const archive_model* models{};
+    const archive_mesh* meshes{};
+    const archive_blob* blobs{};
+    const char* strings{};
+};
+
+/*
+ * True when the file at path starts like an archive, whether or not it can
+ * be opened.
+ */
+bool is_archive(const char* path);
+
+/*
+ * Maps the archive at path and checks its table of contents, printing why
+ * when it can't be used.
+ */
+bool open_archive(const char* path, asset_archive& out);
+void close_archive(asset_archive& archive);
+
+//null for archive_none
+const char* archive_string(const asset_archive& archive, uint32_t offset);
+const unsigned char* archive_blob_data(const asset_archive& archive, uint32_t blob);
+
+/*
+ * Builds archives, collecting the tables in memory until write_archive().
+ * Blobs added twice from the same path are stored once.
+ */
+struct archive_writer
+{
+    std::vector<archive_model> models;
+    std::vector<archive_mesh> meshes;
+    std::vector<archive_blob> blobs;
+    std::vector<char> strings;
+
+    //contents of each blob, in order
+    std::vector<std::vector<unsigned char>> blob_data;
+};
+
+uint32_t add_archive_string(archive_writer& writer, const char* str);
+
+/*
+ * Reads the file at path into a new blob and returns its index, or
+ * archive_none if it can't be read.
+ */
+uint32_t add_archive_file(archive_writer& writer, const char* path);
+
+bool write_archive(const archive_writer& writer, const char* path);
+
+#endif
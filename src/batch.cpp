@@ -0,0 +1,265 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "batch.h"
+#include "jobs.h"
+
+#if HAS_THREADS
+#include <mutex>
+#endif
+
+/*
+ * Everything a frame writes to, so frames rendering at the same time never
+ * share mutable state.
+ */
+struct batch_worker
+{
+    render_state state;
+    blinn_shader_normal_map shader;
+
+    ssao_effect ssao;
+    fxaa_effect fxaa;
+    blur_effect blur;
+    screen_space_effect* effects[3] = { &ssao, &fxaa, &blur };
+};
+
+/*
+ * Workers are handed out per frame rather than per thread. A thread waiting
+ * on a frame's effects can pick up another frame in the meantime, and needs
+ * a second worker for it. The pool grows to however many frames are ever in
+ * flight at once, and like the app's own buffers is left for the OS to
+ * clean up.
+ */
+struct batch_worker_pool
+{
+    const render_state* base_state{};
+    const batch_settings* settings{};
+
+    std::vector<batch_worker*> idle;
+
+    std::atomic<int> frames{};
+
+#if HAS_THREADS
+    std::mutex lock;
+#endif
+};
+
+static batch_worker* acquire_batch_worker(batch_worker_pool& pool)
+{
+    {
+#if HAS_THREADS
+        std::lock_guard<std::mutex> lock(pool.lock);
+#endif
+
+        if (!pool.idle.empty())
+        {
+            auto* worker = pool.idle.back();
+            pool.idle.pop_back();
+            return worker;
+        }
+    }
+
+    const auto& frame_buffer = pool.base_state->output_buffers.frame_buffer;
+    auto* worker = new batch_worker;
+
+    worker->state = *pool.base_state;
+    worker->state.output_buffers = output_buffers{};
+    init_output_buffers(worker->state.output_buffers, frame_buffer.width, frame_buffer.height);
+
+    worker->ssao.enabled = pool.settings->ssao;
+    worker->blur.enabled = pool.settings->blur;
+
+    return worker;
+}
+
+static void release_batch_worker(batch_worker_pool& pool, batch_worker* worker)
+{
+#if HAS_THREADS
+    std::lock_guard<std::mutex> lock(pool.lock);
+#endif
+
+    pool.idle.push_back(worker);
+}
+
+void add_turntable_jobs(std::vector<batch_job>& jobs, const render_state& state, const int model_count, const int view_count)
+{
+    for (auto model_idx = 0; model_idx < model_count; model_idx++)
+    {
+        for (auto view = 0; view < view_count; view++)
+        {
+            const auto turn = static_cast<float>(view) / static_cast<float>(view_count);
+
+            //draw_scene() turns once every 20 seconds and tilts with cos(seconds / 10)
+            const auto tilt = std::abs(std::cos(turn * 2)) * 25 + 10;
+
+            jobs.push_back({ model_idx, state.eye, v3{ tilt, turn * 360, 0 } });
+        }
+    }
+}
+
+static void batch_output_path(char* path, const size_t size, const char* output_path, const int model_idx, const int frame)
+{
+    const auto* extension = strrchr(output_path, '.');
+    const auto stem_length = static_cast<int>(extension != nullptr ? extension - output_path : strlen(output_path));
+
+    if (frame < 0)
+    {
+        snprintf(path, size, "%.*s_m%d%s", stem_length, output_path, model_idx, extension != nullptr ? extension : "");
+    }
+    else
+    {
+        snprintf(path, size, "%.*s_m%d_%04d%s", stem_length, output_path, model_idx, frame, extension != nullptr ? extension : "");
+    }
+}
+
+static void render_batch_job(batch_worker& worker, model* models, const batch_job& job, const batch_settings& settings)
+{
+    auto& state = worker.state;
+
+    state.eye = job.eye;
+    state.projection = projection(job.eye, state.center);
+    state.model_view = look_at(job.eye, state.center, state.up) * rot_x(job.rotation.x) * rot_y(job.rotation.y);
+
+    clear_output_buffers(state.output_buffers, settings.clear_color);
+    draw_model(models[job.model_idx], state, worker.shader);
+
+    if (settings.use_fx)
+    {
+        apply_effects(state.output_buffers, worker.effects, 3);
+    }
+
+    resolve_output_buffers(state.output_buffers);
+}
+
+static void copy_to_sheet(const image& frame, image& sheet, const int column, const int row)
+{
+    const auto row_bytes = static_cast<size_t>(frame.width) * 4;
+
+    for (auto y = 0; y < frame.height; y++)
+    {
+        auto* target = sheet.data + (static_cast<size_t>(row) * frame.height + y) * sheet.stride() + column * row_bytes;
+        memcpy(target, frame.data + static_cast<size_t>(y) * frame.stride(), row_bytes);
+    }
+}
+
+/*
+ * Renders jobs [first, last), all for the same model, one job system job per
+ * frame so idle threads steal whole frames.
+ */
+static bool render_batch_jobs(
+    batch_worker_pool& pool, model* models, const batch_job* jobs, const int first, const int last,
+    const batch_settings& settings, image* sheet, const int sheet_columns
+)
+{
+    std::atomic<bool> failed{};
+
+    parallel_for(last - first, 1, [&](const int begin, const int end)
+    {
+        for (auto index = begin; index < end && !failed; index++)
+        {
+            const auto& job = jobs[first + index];
+            auto* worker = acquire_batch_worker(pool);
+
+            render_batch_job(*worker, models, job, settings);
+            pool.frames++;
+
+            const auto& frame = worker->state.output_buffers.frame_buffer;
+
+            if (sheet != nullptr)
+            {
+                copy_to_sheet(frame, *sheet, index % sheet_columns, index / sheet_columns);
+            }
+            else
+            {
+                char path[1024];
+                batch_output_path(path, sizeof(path), settings.output_path, job.model_idx, index);
+
+                if (!save_image(path, frame))
+                {
+                    failed = true;
+                }
+            }
+
+            release_batch_worker(pool, worker);
+        }
+    });
+
+    return !failed;
+}
+
+bool run_batch(const render_state& state, model* models, const std::vector<batch_job>& jobs, const batch_settings& settings)
+{
+    const auto job_count = static_cast<int>(jobs.size());
+    if (job_count == 0) return true;
+
+    const auto width = state.output_buffers.frame_buffer.width;
+    const auto height = state.output_buffers.frame_buffer.height;
+
+    batch_worker_pool pool;
+    pool.base_state = &state;
+    pool.settings = &settings;
+
+    const auto start = std::chrono::high_resolution_clock::now();
+    auto ok = true;
+
+    //jobs are rendered in runs for the same model, each of which gets a sheet if asked for
+    for (auto first = 0; ok && first < job_count;)
+    {
+        const auto model_idx = jobs[first].model_idx;
+
+        auto last = first;
+        while (last < job_count && jobs[last].model_idx == model_idx) last++;
+
+        if (!settings.sprite_sheet)
+        {
+            ok = render_batch_jobs(pool, models, jobs.data(), first, last, settings, nullptr, 0);
+            first = last;
+            continue;
+        }
+
+        //as square as the frame count allows
+        const auto frames = last - first;
+        const auto columns = static_cast<int>(std::ceil(std::sqrt(static_cast<float>(frames))));
+        const auto rows = (frames + columns - 1) / columns;
+
+        image sheet{};
+        sheet.width = width * columns;
+        sheet.height = height * rows;
+        sheet.n_channels = 4;
+        sheet.data = new unsigned char[image_data_size(sheet)];
+
+        //cells past the last frame show the background
+        for (size_t i = 0; i < static_cast<size_t>(sheet.width) * sheet.height; i++)
+        {
+            reinterpret_cast<rgba*>(sheet.data)[i] = settings.clear_color;
+        }
+
+        ok = render_batch_jobs(pool, models, jobs.data(), first, last, settings, &sheet, columns);
+
+        char path[1024];
+        batch_output_path(path, sizeof(path), settings.output_path, model_idx, -1);
+
+        if (ok && !save_image(path, sheet))
+        {
+            ok = false;
+        }
+
+        delete[] sheet.data;
+        first = last;
+    }
+
+    const auto stop = std::chrono::high_resolution_clock::now();
+    const auto seconds = std::chrono::duration<double>(stop - start).count();
+
+    printf(
+        "Batch: %d frames on %d threads in %.2f s, %.1f frames/s\n",
+        pool.frames.load(), job_thread_count(), seconds, pool.frames.load() / std::max(seconds, 1e-9)
+    );
+
+    return ok;
+}
@@ -0,0 +1,52 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <vector>
+
+#include "render.h"
+#include "file.h"
+
+/*
+ * One frame of a batch render: which model, where the camera is and how the
+ * model is turned, in degrees about x then y.
+ */
+struct batch_job
+{
+    int model_idx{};
+    v3 eye{};
+    v3 rotation{};
+};
+
+struct batch_settings
+{
+    //"out/turntable.png" gives out/turntable_m2_0042.png per frame, or out/turntable_m2.png per sheet
+    const char* output_path = "turntable.png";
+
+    //lay every model's frames out in one image instead of writing them separately
+    bool sprite_sheet{};
+
+    rgba clear_color{};
+
+    //post processing, matching the app's "--fx", "--ssao" and "--blur"
+    bool use_fx{};
+    bool ssao{};
+    bool blur{};
+};
+
+/*
+ * Appends view_count jobs per model, turning each one through a full circle
+ * with the same tilt draw_scene() animates.
+ */
+void add_turntable_jobs(std::vector<batch_job>& jobs, const render_state& state, int model_count, int view_count);
+
+/*
+ * Renders every job at the size of state's output buffers and writes the
+ * frames out, then prints how many frames a second the batch managed.
+ * Frames are rendered concurrently on the job system, each with its own
+ * render state, output buffers, shader and effects. Models and their
+ * textures are shared, so they must not use virtual textures, whose page
+ * cache is updated as they are sampled.
+ */
+bool run_batch(const render_state& state, model* models, const std::vector<batch_job>& jobs, const batch_settings& settings);
+
+#endif
@@ -0,0 +1,404 @@
+#include <chrono>
+#include <cmath>
+#include <vector>
+
+#include "bench.h"
+#include "jobs.h"
+
+#if HAS_THREADS
+#include <thread>
+#endif
+
+/*
+ * Number of auto-rotating views each model is rendered from when gathering
+ * texture samples, and how many times each gathered set is replayed.
+ */
+static const int bench_view_count = 36;
+static const int bench_sample_passes = 10;
+
+struct texel_sample
+{
+    mesh* source;
+    uv_fixed uv;
+};
+
+/*
+ * Records which texels a frame samples, in the order the rasterizer visits
+ * them, instead of shading anything. Replaying the recording lets us time the
+ * texture fetches on their own with a realistic access pattern.
+ */
+struct texel_recording_shader final : public shader
+{
+    m4 model_view_proj{};
+    std::vector<texel_sample>* samples{};
+
+    const char* name() override { return "Texel Recorder"; }
+
+    void begin_pass() override
+    {
+        model_view_proj = renderer_state->projection * renderer_state->model_view;
+    }
+
+    v4 vertex(const v3& vertex, int face_no, int vert_no, triangle_varyings& varyings) const override
+    {
+        return model_view_proj * project_4d(vertex);
+    }
+
+    bool fragment(const v3& bar, rgba & col, v3 interpolated_normal, v2 interpolated_uv, const v2_i& screen_pos) override
+    {
+        samples->push_back({ mesh_to_draw, to_fixed_uv(interpolated_uv) });
+        return false;
+    }
+};
+
+static void set_model_texture_layout(model& obj, const image_layout layout)
+{
+    for (size_t i = 0; i < obj.mesh_count; i++)
+    {
+        auto& mesh = obj.meshes[i];
+
+        convert_image_layout(mesh.diffuse, layout);
+        if (mesh.has_normal_map) convert_image_layout(mesh.normal, layout);
+        if (mesh.has_specular_map) convert_image_layout(mesh.spec, layout);
+        if (mesh.has_emissive_map) convert_image_layout(mesh.emission, layout);
+    }
+}
+
+static size_t model_texture_bytes(const model& obj)
+{
+    size_t bytes = 0;
+
+    for (size_t i = 0; i < obj.mesh_count; i++)
+    {
+        const auto& mesh = obj.meshes[i];
+
+        bytes += image_data_size(mesh.diffuse);
+        if (mesh.has_normal_map) bytes += image_data_size(mesh.normal);
+        if (mesh.has_specular_map) bytes += image_data_size(mesh.spec);
+        if (mesh.has_emissive_map) bytes += image_data_size(mesh.emission);
+    }
+
+    return bytes;
+}
+
+/*
+ * Swaps every map of a (linear) model for a block compressed copy, using the
+ * same formats the model loader picks. The originals are appended to originals
+ * so restore_model_textures() can put them back.
+ */
+static void compress_model_textures(model& obj, std::vector<image>& originals)
+{
+    for (size_t i = 0; i < obj.mesh_count; i++)
+    {
+        auto& mesh = obj.meshes[i];
+        image* maps[4] = { &mesh.diffuse, &mesh.normal, &mesh.spec, &mesh.emission };
+        const bool present[4] = { mesh.diffuse.data != nullptr, mesh.has_normal_map, mesh.has_specular_map, mesh.has_emissive_map };
+        const image_format formats[4] = { image_format::bc1, image_format::bc5, image_format::bc4, image_format::bc1 };
+        const int channels[4] = { 0, 0, 2, 0 };
+
+        for (auto m = 0; m < 4; m++)
+        {
+            originals.push_back(*maps[m]);
+
+            if (present[m])
+            {
+                compress_image(originals.back(), *maps[m], formats[m], channels[m]);
+            }
+        }
+    }
+}
+
+static void restore_model_textures(model& obj, const std::vector<image>& originals)
+{
+    auto next = originals.begin();
+
+    for (size_t i = 0; i < obj.mesh_count; i++)
+    {
+        auto& mesh = obj.meshes[i];
+        image* maps[4] = { &mesh.diffuse, &mesh.normal, &mesh.spec, &mesh.emission };
+
+        for (auto m = 0; m < 4; m++)
+        {
+            if (maps[m]->data != next->data)
+            {
+                free_image(*maps[m]);
+            }
+
+            *maps[m] = *next++;
+        }
+    }
+}
+
+/*
+ * Interleaves the maps of every mesh the model loader would pack, keeping the
+ * separate maps so the model can go back to them afterwards.
+ */
+static void pack_model_materials(model& obj, const bool packed)
+{
+    for (size_t i = 0; i < obj.mesh_count; i++)
+    {
+        auto& mesh = obj.meshes[i];
+
+        if (!worth_packing_material(mesh))
+        {
+            continue;
+        }
+
+        if (packed)
+        {
+            pack_material_texture(
+                mesh.diffuse,
+                mesh.has_normal_map ? &mesh.normal : nullptr,
+                mesh.has_specular_map ? &mesh.spec : nullptr,
+                mesh.has_emissive_map ? &mesh.emission : nullptr,
+                mesh.material
+            );
+        }
+        else
+        {
+            free_material_texture(mesh.material);
+        }
+
+        mesh.has_material_texture = packed;
+    }
+}
+
+static size_t model_material_bytes(const model& obj)
+{
+    size_t bytes = 0;
+
+    for (size_t i = 0; i < obj.mesh_count; i++)
+    {
+        const auto& mesh = obj.meshes[i];
+
+        if (mesh.has_material_texture)
+        {
+            bytes += sizeof(material_texel) * mesh.material.width * mesh.material.height;
+        }
+        else
+        {
+            bytes += image_data_size(mesh.diffuse);
+        }
+    }
+
+    return bytes;
+}
+
+/*
+ * Replays the recorded samples, fetching from every map the normal mapping
+ * shader would read. Returns a checksum so the loads can't be optimised away.
+ */
+static unsigned replay_texel_samples(const std::vector<texel_sample>& samples, const sampler& s)
+{
+    unsigned checksum = 0;
+
+    for (const auto& recorded : samples)
+    {
+        auto& mesh = *recorded.source;
+
+        if (mesh.has_material_texture)
+        {
+            const auto texel = sample_material(s, mesh.material, recorded.uv);
+            checksum += texel.r + texel.normal_y + texel.spec;
+            continue;
+        }
+
+        checksum += sample(s, mesh.diffuse, recorded.uv).r;
+
+        if (mesh.has_normal_map)
+        {
+            checksum += sample(s, mesh.normal, recorded.uv).g;
+        }
+
+        if (mesh.has_specular_map)
+        {
+            checksum += sample(s, mesh.spec, recorded.uv).b;
+        }
+    }
+
+    return checksum;
+}
+
+/*
+ * Returns the number of fragments' worth of texture reads per second.
+ */
+static double time_texel_samples(
+    const std::vector<texel_sample>& samples, unsigned& checksum,
+    const filter_mode filter = filter_mode::point
+)
+{
+    sampler s{};
+    s.filter = filter;
+
+    const auto start = std::chrono::high_resolution_clock::now();
+    for (auto pass = 0; pass < bench_sample_passes; pass++)
+    {
+        checksum += replay_texel_samples(samples, s);
+    }
+    const auto stop = std::chrono::high_resolution_clock::now();
+
+    const auto seconds = std::chrono::duration<double>(stop - start).count();
+    return static_cast<double>(samples.size()) * bench_sample_passes / seconds;
+}
+
+/*
+ * Compares texture sampling throughput and texture memory of the linear,
+ * tiled, block compressed and interleaved formats, using the texel coordinates produced by
+ * the same turntable views draw_scene() animates through.
+ */
+static void bench_texture_formats(render_state& state, model* models, const int model_count)
+{
+    texel_recording_shader recorder;
+    std::vector<texel_sample> samples;
+    recorder.samples = &samples;
+
+    printf("\nTexture format benchmark (%d views per model, MF/s = million fragments sampled per second)\n", bench_view_count);
+    printf(
+        "%-12s %9s %8s %8s %8s %8s %8s %9s %9s %9s\n",
+        "model", "samples", "linear", "bilinear", "tiled", "bc", "packed", "rgba KB", "bc KB", "packed KB"
+    );
+
+    for (auto i = 0; i < model_count; i++)
+    {
+        auto& obj = models[i];
+        samples.clear();
+
+        for (auto view = 0; view < bench_view_count; view++)
+        {
+            const auto rot_y_deg = 360.0f * static_cast<float>(view) / bench_view_count;
+            const auto rot_x_deg = std::abs(std::cos(static_cast<float>(view))) * 25 + 10;
+
+            state.model_view = look_at(state.eye, state.center, state.up) * rot_x(rot_x_deg) * rot_y(rot_y_deg);
+
+            draw_model(obj, state, recorder);
+            clear_output_buffers(state.output_buffers, white);
+        }
+
+        unsigned checksum = 0;
+
+        set_model_texture_layout(obj, image_layout::linear);
+        const auto linear_rate = time_texel_samples(samples, checksum);
+        const auto bilinear_rate = time_texel_samples(samples, checksum, filter_mode::bilinear);
+        const auto rgba_bytes = model_texture_bytes(obj);
+
+        std::vector<image> originals;
+        compress_model_textures(obj, originals);
+        const auto compressed_rate = time_texel_samples(samples, checksum);
+        const auto compressed_bytes = model_texture_bytes(obj);
+        restore_model_textures(obj, originals);
+
+        pack_model_materials(obj, true);
+        const auto packed_rate = time_texel_samples(samples, checksum);
+        const auto packed_bytes = model_material_bytes(obj);
+        pack_model_materials(obj, false);
+
+        set_model_texture_layout(obj, image_layout::tiled);
+        const auto tiled_rate = time_texel_samples(samples, checksum);
+
+        printf(
+            "%-12s %9u %8.1f %8.1f %8.1f %8.1f %8.1f %9u %9u %9u   (checksum %u)\n",
+            obj.name != nullptr ? obj.name : "?",
+            static_cast<unsigned>(samples.size()),
+            linear_rate / 1e6,
+            bilinear_rate / 1e6,
+            tiled_rate / 1e6,
+            compressed_rate / 1e6,
+            packed_rate / 1e6,
+            static_cast<unsigned>(rgba_bytes / 1024),
+            static_cast<unsigned>(compressed_bytes / 1024),
+            static_cast<unsigned>(packed_bytes / 1024),
+            checksum
+        );
+    }
+}
+
+static void empty_job(void* data, int begin, int end)
+{
+}
+
+/*
+ * Cost of the job system itself: queueing and waiting on jobs that do
+ * nothing, splitting a cheap loop with parallel_for at a few grain sizes, and
+ * for comparison starting a thread per band the way row bands used to run.
+ */
+static void bench_job_system()
+{
+    static const int job_batch = 64;
+    static const int job_rounds = 2000;
+    static const int loop_count = 1 << 20;
+
+    printf("\nJob system benchmark (%d threads)\n", job_thread_count());
+
+    job jobs[job_batch];
+    for (auto& j : jobs) j.function = empty_job;
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (auto round = 0; round < job_rounds; round++)
+    {
+        job_counter counter;
+        run_jobs(jobs, job_batch, counter);
+        wait_for_counter(counter);
+    }
+    auto stop = std::chrono::high_resolution_clock::now();
+
+    const auto empty_ns = std::chrono::duration<double, std::nano>(stop - start).count() / (job_batch * job_rounds);
+    printf("%-28s %9.1f ns per job\n", "empty jobs", empty_ns);
+
+    std::vector<float> values(loop_count);
+    for (auto i = 0; i < loop_count; i++) values[i] = static_cast<float>(i);
+
+    const int grains[] = { 0, 1024, 16384, 131072 };
+    std::vector<double> partial_sums(loop_count);
+
+    for (const auto grain : grains)
+    {
+        auto sum = 0.0;
+
+        start = std::chrono::high_resolution_clock::now();
+        for (auto round = 0; round < 10; round++)
+        {
+            auto range = [&](const int begin, const int end)
+            {
+                auto partial = 0.0;
+                for (auto i = begin; i < end; i++) partial += std::sqrt(values[i]);
+                partial_sums[begin] = partial;
+            };
+
+            //grain 0 is the plain loop, for the baseline
+            if (grain == 0) range(0, loop_count);
+            else parallel_for(loop_count, grain, range);
+
+            for (auto begin = 0; begin < loop_count; begin += grain == 0 ? loop_count : grain) sum += partial_sums[begin];
+        }
+        stop = std::chrono::high_resolution_clock::now();
+
+        char label[64];
+        snprintf(label, sizeof(label), grain == 0 ? "serial loop" : "parallel_for, grain %d", grain);
+
+        const auto ms = std::chrono::duration<double, std::milli>(stop - start).count() / 10;
+        printf("%-28s %9.3f ms per 1M sqrt   (checksum %.0f)\n", label, ms, sum);
+    }
+
+#if HAS_THREADS
+    const auto thread_count = std::max(2, static_cast<int>(std::thread::hardware_concurrency()));
+    const auto spawn_rounds = 200;
+
+    start = std::chrono::high_resolution_clock::now();
+    for (auto round = 0; round < spawn_rounds; round++)
+    {
+        std::vector<std::thread> threads;
+        for (auto i = 1; i < thread_count; i++) threads.emplace_back([] {});
+        for (auto& thread : threads) thread.join();
+    }
+    stop = std::chrono::high_resolution_clock::now();
+
+    const auto spawn_us = std::chrono::duration<double, std::micro>(stop - start).count() / spawn_rounds;
+    printf("%-28s %9.1f us per %d threads\n", "thread spawn and join", spawn_us, thread_count - 1);
+#endif
+}
+
+void run_benchmarks(render_state& state, model* models, const int model_count)
+{
+    bench_job_system();
+    bench_texture_formats(state, models, model_count);
+}
@@ -0,0 +1,13 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "render.h"
+#include "file.h"
+
+/*
+ * Benchmarks for the renderer internals. These run instead of the app when
+ * it is started with "--bench", and print their results to stdout.
+ */
+void run_benchmarks(render_state& state, model* models, int model_count);
+
+#endif
@@ -0,0 +1,542 @@
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "render.h"
+#include "pixel4.h"
+
+static inline const rgba& pixel_at(const image& img, const int x, const int y)
+{
+    const auto cx = std::max(0, std::min(x, img.width - 1));
+    const auto cy = std::max(0, std::min(y, img.height - 1));
+
+    return reinterpret_cast<const rgba*>(img.data)[cy * img.width + cx];
+}
+
+/*
+ * Weights red and blue equally, so the result doesn't depend on which of
+ * rgba or bgra the buffer is in.
+ */
+static inline float effect_luma(const rgba& p)
+{
+    return (p.e[0] * 0.25f + p.e[1] * 0.5f + p.e[2] * 0.25f) * (1.0f / 255);
+}
+
+/*
+ * Fast approximate anti-aliasing, after FXAA 3.11's quality preset. Pixels
+ * on a luminance edge are blended with their neighbour across it, by how far
+ * along the edge they are from its nearer end, or by how much they stand out
+ * from their 3x3 neighbourhood for edges a pixel thick.
+ */
+struct fxaa_effect final : public screen_space_effect {
+    //edges with less contrast than this are left alone
+    float edge_threshold = 0.125f;
+    float edge_threshold_min = 0.0312f;
+
+    //how much single pixel features are smoothed
+    float subpixel_quality = 0.75f;
+
+    //how far along an edge to search for its ends
+    int search_steps = 10;
+
+    const char* name() override { return "FXAA"; }
+    int pass_count() override { return 1; }
+
+    void run_pass(int pass, const output_buffers& buffers, const image& source, image& target, const int first_row, const int last_row) override
+    {
+        auto* out = reinterpret_cast<rgba*>(target.data);
+
+        for (auto y = first_row; y < last_row; y++)
+        {
+            for (auto x = 0; x < source.width; x++)
+            {
+                out[y * target.width + x] = anti_alias(source, x, y);
+            }
+        }
+    }
+
+    rgba anti_alias(const image& source, const int x, const int y) const
+    {
+        const auto& centre = pixel_at(source, x, y);
+
+        const auto luma_m = effect_luma(centre);
+        const auto luma_n = effect_luma(pixel_at(source, x, y - 1));
+        const auto luma_s = effect_luma(pixel_at(source, x, y + 1));
+        const auto luma_w = effect_luma(pixel_at(source, x - 1, y));
+        const auto luma_e = effect_luma(pixel_at(source, x + 1, y));
+
+        const auto luma_min = std::min(luma_m, std::min(std::min(luma_n, luma_s), std::min(luma_w, luma_e)));
+        const auto luma_max = std::max(luma_m, std::max(std::max(luma_n, luma_s), std::max(luma_w, luma_e)));
+        const auto range = luma_max - luma_min;
+
+        //not an edge, or too faint to matter
+        if (range < std::max(edge_threshold_min, luma_max * edge_threshold)) return centre;
+
+        const auto luma_nw = effect_luma(pixel_at(source, x - 1, y - 1));
+        const auto luma_ne = effect_luma(pixel_at(source, x + 1, y - 1));
+        const auto luma_sw = effect_luma(pixel_at(source, x - 1, y + 1));
+        const auto luma_se = effect_luma(pixel_at(source, x + 1, y + 1));
+
+        //how much the pixel stands out from its neighbourhood
+        const auto average = (2 * (luma_n + luma_s + luma_w + luma_e) + luma_nw + luma_ne + luma_sw + luma_se) / 12;
+        auto subpixel = std::min(1.0f, std::abs(average - luma_m) / range);
+        subpixel = subpixel * subpixel * (3 - 2 * subpixel);
+        subpixel = subpixel * subpixel * subpixel_quality;
+
+        //an edge running left to right changes most going up or down
+        const auto horizontal_change =
+            std::abs(luma_nw + luma_sw - 2 * luma_w) +
+            std::abs(luma_n + luma_s - 2 * luma_m) * 2 +
+            std::abs(luma_ne + luma_se - 2 * luma_e);
+        const auto vertical_change =
+            std::abs(luma_nw + luma_ne - 2 * luma_n) +
+            std::abs(luma_w + luma_e - 2 * luma_m) * 2 +
+            std::abs(luma_sw + luma_se - 2 * luma_s);
+        const auto horizontal = horizontal_change >= vertical_change;
+
+        //pick the side of the edge with the steeper gradient
+        const auto luma_before = horizontal ? luma_n : luma_w;
+        const auto luma_after = horizontal ? luma_s : luma_e;
+        const auto gradient_before = luma_before - luma_m;
+        const auto gradient_after = luma_after - luma_m;
+
+        const auto steeper_after = std::abs(gradient_after) > std::abs(gradient_before);
+        const auto side_step = steeper_after ? 1 : -1;
+        const auto gradient_scaled = 0.25f * std::max(std::abs(gradient_before), std::abs(gradient_after));
+        const auto luma_local = 0.5f * ((steeper_after ? luma_after : luma_before) + luma_m);
+
+        //the edge lies between this pixel and the one at (side_x, side_y) away
+        const auto side_x = horizontal ? 0 : side_step;
+        const auto side_y = horizontal ? side_step : 0;
+        const auto along_x = horizontal ? 1 : 0;
+        const auto along_y = horizontal ? 0 : 1;
+
+        const auto edge_luma = [&](const int offset)
+        {
+            const auto px = x + along_x * offset;
+            const auto py = y + along_y * offset;
+
+            return 0.5f * (effect_luma(pixel_at(source, px, py)) + effect_luma(pixel_at(source, px + side_x, py + side_y))) - luma_local;
+        };
+
+        //walk both ways along the edge until the luminance leaves it
+        auto distance_before = search_steps;
+        auto distance_after = search_steps;
+        auto end_before = 0.0f;
+        auto end_after = 0.0f;
+
+        for (auto step = 1; step <= search_steps; step++)
+        {
+            end_before = edge_luma(-step);
+            if (std::abs(end_before) >= gradient_scaled)
+            {
+                distance_before = step;
+                break;
+            }
+        }
+
+        for (auto step = 1; step <= search_steps; step++)
+        {
+            end_after = edge_luma(step);
+            if (std::abs(end_after) >= gradient_scaled)
+            {
+                distance_after = step;
+                break;
+            }
+        }
+
+        const auto nearer_before = distance_before < distance_after;
+        const auto distance = std::min(distance_before, distance_after);
+        const auto edge_length = static_cast<float>(distance_before + distance_after);
+
+        //only blend when the nearer end goes the opposite way to this pixel
+        const auto end_luma = nearer_before ? end_before : end_after;
+        const auto correct_variation = (end_luma < 0) != (luma_m < luma_local);
+
+        const auto edge_blend = correct_variation ? 0.5f - static_cast<float>(distance) / edge_length : 0.0f;
+        const auto blend = std::max(edge_blend, subpixel);
+
+        if (blend <= 0) return centre;
+
+        const auto m = load_pixel(centre);
+        const auto across = load_pixel(pixel_at(source, x + side_x, y + side_y));
+
+        return store_pixel(m + (across - m) * splat(blend));
+    }
+};
+
+/*
+ * Separable gaussian blur, a horizontal then a vertical pass.
+ */
+static const int max_blur_radius = 8;
+
+struct blur_effect final : public screen_space_effect {
+    int radius{};
+    float weights[max_blur_radius + 1]{};
+
+    explicit blur_effect(const int blur_radius = 4, const float sigma = 2.0f)
+    {
+        assert(blur_radius > 0 && blur_radius <= max_blur_radius);
+        radius = blur_radius;
+
+        auto total = 0.0f;
+        for (auto i = 0; i <= radius; i++)
+        {
+            weights[i] = std::exp(-static_cast<float>(i * i) / (2 * sigma * sigma));
+            total += i == 0 ? weights[i] : weights[i] * 2;
+        }
+
+        for (auto i = 0; i <= radius; i++) weights[i] /= total;
+    }
+
+    const char* name() override { return "Blur"; }
+    int pass_count() override { return 2; }
+
+    void run_pass(const int pass, const output_buffers& buffers, const image& source, image& target, const int first_row, const int last_row) override
+    {
+        const auto step_x = pass == 0 ? 1 : 0;
+        const auto step_y = pass == 0 ? 0 : 1;
+
+        auto* out = reinterpret_cast<rgba*>(target.data);
+
+        for (auto y = first_row; y < last_row; y++)
+        {
+            for (auto x = 0; x < source.width; x++)
+            {
+                auto sum = load_pixel(pixel_at(source, x, y)) * splat(weights[0]);
+
+                for (auto i = 1; i <= radius; i++)
+                {
+                    const auto before = load_pixel(pixel_at(source, x - step_x * i, y - step_y * i));
+                    const auto after = load_pixel(pixel_at(source, x + step_x * i, y + step_y * i));
+
+                    sum = sum + (before + after) * splat(weights[i]);
+                }
+
+                out[y * target.width + x] = store_pixel(sum);
+            }
+        }
+    }
+};
+
+/*
+ * Screen space ambient occlusion from the z buffer. Occlusion is estimated
+ * at half resolution from pairs of depth samples mirrored about each pixel,
+ * in a small disc rotated per pixel in a 4x4 pattern. Comparing a pair's
+ * average with the pixel measures curvature, so open slopes don't darken
+ * themselves while creases and geometry in front do. A depth aware 4x4 blur then
+ * removes the pattern, and the result is upsampled bilaterally so it doesn't
+ * bleed across silhouettes before darkening the frame.
+ */
+static const int ssao_kernel_size = 8;
+static const int ssao_rotations = 16;
+
+struct ssao_effect final : public screen_space_effect {
+    //kernel radius in half resolution pixels
+    float radius = 6;
+
+    //curvature needs to pass the bias to count and is full occlusion a quarter of the range past it,
+    //samples further in front than the range fade out so distant geometry doesn't cast halos
+    float depth_bias = 0.005f;
+    float depth_range = 0.15f;
+
+    //how dark full occlusion gets
+    float strength = 0.8f;
+
+    //offsets in a unit disc, the second half mirrors the first
+    float kernel_x[ssao_kernel_size]{};
+    float kernel_y[ssao_kernel_size]{};
+    float rotation_cos[ssao_rotations]{};
+    float rotation_sin[ssao_rotations]{};
+
+    //half resolution scratch, sized in prepare()
+    int half_width{}, half_height{};
+    std::vector<float> half_depth;
+    std::vector<float> occlusion;
+    std::vector<float> blurred;
+
+    ssao_effect()
+    {
+        enabled = false;
+
+        const auto pairs = ssao_kernel_size / 2;
+
+        for (auto i = 0; i < pairs; i++)
+        {
+            const auto angle = static_cast<float>(i) * 3.14159265f / pairs;
+            const auto length = (static_cast<float>(i) + 1) / pairs;
+
+            kernel_x[i] = std::cos(angle) * length;
+            kernel_y[i] = std::sin(angle) * length;
+            kernel_x[i + pairs] = -kernel_x[i];
+            kernel_y[i + pairs] = -kernel_y[i];
+        }
+
+        //visit the rotations in a dithered order so neighbouring pixels differ the most
+        static const int dither[ssao_rotations] = { 0, 8, 2, 10, 12, 4, 14, 6, 3, 11, 1, 9, 15, 7, 13, 5 };
+
+        for (auto i = 0; i < ssao_rotations; i++)
+        {
+            const auto angle = static_cast<float>(dither[i]) * 3.14159265f / ssao_rotations;
+
+            rotation_cos[i] = std::cos(angle);
+            rotation_sin[i] = std::sin(angle);
+        }
+    }
+
+    const char* name() override { return "SSAO"; }
+    int pass_count() override { return 3; }
+
+    void prepare(const output_buffers& buffers) override
+    {
+        half_width = (buffers.frame_buffer.width + 1) / 2;
+        half_height = (buffers.frame_buffer.height + 1) / 2;
+
+        const auto size = static_cast<size_t>(half_width) * half_height;
+        half_depth.resize(size);
+        occlusion.resize(size);
+        blurred.resize(size);
+    }
+
+    //the first two passes only fill the half resolution scratch
+    bool writes_target(const int pass) override { return pass == 2; }
+
+    int pass_rows(const int pass, const output_buffers& buffers) override
+    {
+        return pass == 2 ? buffers.frame_buffer.height : half_height;
+    }
+
+    void run_pass(const int pass, const output_buffers& buffers, const image& source, image& target, const int first_row, const int last_row) override
+    {
+        switch (pass)
+        {
+        case 0:
+            downsample_depth(buffers, first_row, last_row);
+            estimate_occlusion(buffers, first_row, last_row);
+            break;
+
+        case 1:
+            blur_occlusion(first_row, last_row);
+            break;
+
+        default:
+            apply_occlusion(buffers, source, target, first_row, last_row);
+            break;
+        }
+    }
+
+    static bool is_background(const float depth)
+    {
+        return depth <= min_z_buffer_val + 1;
+    }
+
+    void downsample_depth(const output_buffers& buffers, const int first_row, const int last_row)
+    {
+        const auto& frame_buffer = buffers.frame_buffer;
+
+        for (auto y = first_row; y < last_row; y++)
+        {
+            const auto* row = buffers.z_buffer + std::min(y * 2, frame_buffer.height - 1) * frame_buffer.width;
+
+            for (auto x = 0; x < half_width; x++)
+            {
+                half_depth[y * half_width + x] = row[std::min(x * 2, frame_buffer.width - 1)];
+            }
+        }
+    }
+
+    /*
+     * Kernel samples reach into rows other bands are still downsampling, so
+     * they read the full resolution z buffer at half resolution coordinates.
+     */
+    float full_depth(const output_buffers& buffers, const int half_x, const int half_y) const
+    {
+        const auto& frame_buffer = buffers.frame_buffer;
+        const auto x = std::max(0, std::min(half_x * 2, frame_buffer.width - 1));
+        const auto y = std::max(0, std::min(half_y * 2, frame_buffer.height - 1));
+
+        return buffers.z_buffer[y * frame_buffer.width + x];
+    }
+
+    void estimate_occlusion(const output_buffers& buffers, const int first_row, const int last_row)
+    {
+        for (auto y = first_row; y < last_row; y++)
+        {
+            for (auto x = 0; x < half_width; x++)
+            {
+                const auto depth = full_depth(buffers, x, y);
+
+                if (is_background(depth))
+                {
+                    occlusion[y * half_width + x] = 0;
+                    continue;
+                }
+
+                const auto rotation = (y & 3) * 4 + (x & 3);
+                const auto c = rotation_cos[rotation] * radius;
+                const auto s = rotation_sin[rotation] * radius;
+
+                float samples[ssao_kernel_size];
+                for (auto i = 0; i < ssao_kernel_size; i++)
+                {
+                    const auto offset_x = kernel_x[i] * c - kernel_y[i] * s;
+                    const auto offset_y = kernel_x[i] * s + kernel_y[i] * c;
+
+                    samples[i] = full_depth(
+                        buffers,
+                        x + static_cast<int>(std::lround(offset_x)),
+                        y + static_cast<int>(std::lround(offset_y))
+                    );
+                }
+
+                occlusion[y * half_width + x] = occlusion_from_samples(depth, samples);
+            }
+        }
+    }
+
+    /*
+     * Average occlusion of the sample pairs, larger depths are closer to the
+     * camera. A pair whose nearer sample is past the range fades out rather
+     * than stopping dead.
+     */
+    float occlusion_from_samples(const float depth, const float samples[ssao_kernel_size]) const
+    {
+        static_assert(ssao_kernel_size == 8, "the SSE2 path handles exactly 4 pairs");
+
+        const auto ramp = 4 / depth_range;
+
+#if HAS_SSE2
+        const auto centre = _mm_set1_ps(depth);
+        const auto zero = _mm_setzero_ps();
+        const auto one = _mm_set1_ps(1);
+
+        const auto first = _mm_sub_ps(_mm_loadu_ps(samples), centre);
+        const auto second = _mm_sub_ps(_mm_loadu_ps(samples + 4), centre);
+
+        const auto curvature = _mm_mul_ps(_mm_add_ps(first, second), _mm_set1_ps(0.5f));
+        const auto amount = _mm_mul_ps(_mm_sub_ps(curvature, _mm_set1_ps(depth_bias)), _mm_set1_ps(ramp));
+        const auto occluded = _mm_min_ps(one, _mm_max_ps(zero, amount));
+
+        //1 inside the range, fading to 0 over the next range's worth
+        const auto nearest = _mm_max_ps(first, second);
+        const auto falloff = _mm_sub_ps(_mm_set1_ps(2), _mm_mul_ps(nearest, _mm_set1_ps(1.0f / depth_range)));
+        const auto total = _mm_mul_ps(occluded, _mm_min_ps(one, _mm_max_ps(zero, falloff)));
+
+        float lanes[4];
+        _mm_storeu_ps(lanes, total);
+
+        return (lanes[0] + lanes[1] + lanes[2] + lanes[3]) / 4;
+#else
+        auto total = 0.0f;
+
+        for (auto i = 0; i < 4; i++)
+        {
+            const auto first = samples[i] - depth;
+            const auto second = samples[i + 4] - depth;
+
+            const auto curvature = (first + second) * 0.5f;
+            const auto occluded = std::min(1.0f, std::max(0.0f, (curvature - depth_bias) * ramp));
+            const auto falloff = std::min(1.0f, std::max(0.0f, 2 - std::max(first, second) / depth_range));
+
+            total += occluded * falloff;
+        }
+
+        return total / 4;
+#endif
+    }
+
+    /*
+     * A 4x4 box covers one of each kernel rotation. Samples across a depth
+     * discontinuity are left out so occlusion doesn't leak onto the background.
+     */
+    void blur_occlusion(const int first_row, const int last_row)
+    {
+        for (auto y = first_row; y < last_row; y++)
+        {
+            for (auto x = 0; x < half_width; x++)
+            {
+                const auto depth = half_depth[y * half_width + x];
+
+                auto total = 0.0f;
+                auto count = 0;
+
+                for (auto dy = -2; dy < 2; dy++)
+                {
+                    const auto sy = std::max(0, std::min(y + dy, half_height - 1));
+
+                    for (auto dx = -2; dx < 2; dx++)
+                    {
+                        const auto sx = std::max(0, std::min(x + dx, half_width - 1));
+                        const auto index = sy * half_width + sx;
+
+                        if (std::abs(half_depth[index] - depth) > depth_range) continue;
+
+                        total += occlusion[index];
+                        count++;
+                    }
+                }
+
+                blurred[y * half_width + x] = count > 0 ? total / static_cast<float>(count) : 0;
+            }
+        }
+    }
+
+    /*
+     * Weighs the 4 nearest half resolution values by both distance and how
+     * close their depth is to this pixel's, then darkens the pixel.
+     */
+    void apply_occlusion(const output_buffers& buffers, const image& source, image& target, const int first_row, const int last_row) const
+    {
+        const auto* in = reinterpret_cast<const rgba*>(source.data);
+        auto* out = reinterpret_cast<rgba*>(target.data);
+
+        for (auto y = first_row; y < last_row; y++)
+        {
+            const auto half_y = std::max(0.0f, (static_cast<float>(y) + 0.5f) * 0.5f - 0.5f);
+            const auto y0 = std::min(static_cast<int>(half_y), half_height - 1);
+            const auto y1 = std::min(y0 + 1, half_height - 1);
+            const auto frac_y = half_y - static_cast<float>(y0);
+
+            for (auto x = 0; x < source.width; x++)
+            {
+                const auto index = y * source.width + x;
+                const auto depth = buffers.z_buffer[index];
+
+                if (is_background(depth))
+                {
+                    out[index] = in[index];
+                    continue;
+                }
+
+                const auto half_x = std::max(0.0f, (static_cast<float>(x) + 0.5f) * 0.5f - 0.5f);
+                const auto x0 = std::min(static_cast<int>(half_x), half_width - 1);
+                const auto x1 = std::min(x0 + 1, half_width - 1);
+                const auto frac_x = half_x - static_cast<float>(x0);
+
+                const int indices[4] = { y0 * half_width + x0, y0 * half_width + x1, y1 * half_width + x0, y1 * half_width + x1 };
+                const float bilinear[4] = {
+                    (1 - frac_x) * (1 - frac_y), frac_x * (1 - frac_y),
+                    (1 - frac_x) * frac_y, frac_x * frac_y
+                };
+
+                auto total = 0.0f;
+                auto weights = 0.0f;
+
+                for (auto i = 0; i < 4; i++)
+                {
+                    const auto depth_weight = 1.0f / (depth_bias + std::abs(half_depth[indices[i]] - depth));
+                    const auto weight = bilinear[i] * depth_weight + 1e-5f;
+
+                    total += blurred[indices[i]] * weight;
+                    weights += weight;
+                }
+
+                const auto ambient = 1 - strength * total / weights;
+
+                auto shaded = load_pixel(in[index]) * splat(ambient);
+                out[index] = store_pixel(shaded);
+                out[index].a = in[index].a;
+            }
+        }
+    }
+};
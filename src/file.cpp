@@ -1,7 +1,12 @@
+#include <chrono>
+#include <cstdint>
 #include <cstdio>
 #include <cstring>
+#include <vector>
+#include <sys/stat.h>
 
 #include "file.h"
+#include "mesh_codec.h"
 #include "platform_specific.h"
 
 static void concat_strings(
@@ -98,7 +103,28 @@ static v3 read_v3_checked(FILE* f)
     return v;
 }
 
-void read_mesh(const char* path, mesh& out)
+/*
+ * The counterparts of the readers above, for writing conf and .bin files.
+ */
+template <typename T>
+static bool write_values(FILE* f, const T* values, const size_t count)
+{
+    return count == 0 || fwrite(values, sizeof(T), count, f) == count;
+}
+
+static bool write_int(FILE* f, const int value)
+{
+    return write_values(f, &value, 1);
+}
+
+static bool write_string(FILE* f, const char* str)
+{
+    //null is stored as an empty length, anything else with its terminator
+    const auto length = str != nullptr ? static_cast<int>(strlen(str) + 1) : 0;
+    return write_int(f, length) && write_values(f, str, length);
+}
+
+static void copy_mesh(const char* path, mesh& out)
 {
     FILE * f = nullptr;
     open_binary_file(path, f);
@@ -161,22 +187,498 @@ void read_mesh(const char* path, mesh& out)
     }
     
     fclose(f);
+}
+
+/*
+ * Points out at the count prefixed array at offset in a mesh file held in
+ * memory and moves offset past it, or fails if the file is too short.
+ */
+template <typename T>
+static bool map_mesh_array(const unsigned char* data, const size_t size, size_t& offset, T*& out, size_t& count)
+{
+    //every field is 4 bytes, so each array starts 4 byte aligned if the file does
+    static_assert(sizeof(T) % sizeof(int) == 0 && alignof(T) <= alignof(int), "mesh arrays must keep the file aligned");
+
+    auto stored_count = 0;
+    if (size - offset < sizeof(stored_count)) return false;
+
+    memcpy(&stored_count, data + offset, sizeof(stored_count));
+    offset += sizeof(stored_count);
+
+    if (stored_count < 0 || (size - offset) / sizeof(T) < static_cast<size_t>(stored_count)) return false;
+
+    out = reinterpret_cast<T*>(const_cast<unsigned char*>(data) + offset);
+    count = static_cast<size_t>(stored_count);
+    offset += sizeof(T) * count;
+
+    return true;
+}
+
+/*
+ * Points the mesh's arrays into a .bin file held in memory, which must be
+ * at least 4 byte aligned.
+ */
+static bool map_mesh_arrays(const unsigned char* data, const size_t size, mesh& out)
+{
+    assert(reinterpret_cast<uintptr_t>(data) % alignof(int) == 0);
+
+    size_t offset = 0;
+
+    const auto mapped =
+        map_mesh_array(data, size, offset, out.verts, out.vert_count) &&
+        map_mesh_array(data, size, offset, out.faces, out.face_count) &&
+        map_mesh_array(data, size, offset, out.uvs, out.uv_count) &&
+        map_mesh_array(data, size, offset, out.normals, out.normal_count);
+
+    if (!mapped)
+    {
+        out.verts = nullptr;
+        out.faces = nullptr;
+        out.uvs = nullptr;
+        out.normals = nullptr;
+    }
+
+    return mapped;
+}
+
+static bool map_mesh(const char* path, mesh& out)
+{
+    mapped_file file;
+    if (!map_file(path, file)) return false;
+
+    if (!map_mesh_arrays(file.data, file.size, out))
+    {
+        unmap_file(file);
+        return false;
+    }
+
+    out.geometry_file = file;
+    return true;
+}
+
+static void print_mesh_counts(const char* how, const mesh& mesh)
+{
+    printf(
+        "%s Bin: V:%u F:%u UV:%u N:%u\n",
+        how,
+        static_cast<unsigned>(mesh.vert_count),
+        static_cast<unsigned>(mesh.face_count),
+        static_cast<unsigned>(mesh.uv_count),
+        static_cast<unsigned>(mesh.normal_count)
+    );
+}
+
+/*
+ * A .bin file is a count prefixed array of each of verts, faces, uvs and
+ * normals, stored exactly as they are laid out in memory. The file is mapped
+ * and the mesh points straight into it, so loading costs nothing up front
+ * and the pages are shared by every process rendering the same assets.
+ * Meshes are copied out with fread instead where mapping fails.
+ */
+void read_mesh(const char* path, mesh& out)
+{
+    const auto mapped = map_mesh(path, out);
+    if (!mapped) copy_mesh(path, out);
+
+    print_mesh_counts(mapped ? "Mapped" : "Loaded", out);
+}
+
+static bool stat_mesh_source(const char* path, quantized_mesh_source& out)
+{
+    struct stat source_stat{};
+    if (stat(path, &source_stat) != 0) return false;
+
+    out.size = static_cast<uint64_t>(source_stat.st_size);
+    out.mtime = static_cast<int64_t>(source_stat.st_mtime);
+
+    return true;
+}
+
+/*
+ * Decodes the .qmsh written next to a .bin by quantize_meshes(), if there is
+ * one and it was made from the .bin as it is now, see mesh_codec.h. Without
+ * the .bin the .qmsh is used as it is.
+ */
+static bool read_quantized_mesh(const char* path, const char* bin_path, mesh& out)
+{
+    mapped_file file;
+    if (!map_file(path, file)) return false;
+
+    quantized_mesh_source made_from{};
+    quantized_mesh_source current{};
+
+    if (
+        read_quantized_mesh_source(file.data, file.size, made_from) && stat_mesh_source(bin_path, current) &&
+        (made_from.size != current.size || made_from.mtime != current.mtime)
+    )
+    {
+        printf("%s is older than %s, run --quantize-meshes again to update it.\n", path, bin_path);
+        unmap_file(file);
+        return false;
+    }
+
+    const auto decoded = decode_quantized_mesh(file.data, file.size, out);
+    unmap_file(file);
+
+    if (!decoded)
+    {
+        printf("%s is damaged.\n", path);
+        return false;
+    }
+
+    print_mesh_counts("Decoded", out);
+    return true;
+}
+
+bool write_mesh(const char* path, const mesh& mesh)
+{
+    FILE* f = nullptr;
+    create_binary_file(path, f);
+
+    if (f == nullptr)
+    {
+        printf("Could not open %s for writing.\n", path);
+        return false;
+    }
+
+    const auto written =
+        write_int(f, static_cast<int>(mesh.vert_count)) && write_values(f, mesh.verts, mesh.vert_count) &&
+        write_int(f, static_cast<int>(mesh.face_count)) && write_values(f, mesh.faces, mesh.face_count) &&
+        write_int(f, static_cast<int>(mesh.uv_count)) && write_values(f, mesh.uvs, mesh.uv_count) &&
+        write_int(f, static_cast<int>(mesh.normal_count)) && write_values(f, mesh.normals, mesh.normal_count);
+
+    if (fclose(f) != 0 || !written)
+    {
+        printf("Could not write %s.\n", path);
+        return false;
+    }
+
+    return true;
+}
+
+static image_format texture_format(const texture_settings& settings, const image_format compressed_format)
+{
+    return settings.compress && !settings.interleave ? compressed_format : image_format::rgba8;
+}
+
+static image_layout texture_layout(const texture_settings& settings)
+{
+    //the packer reads plain row-major maps
+    return settings.interleave ? image_layout::linear : settings.layout;
+}
+
+/*
+ * A packed texel is twice the size of a diffuse texel, so packing only pays
+ * off when it saves fetches from other maps.
+ */
+bool worth_packing_material(const mesh& mesh)
+{
+    return mesh.diffuse.data != nullptr && (mesh.has_normal_map || mesh.has_specular_map || mesh.has_emissive_map);
+}
+
+static bool load_map(
+    const char* path, image& out, const texture_settings& settings,
+    const image_format compressed_format, const int channel = 0
+)
+{
+    const auto layout = texture_layout(settings);
+    const auto format = texture_format(settings, compressed_format);
+
+    if (settings.registry != nullptr)
+    {
+        return acquire_texture(*settings.registry, path, out, layout, format, channel);
+    }
+
+    return load_image(path, out, layout, format, channel);
+}
+
+static void release_map(image& map, texture_registry* registry)
+{
+    if (registry != nullptr)
+    {
+        release_texture(*registry, map);
+    }
+    else
+    {
+        free_image(map);
+    }
+}
+
+/*
+ * Interleaves a mesh's maps into its material texture and releases the
+ * separate maps.
+ */
+void pack_mesh_material(mesh& mesh, texture_registry* registry)
+{
+    pack_material_texture(
+        mesh.diffuse,
+        mesh.has_normal_map ? &mesh.normal : nullptr,
+        mesh.has_specular_map ? &mesh.spec : nullptr,
+        mesh.has_emissive_map ? &mesh.emission : nullptr,
+        mesh.material
+    );
+
+    release_map(mesh.diffuse, registry);
+    release_map(mesh.normal, registry);
+    release_map(mesh.spec, registry);
+    release_map(mesh.emission, registry);
+
+    mesh.has_material_texture = true;
+}
+
+/*
+ * Creates a virtual texture for a map, or returns null if that fails so the
+ * caller can load the map whole instead.
+ */
+static virtual_texture* load_virtual_map(const char* path, page_cache& cache)
+{
+    auto* tex = new virtual_texture;
+    assert(tex != nullptr);
+
+    if (!load_virtual_texture(path, cache, *tex))
+    {
+        delete tex;
+        return nullptr;
+    }
+
+    return tex;
+}
+
+/*
+ * A mesh being loaded, the data of each of its load jobs.
+ */
+struct mesh_load
+{
+    model_loader* loader{};
+    mesh* target{};
+
+    //where the mesh's files are when loading from an archive
+    const archive_mesh* packed{};
+
+    //maps still decoding, the last one to finish packs the material
+    std::atomic<int> maps_left{};
+};
+
+enum class mesh_map
+{
+    diffuse,
+    normal,
+    spec,
+    emission
+};
+
+static virtual_texture* load_virtual_map_locked(const char* path, model_loader& loader)
+{
+#if HAS_THREADS
+    std::lock_guard<std::mutex> lock(loader.virtual_lock);
+#endif
+
+    return load_virtual_map(path, *loader.settings.virtual_cache);
+}
+
+/*
+ * Loads one of the mesh's maps whole, from its file or from the archive.
+ */
+static bool load_whole_map(
+    const mesh_load& load, const mesh_map map, const char* path, image& out,
+    const image_format compressed_format, const int channel = 0
+)
+{
+    const auto& settings = load.loader->settings;
+
+    if (load.packed == nullptr) return load_map(path, out, settings, compressed_format, channel);
+
+    const auto& archive = load.loader->archive;
+    const auto blob = load.packed->maps[static_cast<int>(map)];
+    const auto* bytes = archive_blob_data(archive, blob);
+    const auto size = static_cast<size_t>(archive.blobs[blob].size);
+
+    const auto layout = texture_layout(settings);
+    const auto format = texture_format(settings, compressed_format);
+
+    if (settings.registry != nullptr)
+    {
+        return acquire_texture_bytes(*settings.registry, path, bytes, size, out, layout, format, channel);
+    }
+
+    return decode_image(bytes, size, out, layout, format, channel);
+}
+
+/*
+ * Leaves out an optional map that couldn't be loaded, the mesh is shaded
+ * without it.
+ */
+static void drop_map(const char* path, image& map, bool& has_map)
+{
+    printf("Could not load %s, drawing without it.\n", path);
+
+    map = image{};
+    has_map = false;
+}
+
+/*
+ * Virtual textures page from a file built next to the map's original path,
+ * so with an archive they only work while the loose files are around too.
+ *
+ * A mesh whose diffuse map can't be loaded is left untextured, and
+ * draw_model() skips it.
+ */
+static void load_mesh_map(const mesh_load& load, const mesh_map map)
+{
+    auto& loader = *load.loader;
+    auto& mesh = *load.target;
+    const auto use_virtual = loader.settings.virtual_cache != nullptr;
+
+    switch (map)
+    {
+    case mesh_map::diffuse:
+        if (use_virtual) mesh.virtual_diffuse = load_virtual_map_locked(mesh.diffuse_path, loader);
+
+        if (mesh.virtual_diffuse == nullptr && !load_whole_map(load, map, mesh.diffuse_path, mesh.diffuse, image_format::bc1))
+        {
+            printf("Could not load %s, the mesh using it won't be drawn.\n", mesh.diffuse_path);
+            mesh.diffuse = image{};
+        }
+        break;
+
+    case mesh_map::normal:
+        if (use_virtual) mesh.virtual_normal = load_virtual_map_locked(mesh.normal_path, loader);
+
+        if (mesh.virtual_normal == nullptr && !load_whole_map(load, map, mesh.normal_path, mesh.normal, image_format::bc5))
+        {
+            drop_map(mesh.normal_path, mesh.normal, mesh.has_normal_map);
+        }
+        break;
+
+    case mesh_map::spec:
+        //the shader reads specular power from the blue channel
+        if (use_virtual) mesh.virtual_spec = load_virtual_map_locked(mesh.specular_path, loader);
+
+        if (mesh.virtual_spec == nullptr && !load_whole_map(load, map, mesh.specular_path, mesh.spec, image_format::bc4, 2))
+        {
+            drop_map(mesh.specular_path, mesh.spec, mesh.has_specular_map);
+        }
+        break;
+
+    case mesh_map::emission:
+        if (!load_whole_map(load, map, mesh.emission_path, mesh.emission, image_format::bc1))
+        {
+            drop_map(mesh.emission_path, mesh.emission, mesh.has_emissive_map);
+        }
+        break;
+    }
+}
+
+static void finish_mesh_textures(mesh& mesh, const texture_settings& settings)
+{
+    //packing needs every map loaded whole
+    const auto has_virtual_maps = mesh.virtual_diffuse != nullptr || mesh.virtual_normal != nullptr || mesh.virtual_spec != nullptr;
+
+    if (settings.interleave && !has_virtual_maps && worth_packing_material(mesh))
+    {
+        pack_mesh_material(mesh, settings.registry);
+    }
+}
+
+static void print_texture_totals(const texture_registry& registry)
+{
+#if HAS_THREADS
+    std::unique_lock<std::mutex> lock(registry.lock);
+#endif
+
+    const auto decoded = registry.decoded;
+    const auto cache_hits = registry.cache_hits;
+    const auto path_hits = registry.path_hits;
+    const auto content_hits = registry.content_hits;
+
+#if HAS_THREADS
+    lock.unlock();
+#endif
 
     printf(
-        "Loaded Bin: V:%u F:%u UV:%u N:%u\n",
-        static_cast<unsigned>(out.vert_count),
-        static_cast<unsigned>(out.face_count),
-        static_cast<unsigned>(out.uv_count),
-        static_cast<unsigned>(out.normal_count)
+        "Textures: %u decoded, %u mapped from the cache, %u shared by path, %u shared by content, %u KB\n",
+        static_cast<unsigned>(decoded),
+        static_cast<unsigned>(cache_hits),
+        static_cast<unsigned>(path_hits),
+        static_cast<unsigned>(content_hits),
+        static_cast<unsigned>(registry_texture_bytes(registry) / 1024)
     );
 }
 
+static void finish_load_task(model_loader& loader)
+{
+    if (loader.tasks_left.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+
+    const auto stop = std::chrono::high_resolution_clock::now();
+    const auto duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - loader.start);
 
-void load_models(const char* path, model* & output, int& model_count)
+    printf(
+        "Loaded %d of %d models after %.1f ms\n",
+        loader.models_resident.load(std::memory_order_relaxed), loader.model_count, duration.count() / 1000.0
+    );
+
+    if (loader.settings.registry != nullptr) print_texture_totals(*loader.settings.registry);
+}
+
+static void load_geometry_job(void* data, int, int)
+{
+    auto& load = *static_cast<mesh_load*>(data);
+    auto& mesh = *load.target;
+
+    if (load.packed != nullptr)
+    {
+        const auto& archive = load.loader->archive;
+        const auto blob = load.packed->geometry;
+
+        //a damaged mesh is left empty
+        if (map_mesh_arrays(archive_blob_data(archive, blob), static_cast<size_t>(archive.blobs[blob].size), mesh))
+        {
+            mesh.geometry_in_archive = true;
+            print_mesh_counts("Mapped", mesh);
+        }
+        else
+        {
+            printf("%s is damaged.\n", mesh.geo_path);
+        }
+    }
+    else
+    {
+        char model_bin_path[1024];
+        concat_strings(strlen(mesh.geo_path), mesh.geo_path, strlen(".bin"), ".bin", model_bin_path);
+
+        char quantized_path[1024];
+        snprintf(quantized_path, sizeof(quantized_path), "%s.qmsh", mesh.geo_path);
+
+        if (!read_quantized_mesh(quantized_path, model_bin_path, mesh)) read_mesh(model_bin_path, mesh);
+    }
+
+    finish_load_task(*load.loader);
+}
+
+static void load_map_job(void* data, const int map, int)
+{
+    auto& load = *static_cast<mesh_load*>(data);
+
+    load_mesh_map(load, static_cast<mesh_map>(map));
+
+    if (load.maps_left.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+        finish_mesh_textures(*load.target, load.loader->settings);
+    }
+
+    finish_load_task(*load.loader);
+}
+
+/*
+ * Reads everything the conf file says about each model, without loading
+ * any of the files it refers to. Fails, leaving output and model_count
+ * alone, when the file can't be opened.
+ */
+static bool read_conf(const char* path, model*& output, int& model_count)
 {
     FILE * f = nullptr;
     open_binary_file(path, f);
-    assert(f != nullptr);
+    if (f == nullptr) return false;
  
     //read model count
     model_count = read_int_checked(f);
@@ -226,34 +728,583 @@ void load_models(const char* path, model* & output, int& model_count)
             mesh.has_normal_map = mesh.normal_path != nullptr && strlen(mesh.normal_path) > 0;
 
             mesh.specular_path = read_string_checked(f);
-            mesh.has_specular_map = mesh.specular_path != nullptr && strlen(mesh.normal_path) > 0;
+            mesh.has_specular_map = mesh.specular_path != nullptr && strlen(mesh.specular_path) > 0;
 
             mesh.emission_path = read_string_checked(f);
-            mesh.has_emissive_map = mesh.emission_path != nullptr && strlen(mesh.normal_path) > 0;
+            mesh.has_emissive_map = mesh.emission_path != nullptr && strlen(mesh.emission_path) > 0;
+        }
+    }
+
+    fclose(f);
+    return true;
+}
+
+/*
+ * Fills in the models from an archive's table of contents, the counterpart
+ * of read_conf(). Strings point into the archive.
+ */
+static void read_archive_contents(const asset_archive& archive, model*& output, int& model_count)
+{
+    const auto& header = *archive.header;
+
+    model_count = static_cast<int>(header.model_count);
+
+    output = new model[model_count];
+    assert(output != nullptr);
+
+    for (auto i = 0; i < model_count; i++)
+    {
+        const auto& packed = archive.models[i];
+        auto& model = output[i];
+
+        model.author = archive_string(archive, packed.author);
+        model.name = archive_string(archive, packed.name);
+        model.url = archive_string(archive, packed.url);
+
+        model.background = packed.background;
+        model.text_col = packed.text_col;
+        model.initial_rot = packed.initial_rot;
+
+        model.mesh_count = packed.mesh_count;
+
+        model.meshes = new mesh[model.mesh_count];
+        assert(model.meshes != nullptr);
+
+        for (size_t j = 0; j < model.mesh_count; j++)
+        {
+            const auto& packed_mesh = archive.meshes[packed.first_mesh + j];
+            auto& mesh = model.meshes[j];
+
+            const auto map_path = [&](const mesh_map map)
+            {
+                const auto blob = packed_mesh.maps[static_cast<int>(map)];
+                return blob != archive_none ? archive_string(archive, archive.blobs[blob].path) : nullptr;
+            };
+
+            mesh.allow_lighting = packed_mesh.allow_lighting != 0;
+
+            //only used for naming, the geometry is mapped from the archive
+            mesh.geo_path = archive_string(archive, archive.blobs[packed_mesh.geometry].path);
+
+            mesh.diffuse_path = map_path(mesh_map::diffuse);
+            assert(mesh.diffuse_path != nullptr);
+
+            mesh.normal_path = map_path(mesh_map::normal);
+            mesh.has_normal_map = mesh.normal_path != nullptr;
+
+            mesh.specular_path = map_path(mesh_map::spec);
+            mesh.has_specular_map = mesh.specular_path != nullptr;
+
+            mesh.emission_path = map_path(mesh_map::emission);
+            mesh.has_emissive_map = mesh.emission_path != nullptr;
+        }
+    }
+}
+
+/*
+ * Queues the geometry and map jobs for one model, loads is the model's
+ * first mesh_load.
+ */
+static void queue_model_jobs(model_loader& loader, const model& model, mesh_load* loads, job_counter& counter)
+{
+    std::vector<job> jobs;
+
+    for (size_t i = 0; i < model.mesh_count; i++)
+    {
+        auto& mesh = model.meshes[i];
+        auto& load = loads[i];
+
+        //in mesh_map order
+        const bool has_map[] = { true, mesh.has_normal_map, mesh.has_specular_map, mesh.has_emissive_map };
+
+        load.loader = &loader;
+        load.target = &mesh;
+
+        job geometry{};
+        geometry.function = load_geometry_job;
+        geometry.data = &load;
+        jobs.push_back(geometry);
+
+        for (auto map = 0; map < 4; map++)
+        {
+            if (!has_map[map]) continue;
+
+            load.maps_left.fetch_add(1, std::memory_order_relaxed);
+
+            job texture{};
+            texture.function = load_map_job;
+            texture.data = &load;
+            texture.begin = map;
+            jobs.push_back(texture);
+        }
+    }
+
+    loader.tasks_left.fetch_add(static_cast<int>(jobs.size()), std::memory_order_relaxed);
+
+    //a frame waiting on its own work shouldn't end up decoding textures
+    run_background_jobs(jobs.data(), static_cast<int>(jobs.size()), counter);
+}
+
+bool start_loading_models(
+    const char* path, model*& output, int& model_count, model_loader& loader,
+    const int first_model, const texture_settings& settings
+)
+{
+    loader.start = std::chrono::high_resolution_clock::now();
+    loader.settings = settings;
+
+    //anything that isn't an archive is taken for a conf file
+    const auto from_archive = is_archive(path);
+
+    if (from_archive)
+    {
+        if (!open_archive(path, loader.archive)) return false;
+        read_archive_contents(loader.archive, output, model_count);
+    }
+    else if (!read_conf(path, output, model_count))
+    {
+        return false;
+    }
+
+    assert(first_model >= 0 && first_model < model_count);
+
+    loader.model_count = model_count;
+    loader.model_pending = new job_counter[model_count];
+    loader.models = output;
+
+    loader.residency = new model_residency[model_count];
+    assert(loader.residency != nullptr);
+
+    size_t total_meshes = 0;
+    for (auto i = 0; i < model_count; i++) total_meshes += output[i].mesh_count;
+
+    loader.meshes = new mesh_load[total_meshes];
+    assert(loader.meshes != nullptr);
+
+    auto* loads = loader.meshes;
+
+    for (auto i = 0; i < model_count; i++)
+    {
+        loader.residency[i].loads = loads;
+
+        for (size_t j = 0; j < output[i].mesh_count; j++, loads++)
+        {
+            if (from_archive) loads->packed = &loader.archive.meshes[loader.archive.models[i].first_mesh + j];
+        }
+    }
+
+    //every job queued here is counted before any can finish, so the totals print once for them
+    loader.tasks_left.store(1, std::memory_order_relaxed);
+
+    use_model(loader, first_model);
+    wait_for_counter(loader.model_pending[first_model]);
+
+    if (settings.virtual_cache != nullptr)
+    {
+        for (auto i = 0; i < model_count; i++) use_model(loader, i);
+        wait_for_models(loader);
+    }
+
+    finish_load_task(loader);
+
+    return true;
+}
+
+bool model_loaded(const model_loader& loader, const int model_idx)
+{
+    assert(model_idx >= 0 && model_idx < loader.model_count);
+
+    return
+        loader.residency[model_idx].resident &&
+        loader.model_pending[model_idx].pending.load(std::memory_order_acquire) == 0;
+}
+
+static void queue_model(model_loader& loader, const int model_idx)
+{
+    assert(model_idx >= 0 && model_idx < loader.model_count);
+
+    auto& residency = loader.residency[model_idx];
+    if (residency.resident) return;
+
+    residency.resident = true;
+    loader.models_resident.fetch_add(1, std::memory_order_relaxed);
+
+    queue_model_jobs(loader, loader.models[model_idx], residency.loads, loader.model_pending[model_idx]);
+}
+
+void use_model(model_loader& loader, const int model_idx)
+{
+    queue_model(loader, model_idx);
+    loader.residency[model_idx].last_used = ++loader.use_clock;
+}
+
+void prefetch_model(model_loader& loader, const int model_idx)
+{
+    assert(model_idx >= 0 && model_idx < loader.model_count);
+
+    const auto budget_spent = loader.memory_budget > 0 && loader.loaded_bytes >= loader.memory_budget;
+    if (budget_spent && !loader.residency[model_idx].resident) return;
+
+    use_model(loader, model_idx);
+}
+
+static size_t map_bytes(const image& map)
+{
+    return map.data != nullptr ? image_data_size(map) : 0;
+}
+
+static size_t model_bytes(const model& model)
+{
+    size_t bytes = 0;
+
+    for (size_t i = 0; i < model.mesh_count; i++)
+    {
+        const auto& mesh = model.meshes[i];
+
+        bytes +=
+            sizeof(v3) * mesh.vert_count + sizeof(v3) * mesh.normal_count +
+            sizeof(v2) * mesh.uv_count + sizeof(face) * mesh.face_count;
+
+        bytes += map_bytes(mesh.diffuse) + map_bytes(mesh.normal) + map_bytes(mesh.spec) + map_bytes(mesh.emission);
+
+        if (mesh.has_material_texture)
+        {
+            bytes += sizeof(material_texel) * mesh.material.width * mesh.material.height;
+        }
+    }
+
+    return bytes;
+}
+
+void trim_models(model_loader& loader)
+{
+    //anything used after this was used since the last trim
+    const auto last_trim = loader.trim_clock;
+    loader.trim_clock = loader.use_clock;
+
+    loader.loaded_bytes = 0;
+
+    for (auto i = 0; i < loader.model_count; i++)
+    {
+        if (model_loaded(loader, i)) loader.loaded_bytes += model_bytes(loader.models[i]);
+    }
+
+    //the page cache keeps pointers to every virtual texture
+    if (loader.memory_budget == 0 || loader.settings.virtual_cache != nullptr) return;
+
+    while (loader.loaded_bytes > loader.memory_budget)
+    {
+        auto oldest = -1;
+
+        for (auto i = 0; i < loader.model_count; i++)
+        {
+            const auto& residency = loader.residency[i];
+
+            //models still loading can't be unloaded until their jobs finish
+            if (residency.last_used > last_trim || !model_loaded(loader, i)) continue;
+
+            if (oldest < 0 || residency.last_used < loader.residency[oldest].last_used) oldest = i;
+        }
+
+        if (oldest < 0) break;
+
+        const auto bytes = model_bytes(loader.models[oldest]);
+
+        unload_model(loader.models[oldest], loader.settings.registry);
+        loader.residency[oldest].resident = false;
+        loader.models_resident.fetch_sub(1, std::memory_order_relaxed);
+        loader.loaded_bytes -= bytes;
+
+        printf("Unloaded model %d, %u KB\n", oldest, static_cast<unsigned>(bytes / 1024));
+    }
+}
+
+void load_all_models(model_loader& loader)
+{
+    for (auto i = 0; i < loader.model_count; i++) queue_model(loader, i);
+
+    wait_for_models(loader);
+}
+
+void wait_for_models(const model_loader& loader)
+{
+    for (auto i = 0; i < loader.model_count; i++)
+    {
+        wait_for_counter(loader.model_pending[i]);
+    }
+}
+
+bool pack_models(const char* conf_path, const char* archive_path)
+{
+    model* models = nullptr;
+    auto model_count = 0;
+
+    if (!read_conf(conf_path, models, model_count))
+    {
+        printf("Could not open %s.\n", conf_path);
+        return false;
+    }
+
+    archive_writer writer;
+
+    for (auto i = 0; i < model_count; i++)
+    {
+        const auto& model = models[i];
+
+        archive_model packed{};
+        packed.background = model.background;
+        packed.text_col = model.text_col;
+        packed.initial_rot = model.initial_rot;
+        packed.author = add_archive_string(writer, model.author);
+        packed.name = add_archive_string(writer, model.name);
+        packed.url = add_archive_string(writer, model.url);
+        packed.first_mesh = static_cast<uint32_t>(writer.meshes.size());
+        packed.mesh_count = static_cast<uint32_t>(model.mesh_count);
+
+        writer.models.push_back(packed);
+
+        for (size_t j = 0; j < model.mesh_count; j++)
+        {
+            const auto& mesh = model.meshes[j];
 
-            //load the referenced resources
             char model_bin_path[1024];
-            concat_strings( strlen(mesh.geo_path), mesh.geo_path, strlen(".bin"), ".bin", model_bin_path);
-            
-            read_mesh(model_bin_path, mesh);
-            load_image(mesh.diffuse_path, mesh.diffuse);
+            concat_strings(strlen(mesh.geo_path), mesh.geo_path, strlen(".bin"), ".bin", model_bin_path);
 
-            if(mesh.has_normal_map)
+            //in mesh_map order
+            const char* map_paths[archive_mesh_maps] = {
+                mesh.diffuse_path,
+                mesh.has_normal_map ? mesh.normal_path : nullptr,
+                mesh.has_specular_map ? mesh.specular_path : nullptr,
+                mesh.has_emissive_map ? mesh.emission_path : nullptr
+            };
+
+            archive_mesh packed_mesh{};
+            packed_mesh.allow_lighting = mesh.allow_lighting;
+            packed_mesh.geometry = add_archive_file(writer, model_bin_path);
+
+            if (packed_mesh.geometry == archive_none)
             {
-                load_image(mesh.normal_path, mesh.normal);
+                printf("Could not read %s.\n", model_bin_path);
+                return false;
             }
 
-            if(mesh.has_specular_map)
+            for (auto map = 0; map < archive_mesh_maps; map++)
             {
-                load_image(mesh.specular_path, mesh.spec);
+                packed_mesh.maps[map] = archive_none;
+                if (map_paths[map] == nullptr) continue;
+
+                packed_mesh.maps[map] = add_archive_file(writer, map_paths[map]);
+
+                if (packed_mesh.maps[map] == archive_none)
+                {
+                    printf("Could not read %s.\n", map_paths[map]);
+                    return false;
+                }
             }
 
-            if(mesh.has_emissive_map)
+            writer.meshes.push_back(packed_mesh);
+        }
+    }
+
+    return write_archive(writer, archive_path);
+}
+
+bool quantize_meshes(const char* conf_path, const bool compress)
+{
+    model* models = nullptr;
+    auto model_count = 0;
+
+    if (!read_conf(conf_path, models, model_count))
+    {
+        printf("Could not open %s.\n", conf_path);
+        return false;
+    }
+
+    size_t total_size = 0;
+    size_t total_quantized_size = 0;
+
+    for (auto i = 0; i < model_count; i++)
+    {
+        for (size_t j = 0; j < models[i].mesh_count; j++)
+        {
+            auto& mesh = models[i].meshes[j];
+
+            char model_bin_path[1024];
+            concat_strings(strlen(mesh.geo_path), mesh.geo_path, strlen(".bin"), ".bin", model_bin_path);
+
+            char quantized_path[1024];
+            snprintf(quantized_path, sizeof(quantized_path), "%s.qmsh", mesh.geo_path);
+
+            read_mesh(model_bin_path, mesh);
+
+            //as laid out in the .bin, each array after its count
+            const auto size =
+                sizeof(int) * 4 + sizeof(v3) * mesh.vert_count + sizeof(face) * mesh.face_count +
+                sizeof(v2) * mesh.uv_count + sizeof(v3) * mesh.normal_count;
+
+            quantized_mesh_source source{};
+            stat_mesh_source(model_bin_path, source);
+
+            std::vector<unsigned char> encoded;
+            encode_quantized_mesh(mesh, compress, source, encoded);
+
+            FILE* f = nullptr;
+            create_binary_file(quantized_path, f);
+
+            if (f == nullptr)
             {
-                load_image(mesh.emission_path, mesh.emission);
+                printf("Could not open %s for writing.\n", quantized_path);
+                return false;
             }
+
+            const auto written = fwrite(encoded.data(), 1, encoded.size(), f) == encoded.size();
+
+            if (fclose(f) != 0 || !written)
+            {
+                printf("Could not write %s.\n", quantized_path);
+                return false;
+            }
+
+            printf("Quantized %s, %u KB to %u KB\n",
+                model_bin_path,
+                static_cast<unsigned>(size / 1024),
+                static_cast<unsigned>(encoded.size() / 1024)
+            );
+
+            total_size += size;
+            total_quantized_size += encoded.size();
         }
+
+        unload_model(models[i], nullptr);
     }
 
-    fclose(f);
+    printf("Quantized %u KB of meshes to %u KB\n",
+        static_cast<unsigned>(total_size / 1024),
+        static_cast<unsigned>(total_quantized_size / 1024)
+    );
+
+    return true;
+}
+
+static bool write_conf(const char* path, const model* models, const int model_count)
+{
+    FILE* f = nullptr;
+    create_binary_file(path, f);
+
+    if (f == nullptr)
+    {
+        printf("Could not open %s for writing.\n", path);
+        return false;
+    }
+
+    auto written = write_int(f, model_count);
+
+    for (auto i = 0; i < model_count && written; i++)
+    {
+        const auto& model = models[i];
+
+        written =
+            write_string(f, model.author) && write_string(f, model.name) && write_string(f, model.url) &&
+            write_values(f, &model.background, 1) && write_values(f, &model.text_col, 1) &&
+            write_values(f, &model.initial_rot, 1) && write_int(f, static_cast<int>(model.mesh_count));
+
+        for (size_t j = 0; j < model.mesh_count && written; j++)
+        {
+            const auto& mesh = model.meshes[j];
+
+            written =
+                write_values(f, &mesh.allow_lighting, 1) &&
+                write_string(f, mesh.geo_path) && write_string(f, mesh.diffuse_path) &&
+                write_string(f, mesh.has_normal_map ? mesh.normal_path : nullptr) &&
+                write_string(f, mesh.has_specular_map ? mesh.specular_path : nullptr) &&
+                write_string(f, mesh.has_emissive_map ? mesh.emission_path : nullptr);
+        }
+    }
+
+    if (fclose(f) != 0 || !written)
+    {
+        printf("Could not write %s.\n", path);
+        return false;
+    }
+
+    return true;
+}
+
+bool add_conf_model(const char* conf_path, const model& added)
+{
+    model* models = nullptr;
+    auto model_count = 0;
+
+    //a conf file that doesn't exist yet starts out empty
+    read_conf(conf_path, models, model_count);
+
+    std::vector<model> updated(models, models + model_count);
+    auto replaced = false;
+
+    for (auto& model : updated)
+    {
+        if (model.name != nullptr && added.name != nullptr && strcmp(model.name, added.name) == 0)
+        {
+            model = added;
+            replaced = true;
+        }
+    }
+
+    if (!replaced) updated.push_back(added);
+
+    if (!write_conf(conf_path, updated.data(), static_cast<int>(updated.size()))) return false;
+
+    printf("%s %s in %s\n", replaced ? "Replaced" : "Added", added.name, conf_path);
+    return true;
+}
+
+static void unload_virtual_map(virtual_texture*& tex)
+{
+    if (tex == nullptr) return;
+
+    unload_virtual_texture(*tex);
+    delete tex;
+    tex = nullptr;
+}
+
+void unload_model(model& obj, texture_registry* registry)
+{
+    for (size_t i = 0; i < obj.mesh_count; i++)
+    {
+        auto& mesh = obj.meshes[i];
+
+        release_map(mesh.diffuse, registry);
+        release_map(mesh.normal, registry);
+        release_map(mesh.spec, registry);
+        release_map(mesh.emission, registry);
+
+        free_material_texture(mesh.material);
+        mesh.has_material_texture = false;
+
+        unload_virtual_map(mesh.virtual_diffuse);
+        unload_virtual_map(mesh.virtual_normal);
+        unload_virtual_map(mesh.virtual_spec);
+
+        if (mesh.geometry_file.data != nullptr)
+        {
+            unmap_file(mesh.geometry_file);
+        }
+        else if (!mesh.geometry_in_archive)
+        {
+            delete[] mesh.verts;
+            delete[] mesh.normals;
+            delete[] mesh.uvs;
+            delete[] mesh.faces;
+        }
+
+        mesh.verts = nullptr;
+        mesh.normals = nullptr;
+        mesh.uvs = nullptr;
+        mesh.faces = nullptr;
+
+        mesh.vert_count = 0;
+        mesh.normal_count = 0;
+        mesh.uv_count = 0;
+        mesh.face_count = 0;
+    }
 }
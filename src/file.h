@@ -1,10 +1,24 @@
 #ifndef FILE_H
 #define FILE_H
 
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#include "archive.h"
+#include "jobs.h"
 #include "maths.h"
+#include "platform_specific.h"
 #include "image.h"
+#include "material_texture.h"
+#include "texture_registry.h"
+#include "virtual_texture.h"
 #include "render.h"
 
+#if HAS_THREADS
+#include <mutex>
+#endif
+
 struct face
 {
     v3_i verts;
@@ -19,10 +33,19 @@ struct mesh
     image spec;
     image emission;
 
+    //every map above interleaved into one texture, see texture_settings::interleave
+    material_texture material;
+
+    //streamed stand-ins for the maps above, see texture_settings::virtual_cache
+    virtual_texture* virtual_diffuse{};
+    virtual_texture* virtual_normal{};
+    virtual_texture* virtual_spec{};
+
     bool allow_lighting{};
     bool has_emissive_map{};
     bool has_normal_map{};
     bool has_specular_map{};
+    bool has_material_texture{};
 
     const char* geo_path{};
     const char* diffuse_path{};
@@ -39,6 +62,12 @@ struct mesh
     v3 * normals{};
     v2 * uvs{};
     face * faces{};
+
+    //the mesh's .bin file when the arrays above point into it, see read_mesh()
+    mapped_file geometry_file;
+
+    //the arrays above point into an asset archive, which owns them
+    bool geometry_in_archive{};
 };
 
 struct model
@@ -57,6 +86,181 @@ struct model
 };
 
 
-void load_models(const char* path, model*& output, int& model_count);
+/*
+ * How textures are stored once they are decoded. Run the app with "--bench"
+ * to compare the options on the current machine and render size.
+ *
+ * compress: block compress the maps (bc1 diffuse/emission, bc5 normal, bc4
+ * spec). Compressed maps are always tiled, so layout only applies to rgba8.
+ *
+ * interleave: pack each mesh's maps into a single material_texture, so the
+ * shader reads all of them with one fetch. The separate maps are released
+ * once packed. Takes precedence over compress and layout.
+ *
+ * virtual_cache: when set, diffuse, normal and spec maps become virtual
+ * textures streamed through this cache instead of being loaded whole. Takes
+ * precedence over every other setting for those maps.
+ *
+ * registry: when set, textures are shared through it, so a map used by
+ * several meshes or models is decoded and stored once.
+ */
+struct texture_settings
+{
+    image_layout layout = image_layout::linear;
+    bool compress = false;
+    bool interleave = false;
+    page_cache* virtual_cache{};
+    texture_registry* registry{};
+};
+
+bool worth_packing_material(const mesh& mesh);
+void pack_mesh_material(mesh& mesh, texture_registry* registry);
+
+/*
+ * Frees a model's geometry and releases its textures, keeping what was read
+ * from the conf file. registry must be the one the model was loaded with.
+ */
+void unload_model(model& obj, texture_registry* registry);
+
+struct mesh_load;
+
+/*
+ * Whether a model is loaded, and when it was last asked for.
+ */
+struct model_residency
+{
+    //the model's first mesh_load
+    mesh_load* loads{};
+
+    //queued for loading and not unloaded since
+    bool resident{};
+
+    //model_loader::use_clock as of the last use_model() or prefetch_model()
+    uint64_t last_used{};
+};
+
+/*
+ * Tracks models loading in the background, see start_loading_models().
+ */
+struct model_loader
+{
+    texture_settings settings;
+
+    /*
+     * Bytes of geometry and textures the loaded models may hold before
+     * trim_models() unloads the least recently used, 0 for no limit. Set it
+     * before start_loading_models().
+     */
+    size_t memory_budget{};
+
+    //open when loading from an archive rather than a conf file
+    asset_archive archive;
+
+    //one per model, reaches zero once every mesh and texture of it is loaded
+    job_counter* model_pending{};
+    int model_count{};
+
+    mesh_load* meshes{};
+
+    //only touched by the thread that draws the models
+    model* models{};
+    model_residency* residency{};
+    uint64_t use_clock{};
+    uint64_t trim_clock{};
+    size_t loaded_bytes{};
+
+    //read by the load jobs for the totals
+    std::atomic<int> models_resident{};
+
+    //load jobs that haven't finished, the last one prints the totals
+    std::atomic<int> tasks_left{};
+    std::chrono::high_resolution_clock::time_point start;
+
+#if HAS_THREADS
+    //virtual textures register with the page cache, which has no lock of its own
+    std::mutex virtual_lock;
+#endif
+};
+
+/*
+ * Reads the asset archive or conf file at path and loads models from it on
+ * the job system, storing textures as described by settings. Each mesh's
+ * geometry and each of its maps is a job of its own, so textures decode
+ * concurrently.
+ *
+ * Only first_model is loaded, with every thread, and is ready when this
+ * returns. The rest load when use_model() or prefetch_model() first asks for
+ * them, check model_loaded() before drawing them. With virtual textures,
+ * whose page cache the renderer reads, every model is loaded before this
+ * returns and none are ever unloaded.
+ *
+ * Fails, after printing why, for archives that can't be used.
+ */
+bool start_loading_models(
+    const char* path, model*& output, int& model_count, model_loader& loader,
+    int first_model, const texture_settings& settings = texture_settings{}
+);
+
+bool model_loaded(const model_loader& loader, int model_idx);
+
+/*
+ * Marks a model as in use, queueing its loads if it isn't loaded. Models
+ * used since the last trim_models() are never unloaded by it.
+ *
+ * This and the functions below are only called from the thread that draws
+ * the models.
+ */
+void use_model(model_loader& loader, int model_idx);
+
+/*
+ * A hint that a model is likely to be used next. It loads in the background
+ * and is kept like a used model, unless the budget is already spent, in
+ * which case models that aren't loaded are left alone.
+ */
+void prefetch_model(model_loader& loader, int model_idx);
+
+/*
+ * Unloads loaded models, least recently used first, until the rest fit in
+ * loader.memory_budget or only models used since the last call are left.
+ * Call it between frames, never while drawing.
+ *
+ * The size of a model is an estimate: textures shared with other models
+ * count towards each of them, and a model's loads count once they finish.
+ */
+void trim_models(model_loader& loader);
+
+/*
+ * Loads every model and waits for them, ignoring the budget.
+ */
+void load_all_models(model_loader& loader);
+
+/*
+ * Waits for every model that was asked for to finish loading. Load jobs
+ * are background jobs, so only the worker threads run them.
+ */
+void wait_for_models(const model_loader& loader);
+
+/*
+ * Packs the conf file at conf_path and every file it lists into an asset
+ * archive at archive_path, see archive.h.
+ */
+bool pack_models(const char* conf_path, const char* archive_path);
+
+/*
+ * Writes mesh's geometry to path as a .bin file, see read_mesh().
+ */
+bool write_mesh(const char* path, const mesh& mesh);
+
+/*
+ * Adds a model to the conf file at conf_path, creating the file if there
+ * isn't one. A model of the same name is replaced.
+ */
+bool add_conf_model(const char* conf_path, const model& added);
+
+/*
+ * Writes a .qmsh next to the .bin of every mesh listed in the conf file at
+ * conf_path, compressing them when compress is set, see mesh_codec.h.
+ */
+bool quantize_meshes(const char* conf_path, bool compress);
 
 #endif
\ No newline at end of file
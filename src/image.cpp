@@ -1,7 +1,14 @@
 #include "image.h"
+#include "texture_compression.h"
+#include "platform_specific.h"
 
 #include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <algorithm>
+#include <vector>
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "include/stb_image.h"
@@ -161,7 +168,7 @@ inline void set_pixel(image& out, const rgba& col, int x, int y)
     assert(out.n_channels == 4);
 
     //read from bottom up
-    y = out.width - y - 1;	
+    y = out.height - y - 1;
 
     const auto idx = (y * out.width + x);
     const auto max_size = out.width * out.height;
@@ -174,10 +181,33 @@ inline void set_pixel(image& out, const rgba& col, int x, int y)
     *accessor = col;
 }
 
-inline rgba get_pixel(image& out, int x, int y) 
+inline rgba get_pixel(image& out, const int x, const int y)
+{
+    switch (out.format)
+    {
+    case image_format::bc1:
+        return get_pixel_bc1(out, x, y);
+    case image_format::bc4:
+        return get_pixel_bc4(out, x, y);
+    case image_format::bc5:
+        return get_pixel_bc5(out, x, y);
+    default:
+        break;
+    }
+
+    if (out.layout == image_layout::tiled)
+    {
+        return get_pixel_tiled(out, x, y);
+    }
+
+    return get_pixel_linear(out, x, y);
+}
+
+inline rgba get_pixel_linear(image& out, int x, int y)
 {
     //only support rgba images
     assert(out.n_channels == 4);
+    assert(out.layout == image_layout::linear);
 
     //read from bottom up
     y = out.height - y - 1;
@@ -193,10 +223,49 @@ inline rgba get_pixel(image& out, int x, int y)
     return *accessor;
 }
 
+/*
+ * Maps a texel coordinate to its index in a tiled image. The tile size is a
+ * power of two, so this is only shifts and masks: the tile index picks the
+ * 16 texel block, the low bits pick the texel inside it.
+ */
+static int tiled_index(const int tiles_x, const int x, const int y)
+{
+    const auto tile = (y >> 2) * tiles_x + (x >> 2);
+    const auto texel = ((y & 3) << 2) | (x & 3);
+
+    return tile * image_tile_texels + texel;
+}
+
+inline rgba get_pixel_tiled(image& out, int x, int y)
+{
+    //only support rgba images
+    assert(out.n_channels == 4);
+    assert(out.layout == image_layout::tiled);
+
+    //read from bottom up
+    y = out.height - y - 1;
+
+    //bounds check
+    assert(x >= 0 && x < out.width);
+    assert(y >= 0 && y < out.height);
+
+    const auto* accessor = reinterpret_cast<rgba*>(out.data) + tiled_index(out.tiles_x, x, y);
+    return *accessor;
+}
+
 inline  v3 get_normal(image& out, int x, int y) 
 {
-    const auto pixel = get_pixel(out, x, y);
+    //two channel normal maps rebuild z themselves
+    if (out.format == image_format::bc5)
+    {
+        return get_normal_bc5(out, x, y);
+    }
+
+    return unpack_normal(get_pixel(out, x, y));
+}
 
+inline v3 unpack_normal(const rgba& pixel)
+{
     return {
         static_cast<float>(pixel.r) / 255.0f * 2.0f - 1.0f,
         static_cast<float>(pixel.g) / 255.0f * 2.0f - 1.0f,
@@ -204,20 +273,359 @@ inline  v3 get_normal(image& out, int x, int y)
     };
 }
 
-bool load_image(const char* path, image& out)
+/*
+ * Re-orders the texels of an image into the requested layout. The old pixel
+ * data is released and replaced with a new allocation. Pixels are allocated
+ * with malloc so that textures can be released the same way as the buffers
+ * returned by stb_image, whatever their layout.
+ */
+void convert_image_layout(image& img, const image_layout layout)
 {
-    auto width = 0, height = 0, comp = 0;
-    auto* pixels = stbi_load(path, &width, &height, &comp, STBI_rgb_alpha);
+    assert(img.n_channels == 4);
 
-    if (pixels == nullptr)
+    //compressed images are always stored tiled
+    if (img.format != image_format::rgba8)
     {
-        return false;
+        return;
+    }
+
+    if (img.layout == layout || img.data == nullptr)
+    {
+        img.layout = layout;
+        return;
     }
 
+    const auto tiles_x = (img.width + image_tile_size - 1) / image_tile_size;
+    const auto tiles_y = (img.height + image_tile_size - 1) / image_tile_size;
+
+    const auto linear_size = img.width * img.height;
+    const auto tiled_size = tiles_x * tiles_y * image_tile_texels;
+
+    const auto* source = reinterpret_cast<rgba*>(img.data);
+    rgba* dest = nullptr;
+
+    if (layout == image_layout::tiled)
+    {
+        dest = static_cast<rgba*>(malloc(tiled_size * sizeof(rgba)));
+        assert(dest != nullptr);
+
+        //padding texels are never read, but keep them deterministic
+        memset(dest, 0, tiled_size * sizeof(rgba));
+
+        for (auto y = 0; y < img.height; y++) {
+            for (auto x = 0; x < img.width; x++) {
+                dest[tiled_index(tiles_x, x, y)] = source[y * img.width + x];
+            }
+        }
+    }
+    else
+    {
+        dest = static_cast<rgba*>(malloc(linear_size * sizeof(rgba)));
+        assert(dest != nullptr);
+
+        for (auto y = 0; y < img.height; y++) {
+            for (auto x = 0; x < img.width; x++) {
+                dest[y * img.width + x] = source[tiled_index(img.tiles_x, x, y)];
+            }
+        }
+    }
+
+    free(img.data);
+
+    img.data = reinterpret_cast<unsigned char*>(dest);
+    img.layout = layout;
+    img.tiles_x = layout == image_layout::tiled ? tiles_x : 0;
+}
+
+/*
+ * Number of bytes of pixel data the image holds, including tile padding.
+ */
+size_t image_data_size(const image& img)
+{
+    const auto tiles_x = static_cast<size_t>((img.width + image_tile_size - 1) / image_tile_size);
+    const auto tiles_y = static_cast<size_t>((img.height + image_tile_size - 1) / image_tile_size);
+
+    switch (img.format)
+    {
+    case image_format::bc1:
+    case image_format::bc4:
+        return tiles_x * tiles_y * 8;
+    case image_format::bc5:
+        return tiles_x * tiles_y * 16;
+    default:
+        break;
+    }
+
+    if (img.layout == image_layout::tiled)
+    {
+        return tiles_x * tiles_y * image_tile_texels * sizeof(rgba);
+    }
+
+    return static_cast<size_t>(img.width) * img.height * sizeof(rgba);
+}
+
+void free_image(image& img)
+{
+    if (img.mapping.data != nullptr) unmap_file(img.mapping);
+    else free(img.data);
+
+    img = image{};
+}
+
+/*
+ * Takes ownership of freshly decoded rgba8 pixels and converts them to the
+ * requested layout or block compressed format.
+ */
+static void finish_decoded_image(
+    unsigned char* pixels, const int width, const int height, image& out,
+    const image_layout layout, const image_format format, const int channel
+)
+{
     out.width = width;
     out.height = height;
     out.n_channels = 4;
     out.data = pixels;
+    out.layout = image_layout::linear;
+    out.format = image_format::rgba8;
+
+    if (format != image_format::rgba8)
+    {
+        image compressed{};
+        compress_image(out, compressed, format, channel);
+
+        free_image(out);
+        out = compressed;
+
+        return;
+    }
+
+    convert_image_layout(out, layout);
+}
+
+/*
+ * Loads an image from disk as rgba8 and converts it to the requested layout
+ * or block compressed format. channel picks the source channel for single
+ * channel (bc4) images.
+ */
+bool load_image(const char* path, image& out, const image_layout layout, const image_format format, const int channel)
+{
+    auto width = 0, height = 0, comp = 0;
+    auto* pixels = stbi_load(path, &width, &height, &comp, STBI_rgb_alpha);
+
+    if (pixels == nullptr)
+    {
+        return false;
+    }
+
+    finish_decoded_image(pixels, width, height, out, layout, format, channel);
+
+    return true;
+}
+
+/*
+ * As load_image(), for an encoded png/jpeg already in memory.
+ */
+bool decode_image(
+    const unsigned char* bytes, const size_t size, image& out,
+    const image_layout layout, const image_format format, const int channel
+)
+{
+    auto width = 0, height = 0, comp = 0;
+    auto* pixels = stbi_load_from_memory(bytes, static_cast<int>(size), &width, &height, &comp, STBI_rgb_alpha);
+
+    if (pixels == nullptr)
+    {
+        return false;
+    }
+
+    finish_decoded_image(pixels, width, height, out, layout, format, channel);
+
+    return true;
+}
+
+static bool has_extension(const char* path, const char* extension)
+{
+    const auto path_length = strlen(path);
+    const auto extension_length = strlen(extension);
+
+    return path_length >= extension_length && strcmp(path + path_length - extension_length, extension) == 0;
+}
+
+/*
+ * Binary ppm, rgb only.
+ */
+static void write_ppm(FILE* f, const image& img)
+{
+    fprintf(f, "P6\n%d %d\n255\n", img.width, img.height);
+
+    std::vector<unsigned char> row(static_cast<size_t>(img.width) * 3);
+
+    for (auto y = 0; y < img.height; y++)
+    {
+        const auto* pixels = img.data + static_cast<size_t>(y) * img.stride();
+
+        for (auto x = 0; x < img.width; x++)
+        {
+            memcpy(&row[x * 3], pixels + x * 4, 3);
+        }
+
+        fwrite(row.data(), 1, row.size(), f);
+    }
+}
+
+struct png_crc_table
+{
+    unsigned int e[256];
+
+    png_crc_table()
+    {
+        for (auto i = 0u; i < 256; i++)
+        {
+            auto c = i;
+            for (auto bit = 0; bit < 8; bit++) c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            e[i] = c;
+        }
+    }
+};
+
+static unsigned int png_crc(const unsigned char* bytes, const size_t size, unsigned int crc = 0)
+{
+    //built on first use, images can be saved from several threads at once
+    static const png_crc_table table;
+
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++) crc = table.e[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+
+    return ~crc;
+}
+
+static void put_big_endian(std::vector<unsigned char>& out, const unsigned int value)
+{
+    out.push_back(static_cast<unsigned char>(value >> 24));
+    out.push_back(static_cast<unsigned char>(value >> 16));
+    out.push_back(static_cast<unsigned char>(value >> 8));
+    out.push_back(static_cast<unsigned char>(value));
+}
+
+static void write_png_chunk(FILE* f, const char* type, const std::vector<unsigned char>& data)
+{
+    std::vector<unsigned char> chunk;
+    chunk.reserve(data.size() + 12);
+
+    put_big_endian(chunk, static_cast<unsigned int>(data.size()));
+    chunk.insert(chunk.end(), type, type + 4);
+    chunk.insert(chunk.end(), data.begin(), data.end());
+
+    //the crc covers the type and data, not the length
+    put_big_endian(chunk, png_crc(chunk.data() + 4, chunk.size() - 4));
+
+    fwrite(chunk.data(), 1, chunk.size(), f);
+}
+
+/*
+ * Rgb png. The pixel data goes in uncompressed deflate blocks, frames are
+ * written every frame in batch runs and deflating them would cost more than
+ * rendering them.
+ */
+static void write_png(FILE* f, const image& img)
+{
+    static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    fwrite(signature, 1, sizeof(signature), f);
+
+    std::vector<unsigned char> header;
+    put_big_endian(header, static_cast<unsigned int>(img.width));
+    put_big_endian(header, static_cast<unsigned int>(img.height));
+
+    //8 bit rgb, default compression and filtering, no interlacing
+    const unsigned char format[5] = { 8, 2, 0, 0, 0 };
+    header.insert(header.end(), format, format + 5);
+    write_png_chunk(f, "IHDR", header);
+
+    //every row starts with its filter type, 0 is none
+    const auto row_size = static_cast<size_t>(img.width) * 3 + 1;
+    std::vector<unsigned char> raw(row_size * img.height);
+
+    for (auto y = 0; y < img.height; y++)
+    {
+        const auto* pixels = img.data + static_cast<size_t>(y) * img.stride();
+        auto* row = &raw[y * row_size];
+
+        row[0] = 0;
+        for (auto x = 0; x < img.width; x++)
+        {
+            memcpy(row + 1 + x * 3, pixels + x * 4, 3);
+        }
+    }
+
+    //zlib stream of stored blocks, each holds at most 65535 bytes
+    const size_t max_block = 65535;
+    std::vector<unsigned char> data{ 0x78, 0x01 };
+    data.reserve(raw.size() + raw.size() / max_block * 5 + 16);
+
+    for (size_t offset = 0;; offset += max_block)
+    {
+        const auto size = std::min(max_block, raw.size() - offset);
+        const auto last = offset + size == raw.size();
+
+        data.push_back(last ? 1 : 0);
+        data.push_back(static_cast<unsigned char>(size));
+        data.push_back(static_cast<unsigned char>(size >> 8));
+        data.push_back(static_cast<unsigned char>(~size));
+        data.push_back(static_cast<unsigned char>(~size >> 8));
+        data.insert(data.end(), raw.begin() + offset, raw.begin() + offset + size);
+
+        if (last) break;
+    }
+
+    unsigned int adler_a = 1, adler_b = 0;
+    for (const auto byte : raw)
+    {
+        adler_a = (adler_a + byte) % 65521;
+        adler_b = (adler_b + adler_a) % 65521;
+    }
+    put_big_endian(data, adler_b << 16 | adler_a);
+
+    write_png_chunk(f, "IDAT", data);
+    write_png_chunk(f, "IEND", {});
+}
+
+/*
+ * Writes a linear rgba8 image to a .png or .ppm file, picked by the path's
+ * extension. Alpha is dropped. Prints why when it fails, callers only need
+ * to stop.
+ */
+bool save_image(const char* path, const image& img)
+{
+    assert(img.layout == image_layout::linear);
+    assert(img.format == image_format::rgba8);
+    assert(img.n_channels == 4);
+
+    const auto png = has_extension(path, ".png");
+    if (!png && !has_extension(path, ".ppm"))
+    {
+        printf("Could not write %s, the path needs a .png or .ppm extension.\n", path);
+        return false;
+    }
+
+    FILE* f = nullptr;
+    create_binary_file(path, f);
+
+    if (f == nullptr)
+    {
+        printf("Could not open %s for writing: %s.\n", path, strerror(errno));
+        return false;
+    }
+
+    if (png) write_png(f, img);
+    else write_ppm(f, img);
+
+    const auto written = ferror(f) == 0;
+
+    if (fclose(f) != 0 || !written)
+    {
+        printf("Could not write %s: %s.\n", path, strerror(errno));
+        return false;
+    }
 
     return true;
 }
@@ -1,7 +1,10 @@
 #ifndef IMAGE_H
 #define IMAGE_H
 
+#include <cstddef>
+
 #include "maths.h"
+#include "platform_specific.h"
 
 /*
  * NOTE: This struct represents hue in the range 0-1, not 0-360 degrees as
@@ -45,16 +48,81 @@ const rgba eggshell{ 200, 200, 200, 255 };
 rgba hsl_to_rgb(const hsla& val);
 hsla rgb_to_hsl(const rgba& val);
 
+/*
+ * Memory layout of an image's texels.
+ *
+ * linear: plain row-major storage, as handed back by stb_image.
+ *
+ * tiled: the image is split into 4x4 texel tiles stored back to back in
+ * row-major tile order. A tile of rgba texels is 64 bytes, so one cache line
+ * holds a texel's neighbours in both x and y. This suits textures, where a
+ * rotated triangle walks the image diagonally and a linear layout misses the
+ * cache on nearly every row change. The width and height are padded up to a
+ * multiple of the tile size.
+ */
+enum class image_layout
+{
+    linear,
+    tiled
+};
+
+/*
+ * Storage format of an image's texels.
+ *
+ * rgba8 stores every texel uncompressed, in either layout. The block
+ * compressed formats always use the tiled layout, with one 4x4 block per tile,
+ * and are decoded per texel when sampled:
+ *
+ *  bc1: 8 byte blocks, two rgb565 end points and 2 bit indices. Used for colour.
+ *  bc4: 8 byte blocks, two 8 bit end points and 3 bit indices for one channel.
+ *  bc5: two bc4 blocks for the x and y of a tangent space normal, z is rebuilt.
+ */
+enum class image_format
+{
+    rgba8,
+    bc1,
+    bc4,
+    bc5
+};
+
+static const int image_tile_size = 4;
+static const int image_tile_texels = image_tile_size * image_tile_size;
+
 struct image {
     int width{}, height{};
     int n_channels = 4;
     unsigned char* data{};
 
+    image_layout layout = image_layout::linear;
+    image_format format = image_format::rgba8;
+
+    //number of tiles (or compressed blocks) in each row, only meaningful for tiled images
+    int tiles_x{};
+
+    //set when data points into a mapped file rather than its own allocation, see texture_cache.h
+    mapped_file mapping;
+
     int stride() const;
 };
 
 inline void set_pixel(image& out, const rgba& col, int x, int y);
 inline rgba get_pixel(image& out, int x, int y);
+inline rgba get_pixel_linear(image& out, int x, int y);
+inline rgba get_pixel_tiled(image& out, int x, int y);
 inline v3 get_normal(image& out, int x, int y);
-bool load_image(const char* path, image& out);
+inline v3 unpack_normal(const rgba& pixel);
+void convert_image_layout(image& img, image_layout layout);
+size_t image_data_size(const image& img);
+void free_image(image& img);
+bool load_image(
+    const char* path, image& out,
+    image_layout layout = image_layout::linear,
+    image_format format = image_format::rgba8, int channel = 0
+);
+bool decode_image(
+    const unsigned char* bytes, size_t size, image& out,
+    image_layout layout = image_layout::linear,
+    image_format format = image_format::rgba8, int channel = 0
+);
+bool save_image(const char* path, const image& img);
 #endif
@@ -0,0 +1,355 @@
+#include <algorithm>
+#include <cassert>
+
+#include "jobs.h"
+
+#if HAS_THREADS
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#endif
+
+/*
+ * Chunks a single parallel_for() is split into at most, the grain grows to
+ * fit larger ranges.
+ */
+static const int max_parallel_for_jobs = 256;
+
+/*
+ * Times a waiting thread with nothing to run yields before it blocks until
+ * the counter reaches zero or more work arrives.
+ */
+static const int wait_spin_rounds = 64;
+
+#if HAS_THREADS
+struct job_queue
+{
+    std::mutex lock;
+    std::deque<job> jobs;
+};
+
+struct job_system
+{
+    int thread_count = 1;
+
+    //one per thread, workers own 1 and up
+    job_queue* queues{};
+    std::vector<std::thread> workers;
+
+    //see run_background_jobs(), only workers take from it
+    job_queue background;
+
+    //jobs sitting in the per thread queues and in the background one, idle workers sleep while both are zero
+    std::atomic<int> queued{};
+    std::atomic<int> background_queued{};
+    std::mutex sleep_lock;
+    std::condition_variable work_queued;
+
+    //threads blocked in wait_for_counter(), woken when a counter reaches zero or jobs are queued
+    std::atomic<int> waiters{};
+    std::mutex wait_lock;
+    std::condition_variable wait_wakeup;
+};
+
+static job_system* global_job_system;
+
+//queue of the calling thread, worker threads set their own
+static thread_local int job_queue_index = 0;
+
+static bool pop_job(job_queue& queue, job& out, const bool from_front)
+{
+    std::lock_guard<std::mutex> lock(queue.lock);
+    if (queue.jobs.empty()) return false;
+
+    if (from_front)
+    {
+        out = queue.jobs.front();
+        queue.jobs.pop_front();
+    }
+    else
+    {
+        out = queue.jobs.back();
+        queue.jobs.pop_back();
+    }
+
+    return true;
+}
+
+/*
+ * Takes a job from our own queue, or failing that steals the oldest job
+ * from someone else's.
+ */
+static bool take_job(job_system& system, job& out)
+{
+    if (system.queued.load(std::memory_order_acquire) == 0) return false;
+
+    const auto own = job_queue_index;
+
+    if (pop_job(system.queues[own], out, false))
+    {
+        system.queued.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    for (auto i = 1; i < system.thread_count; i++)
+    {
+        auto& victim = system.queues[(own + i) % system.thread_count];
+
+        if (pop_job(victim, out, true))
+        {
+            system.queued.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool take_background_job(job_system& system, job& out)
+{
+    if (system.background_queued.load(std::memory_order_acquire) == 0) return false;
+    if (!pop_job(system.background, out, true)) return false;
+
+    system.background_queued.fetch_sub(1, std::memory_order_relaxed);
+    return true;
+}
+
+/*
+ * Both sides of waking a waiter are sequentially consistent: either the
+ * waker sees it waiting, or it sees what the waker changed before it sleeps.
+ */
+static void wake_waiters(job_system& system)
+{
+    if (system.waiters.load() == 0) return;
+
+    std::lock_guard<std::mutex> lock(system.wait_lock);
+    system.wait_wakeup.notify_all();
+}
+#endif
+
+static void execute_job(const job& j)
+{
+    if (j.depends_on != nullptr) wait_for_counter(*j.depends_on);
+
+    j.function(j.data, j.begin, j.end);
+
+    const auto last = j.counter->pending.fetch_sub(1) == 1;
+
+#if HAS_THREADS
+    if (last && global_job_system != nullptr) wake_waiters(*global_job_system);
+#else
+    (void)last;
+#endif
+}
+
+#if HAS_THREADS
+static void run_job_worker(job_system& system, const int index)
+{
+    job_queue_index = index;
+
+    for (;;)
+    {
+        job next;
+
+        //frame work first, loading only when there is none
+        if (take_job(system, next) || take_background_job(system, next))
+        {
+            execute_job(next);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(system.sleep_lock);
+        system.work_queued.wait(lock, [&]
+        {
+            return system.queued.load(std::memory_order_acquire) > 0 || system.background_queued.load(std::memory_order_acquire) > 0;
+        });
+    }
+}
+#endif
+
+void init_job_system(int thread_count)
+{
+#if HAS_THREADS
+    assert(global_job_system == nullptr);
+
+    if (thread_count <= 0)
+    {
+        thread_count = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    }
+
+    auto* system = new job_system;
+    system->thread_count = thread_count;
+    system->queues = new job_queue[thread_count];
+
+    for (auto i = 1; i < thread_count; i++)
+    {
+        system->workers.emplace_back(run_job_worker, std::ref(*system), i);
+    }
+
+    global_job_system = system;
+#endif
+}
+
+int job_thread_count()
+{
+#if HAS_THREADS
+    return global_job_system != nullptr ? global_job_system->thread_count : 1;
+#else
+    return 1;
+#endif
+}
+
+#if HAS_THREADS
+static void queue_jobs(job_system& system, job_queue& queue, std::atomic<int>& queued, job* jobs, const int count)
+{
+    {
+        std::lock_guard<std::mutex> lock(queue.lock);
+        queue.jobs.insert(queue.jobs.end(), jobs, jobs + count);
+    }
+
+    queued.fetch_add(count);
+
+    //taking the lock orders this with a worker that has just found nothing and is about to sleep
+    {
+        std::lock_guard<std::mutex> lock(system.sleep_lock);
+    }
+
+    if (count == 1) system.work_queued.notify_one();
+    else system.work_queued.notify_all();
+}
+#endif
+
+void run_jobs(job* jobs, const int count, job_counter& counter)
+{
+    counter.pending.fetch_add(count, std::memory_order_relaxed);
+
+    for (auto i = 0; i < count; i++) jobs[i].counter = &counter;
+
+#if HAS_THREADS
+    auto* system = global_job_system;
+
+    if (system != nullptr && system->thread_count > 1)
+    {
+        queue_jobs(*system, system->queues[job_queue_index], system->queued, jobs, count);
+
+        //blocked waiters can help with these
+        wake_waiters(*system);
+        return;
+    }
+#endif
+
+    for (auto i = 0; i < count; i++) execute_job(jobs[i]);
+}
+
+void run_background_jobs(job* jobs, const int count, job_counter& counter)
+{
+    counter.pending.fetch_add(count, std::memory_order_relaxed);
+
+    for (auto i = 0; i < count; i++) jobs[i].counter = &counter;
+
+#if HAS_THREADS
+    auto* system = global_job_system;
+
+    if (system != nullptr && system->thread_count > 1)
+    {
+        queue_jobs(*system, system->background, system->background_queued, jobs, count);
+        return;
+    }
+#endif
+
+    for (auto i = 0; i < count; i++) execute_job(jobs[i]);
+}
+
+void wait_for_counter(const job_counter& counter)
+{
+#if HAS_THREADS
+    auto idle_rounds = 0;
+#endif
+
+    while (counter.pending.load(std::memory_order_acquire) > 0)
+    {
+#if HAS_THREADS
+        auto* system = global_job_system;
+        if (system == nullptr) continue;
+
+        job next;
+
+        if (take_job(*system, next))
+        {
+            execute_job(next);
+            idle_rounds = 0;
+            continue;
+        }
+
+        //whatever we are waiting for is running elsewhere, and is usually about to finish
+        if (idle_rounds++ < wait_spin_rounds)
+        {
+            std::this_thread::yield();
+            continue;
+        }
+
+        system->waiters.fetch_add(1);
+
+        {
+            std::unique_lock<std::mutex> lock(system->wait_lock);
+            system->wait_wakeup.wait(lock, [&]
+            {
+                return counter.pending.load() == 0 || system->queued.load() > 0;
+            });
+        }
+
+        system->waiters.fetch_sub(1);
+        idle_rounds = 0;
+#endif
+    }
+}
+
+template <typename F>
+static void run_parallel_for_range(void* data, const int begin, const int end)
+{
+    (*static_cast<const F*>(data))(begin, end);
+}
+
+template <typename F>
+void parallel_for(const int count, int grain, const F& f)
+{
+    if (count <= 0) return;
+
+    grain = std::max(grain, 1);
+    grain = std::max(grain, (count + max_parallel_for_jobs - 1) / max_parallel_for_jobs);
+
+    if (job_thread_count() == 1 || count <= grain)
+    {
+        f(0, count);
+        return;
+    }
+
+    job jobs[max_parallel_for_jobs];
+    auto job_count = 0;
+
+    for (auto begin = 0; begin < count; begin += grain)
+    {
+        auto& j = jobs[job_count++];
+
+        j.function = run_parallel_for_range<F>;
+        j.data = const_cast<F*>(&f);
+        j.begin = begin;
+        j.end = std::min(begin + grain, count);
+    }
+
+    job_counter counter;
+    run_jobs(jobs, job_count, counter);
+    wait_for_counter(counter);
+}
+
+template <typename F>
+void for_each_row_band(const int rows, const F& f)
+{
+    //a few bands per thread, thin enough to balance but thick enough that each is worth a job
+    const auto bands_per_thread = 4;
+    const auto min_band_rows = 4;
+
+    parallel_for(rows, std::max(min_band_rows, rows / (job_thread_count() * bands_per_thread)), f);
+}
@@ -0,0 +1,89 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <atomic>
+
+#include "platform_specific.h"
+
+/*
+ * Counts jobs that haven't finished yet. Jobs run with a counter decrement it
+ * when they are done, so waiting for it to reach zero waits for all of them.
+ */
+struct job_counter
+{
+    std::atomic<int> pending{};
+};
+
+using job_function = void (*)(void* data, int begin, int end);
+
+/*
+ * A function to run over [begin, end), with whatever data it needs. A job
+ * with depends_on set waits for that counter before it starts, running other
+ * jobs in the meantime.
+ */
+struct job
+{
+    job_function function{};
+    void* data{};
+    int begin{}, end{};
+
+    const job_counter* depends_on{};
+
+    //set by run_jobs()
+    job_counter* counter{};
+};
+
+/*
+ * Starts thread_count - 1 worker threads to go with the calling one, 0 means
+ * one per hardware thread. With a single thread, or before this is called,
+ * every job runs inline as it is submitted, in submission order, so results
+ * don't depend on scheduling.
+ *
+ * Each thread owns a deque of jobs. Jobs it submits go on the back and it
+ * takes work from the back too, so nested work runs depth first while it is
+ * still in cache. Idle threads steal from the front of other deques, which
+ * holds the oldest and usually largest work. Threads that aren't workers,
+ * like the main and render threads, share deque 0.
+ *
+ * Like the output buffers, the workers live until the program exits.
+ */
+void init_job_system(int thread_count);
+int job_thread_count();
+
+/*
+ * Queues count jobs, all counted against counter.
+ */
+void run_jobs(job* jobs, int count, job_counter& counter);
+
+/*
+ * Like run_jobs(), for long work that no frame waits on, like loading. These
+ * go on a queue of their own that only worker threads take from, and only
+ * when there is nothing else to do, so a thread waiting on frame work never
+ * picks up a texture decode instead.
+ */
+void run_background_jobs(job* jobs, int count, job_counter& counter);
+
+/*
+ * Returns once counter reaches zero. The calling thread runs queued jobs
+ * while it waits, so waiting from inside a job can't deadlock, but never
+ * background ones. With nothing left to run it yields for a while, then
+ * sleeps until the counter reaches zero or more jobs are queued.
+ */
+void wait_for_counter(const job_counter& counter);
+
+/*
+ * Runs f(begin, end) over chunks of [0, count) of about grain indices each,
+ * and returns once they are all done. The calling thread takes part.
+ */
+template <typename F>
+void parallel_for(int count, int grain, const F& f);
+
+/*
+ * Runs f(first_row, last_row) over bands of rows, several per thread so a
+ * slow band can be balanced by idle threads stealing the rest, and returns
+ * once every band is done.
+ */
+template <typename F>
+void for_each_row_band(int rows, const F& f);
+
+#endif
@@ -1,20 +1,47 @@
 #include <cassert>
 #include <chrono>
+#include <cstdint>
 #include <cstdio>
+#include <cstring>
 #include <vector>
 
+#include "platform_specific.h"
+
+#if HAS_THREADS
+#include <mutex>
+#include <thread>
+#endif
+
+#if HAS_WINDOW
 #define SDL_MAIN_HANDLED
 #include "./include/SDL/SDL.h"
+#endif
 
 /*
     Unity build
 */
 #include "platform_specific.cpp"
+#include "jobs.cpp"
 #include "maths.cpp"
+#include "pixel4.cpp"
 #include "image.cpp"
+#include "texture_compression.cpp"
+#include "material_texture.cpp"
+#include "sampler.cpp"
+#include "virtual_texture.cpp"
+#include "texture_cache.cpp"
+#include "texture_registry.cpp"
+#include "archive.cpp"
 #include "file.cpp"
+#include "mesh_codec.cpp"
+#include "mesh_import.cpp"
 #include "render.cpp"
+#include "upscale.cpp"
 #include "shaders.cpp"
+#include "effects.cpp"
+#include "bench.cpp"
+#include "batch.cpp"
+#include "video.cpp"
 
 /*
     App Shaders
@@ -25,11 +52,60 @@ static shader * shaders[shader_count] = {
     &blinn_shader_normal_map
 };
 
+/*
+    Post processing, run in order over every frame when use_fx is set ("--fx").
+    SSAO and the blur are off unless asked for with "--ssao" and "--blur".
+*/
+static ssao_effect ssao_effect;
+static fxaa_effect fxaa_effect;
+static blur_effect blur_effect;
+static const int effect_count = 3;
+static screen_space_effect * effects[effect_count] = {
+    &ssao_effect,
+    &fxaa_effect,
+    &blur_effect
+};
+
 /*
     Model Buffer
 */
 static int model_count;
 static model * models;
+static model_loader global_model_loader;
+
+/*
+    Assets are read from the archive built by "--pack" when there is one, and
+    from the conf file and the files it lists otherwise.
+*/
+static const char* const conf_path = "./obj/conf.bin";
+static const char* const archive_path = "./obj/assets.pak";
+
+//the model shown first, loaded before anything else
+static const int initial_model_idx = 2;
+
+/*
+    Virtual texture page cache, only used when running with "--virtual-textures".
+    256 pages of 64x64 texels is 4MB, whatever the size of the assets.
+*/
+static const int virtual_page_slots = 256;
+static page_cache virtual_page_cache;
+
+/*
+    Decoded textures, shared between every mesh that uses them.
+*/
+static texture_registry global_texture_registry;
+
+/*
+    Y4M stream of every frame shown, only open when running with "--video <path>".
+*/
+static video_sink global_video;
+
+/*
+    Scales renders smaller than the window up to it, either because of "--upscale"
+    or dynamic resolution.
+*/
+static const int upscale_window_factor = 4;
+static upscaler global_upscaler;
 
 struct ui_state
 {
@@ -38,12 +114,15 @@ struct ui_state
     bool mouse_in_window{};
     int mouse_x{};
     int mouse_y{};
+
+    //picked with the arrow keys, shown once it has loaded
+    int requested_model_idx{};
 };
 
 struct application_state
 {
     render_state gl_state;
-    ui_state ui_state;
+    ::ui_state ui_state;
 
     model* active_model{};
     int active_model_idx{};
@@ -64,16 +143,35 @@ struct application_state
 
     //true if the app will sleep in one frame.
     bool impending_sleep{};
+
+    //render resolution follows frame times when set, see "--dynamic-resolution"
+    bool dynamic_resolution{};
+    resolution_scaler resolution{};
 };
 
+application_state global_app_state;
+
+/*
+    Headless runs ("--headless", or any HEADLESS build) advance the animation by
+    this much every frame, so the same arguments always give the same frames.
+*/
+static const float headless_frame_ms = 1000.0f / 60;
+
+static bool run_headless(application_state& app_state, int frame_count, int cycle_frames, const char* output_path);
+
+#if HAS_WINDOW
 SDL_Window* global_window = nullptr;
 SDL_Surface* global_screen_surface = nullptr;
-application_state global_app_state;
 
 static int main_loop(application_state & app_state, SDL_Window* window, SDL_Surface* screen_surface);
+static void init_presentation(output_buffers* target, bool allow_direct, SDL_Surface* screen_surface);
+#if HAS_THREADS
+static void run_pipelined(application_state& app_state, SDL_Window* window, SDL_Surface* screen_surface);
+#endif
+#endif
 
 //emscripten main loop
-#ifdef EMSCRIPTEN
+#if defined(EMSCRIPTEN) && HAS_WINDOW
 #include <emscripten.h>
 #include <emscripten/html5.h>
 
@@ -85,13 +183,141 @@ EM_BOOL one_iter(double time, void* userData) {
 }
 #endif
 
+/*
+ * Maps normalised device coordinates into the middle 4/5ths of a render of the given size.
+ */
+static m4 render_viewport(const int width, const int height)
+{
+    return view_port(
+        static_cast<float>(width) / 10,
+        static_cast<float>(height) / 10,
+        static_cast<float>(width) * 4 / 5,
+        static_cast<float>(height) * 4 / 5
+    );
+}
+
+static bool has_arg(const int argc, char* args[], const char* arg)
+{
+    for (auto i = 1; i < argc; i++)
+    {
+        if (strcmp(args[i], arg) == 0) return true;
+    }
+
+    return false;
+}
+
+/*
+ * The argument following arg, or fallback when arg isn't given.
+ */
+static const char* arg_value(const int argc, char* args[], const char* arg, const char* fallback)
+{
+    for (auto i = 1; i + 1 < argc; i++)
+    {
+        if (strcmp(args[i], arg) == 0) return args[i + 1];
+    }
+
+    return fallback;
+}
+
+static bool file_exists(const char* path)
+{
+    FILE* f = nullptr;
+    open_binary_file(path, f);
+    if (f == nullptr) return false;
+
+    fclose(f);
+    return true;
+}
+
 int main(int argc, char* args[]) {
-    /* Load the models */
-    load_models("./obj/conf.bin", models, model_count);
+    const auto run_bench = has_arg(argc, args, "--bench");
+    const auto run_batch_render = has_arg(argc, args, "--batch");
+    const auto use_virtual_textures = has_arg(argc, args, "--virtual-textures");
+    const auto headless = !HAS_WINDOW || has_arg(argc, args, "--headless");
+
+    //"--threads 1" runs every job inline, in order
+    init_job_system(atoi(arg_value(argc, args, "--threads", "0")));
+
+    /* Pack the assets into an archive instead of running the app when asked to, see archive.h */
+    if (has_arg(argc, args, "--pack"))
+    {
+        return pack_models(conf_path, arg_value(argc, args, "--pack", archive_path)) ? 0 : 1;
+    }
+
+    /* Likewise for writing quantized meshes, see mesh_codec.h */
+    if (has_arg(argc, args, "--quantize-meshes"))
+    {
+        return quantize_meshes(conf_path, !has_arg(argc, args, "--no-lz")) ? 0 : 1;
+    }
+
+    /* And for converting an .obj into meshes and a conf entry, see mesh_import.h */
+    if (const auto* import_path = arg_value(argc, args, "--import", nullptr))
+    {
+        import_settings settings{};
+        settings.name = arg_value(argc, args, "--name", nullptr);
+        settings.author = arg_value(argc, args, "--author", nullptr);
+        settings.url = arg_value(argc, args, "--url", nullptr);
+
+        return import_obj(import_path, conf_path, settings) ? 0 : 1;
+    }
 
     const auto render_width = 256;
     const auto render_height = 256;
 
+    /*
+     * Open the video output before anything is printed, so streaming it to
+     * stdout can move the log to stderr first. Windowed runs drop frames the
+     * conversion can't keep up with, headless ones wait for it.
+     */
+    const auto* video_path = arg_value(argc, args, "--video", nullptr);
+
+    if (video_path != nullptr && !run_bench && !run_batch_render)
+    {
+        if (!open_video_sink(global_video, video_path, render_width, render_height, 60, !headless))
+        {
+            printf("Could not open %s for video output.\n", video_path);
+            return 1;
+        }
+    }
+
+    /*
+     * Load the models. Textures are block compressed to cut memory and
+     * bandwidth, and shared between meshes through the registry. Benchmarks
+     * skip both: they compare the formats themselves by converting every
+     * mesh's maps in place, which needs unshared, uncompressed texels.
+     */
+    texture_settings texture_settings{};
+    texture_settings.compress = !run_bench;
+    texture_settings.registry = run_bench ? nullptr : &global_texture_registry;
+
+    //"--interleave" packs each mesh's maps into one texture, read with a single fetch per pixel
+    texture_settings.interleave = !run_bench && has_arg(argc, args, "--interleave");
+
+    //"--no-texture-cache" decodes every texture, as a first run would
+    global_texture_registry.disk_cache = !has_arg(argc, args, "--no-texture-cache");
+
+    //batch workers share the models, and the page cache isn't safe to sample from several threads
+    if (use_virtual_textures && !run_bench && !run_batch_render)
+    {
+        init_page_cache(virtual_page_cache, virtual_page_slots);
+        texture_settings.virtual_cache = &virtual_page_cache;
+    }
+
+    /*
+     * Only the model shown first has to be loaded before the first frame, the
+     * rest follow on the job system.
+     */
+    const auto* asset_path = arg_value(argc, args, "--assets", file_exists(archive_path) ? archive_path : conf_path);
+
+    //"--model-budget MB" unloads models nobody has looked at in a while once they hold more than that
+    global_model_loader.memory_budget = static_cast<size_t>(atoi(arg_value(argc, args, "--model-budget", "0"))) * 1024 * 1024;
+
+    if (!start_loading_models(asset_path, models, model_count, global_model_loader, initial_model_idx, texture_settings))
+    {
+        printf("Could not load the models from %s.\n", asset_path);
+        return 1;
+    }
+
     /* Initialise application settings */
     global_app_state = application_state{
         //renderer state
@@ -102,30 +328,83 @@ int main(int argc, char* args[]) {
             v3{ 1, 1, 1 }.normalise(),
             identity(),
             projection(v3{ 0, 0, 3 }, v3{ 0, 0, 0 }),
-            view_port(
-                static_cast<float>(render_width) / 10,
-                static_cast<float>(render_height) / 10,
-                static_cast<float>(render_width) * 4 / 5,
-                static_cast<float>(render_height) * 4 / 5
-            )
+            render_viewport(render_width, render_height)
         },
         //ui state
-        { },
+        { false, false, false, 0, 0, initial_model_idx },
         //active model
-        &models[2], 2,
+        &models[initial_model_idx], initial_model_idx,
         //active shader
         shaders[0], 0,
     };
 
-    /* Initialise output buffers. The width/height values specified here determine rendering resolution */
+    /*
+     * Initialise output buffers. The width/height values specified here determine rendering resolution,
+     * or the largest it can go to with dynamic resolution.
+     */
     init_output_buffers(global_app_state.gl_state.output_buffers, render_width, render_height);
     printf("Rendering with Width:%d and Height:%d\n", render_width, render_height);
 
+    //a video's frames all have to be the same size
+    global_app_state.dynamic_resolution = has_arg(argc, args, "--dynamic-resolution") && video_path == nullptr;
+
+    ssao_effect.enabled = has_arg(argc, args, "--ssao");
+    blur_effect.enabled = has_arg(argc, args, "--blur");
+    global_app_state.use_fx = has_arg(argc, args, "--fx") || ssao_effect.enabled || blur_effect.enabled;
+
     global_app_state.background_color = rgb_to_hsl(eggshell);
 
     /* Setup initial model position and app background color */
     clear_output_buffers(global_app_state.gl_state.output_buffers, hsl_to_rgb(global_app_state.background_color));
 
+    /* Run the benchmarks instead of the app when asked to */
+    if (run_bench)
+    {
+        load_all_models(global_model_loader);
+        run_benchmarks(global_app_state.gl_state, models, model_count);
+        return 0;
+    }
+
+    /* Render every model from every side, see batch.h */
+    if (run_batch_render)
+    {
+        batch_settings settings{};
+        settings.output_path = arg_value(argc, args, "--output", settings.output_path);
+        settings.sprite_sheet = has_arg(argc, args, "--sheet");
+        settings.clear_color = hsl_to_rgb(global_app_state.background_color);
+        settings.use_fx = global_app_state.use_fx;
+        settings.ssao = ssao_effect.enabled;
+        settings.blur = blur_effect.enabled;
+
+        load_all_models(global_model_loader);
+
+        std::vector<batch_job> jobs;
+        add_turntable_jobs(jobs, global_app_state.gl_state, model_count, atoi(arg_value(argc, args, "--views", "360")));
+
+        return run_batch(global_app_state.gl_state, models, jobs, settings) ? 0 : 1;
+    }
+
+    /* Render to image files instead of a window when asked to, or when built without one */
+    if (headless)
+    {
+        const auto frame_count = atoi(arg_value(argc, args, "--frames", "1"));
+        //a video on its own doesn't need every frame as an image as well
+        const auto* output_path = arg_value(argc, args, "--output", global_video.file != nullptr ? nullptr : "frame.png");
+        //"--cycle-frames N" moves on to the next model every N frames
+        const auto cycle_frames = atoi(arg_value(argc, args, "--cycle-frames", "0"));
+        const auto rendered = run_headless(global_app_state, frame_count, cycle_frames, output_path);
+
+        //loads still running would outlive the registry
+        wait_for_models(global_model_loader);
+        close_video_sink(global_video);
+        return rendered ? 0 : 1;
+    }
+
+#if HAS_WINDOW
+    //"--upscale" presents to a larger window than we render, through the upscaler
+    const auto window_factor = has_arg(argc, args, "--upscale") ? upscale_window_factor : 1;
+    const auto window_width = render_width * window_factor;
+    const auto window_height = render_height * window_factor;
 
     /* Initialise SDL and begin main loop */
     if (SDL_Init(SDL_INIT_VIDEO) < 0) {
@@ -136,7 +415,7 @@ int main(int argc, char* args[]) {
     {
         global_window = SDL_CreateWindow(
                             "Software Renderer", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
-                            render_width, render_height, 0
+                            window_width, window_height, 0
                         );
         if (global_window == nullptr)
         {
@@ -148,42 +427,93 @@ int main(int argc, char* args[]) {
 
 #ifdef EMSCRIPTEN
 
+            //render straight into the window surface when its format allows, scaled renders need their own buffers
+            init_presentation(
+                &global_app_state.gl_state.output_buffers, !global_app_state.dynamic_resolution, global_screen_surface
+            );
+
             //emscripten main loop
             emscripten_request_animation_frame_loop(one_iter, 0);
 
 #else
 
-            //desktop main loop
             global_app_state.running = true;
-            while (global_app_state.running) {
-                main_loop(global_app_state, global_window, global_screen_surface);
+
+            /*
+             * Desktop main loop. By default rendering runs on its own thread
+             * while this one presents, "--no-pipeline" does both in turn here.
+             */
+            if (!has_arg(argc, args, "--no-pipeline")) {
+                init_presentation(nullptr, false, global_screen_surface);
+                run_pipelined(global_app_state, global_window, global_screen_surface);
+            }
+            else {
+                init_presentation(
+                    &global_app_state.gl_state.output_buffers, !global_app_state.dynamic_resolution, global_screen_surface
+                );
+
+                while (global_app_state.running) {
+                    main_loop(global_app_state, global_window, global_screen_surface);
+                }
             }
 
+            wait_for_models(global_model_loader);
+            close_video_sink(global_video);
             SDL_Quit();
 
 #endif
         }
     }
+#endif
 
     return 0;
 }
 
-static void poll_events(application_state& app_state);
-static void draw_scene(application_state & app_state, SDL_Surface* screen_surface);
+static void update_active_model(application_state& app_state, int requested);
+static void update_model_transform(application_state& app_state);
+static void post_process(application_state& app_state);
+static void draw_scene(application_state & app_state);
+
+#if HAS_WINDOW
+static void update_render_resolution(application_state& app_state);
+static void poll_events(application_state& app_state, SDL_Window* window);
+static void present_output_buffers(output_buffers& output_buffers, SDL_Surface* screen_surface);
 static void copy_frame_buffer_to_screen(application_state& app_state, SDL_Surface* screen_surface);
 
+#if HAS_THREADS
+/*
+ * Pipelined rendering. The render thread draws into one set of the triple
+ * buffer while the main thread presents the last finished set and clears it
+ * for reuse. Input is the only other state the threads share, it is written
+ * by poll_events() and read by the render thread under input_lock.
+ */
+static output_triple_buffer global_triple_buffer;
+static std::atomic<bool> render_thread_running{};
+static std::mutex input_lock;
+
+//longest the presenter sleeps waiting for a frame before it polls input again, about one frame at 60 Hz
+static const int present_wait_ms = 16;
+
+#endif
+
 static int main_loop(application_state & app_state, SDL_Window* window, SDL_Surface* screen_surface)
 {
     const auto start = std::chrono::high_resolution_clock::now();
 
     //get user input
-    poll_events(app_state);
+    poll_events(app_state, window);
 
     //render the scene
-    draw_scene(app_state, screen_surface);
+    draw_scene(app_state);
+
+    post_process(app_state);
+
+    //stream in the virtual texture pages this frame asked for
+    update_page_cache(virtual_page_cache);
 
     //blit the render to the window
     copy_frame_buffer_to_screen(app_state, screen_surface);
+    submit_video_frame(global_video, app_state.gl_state.output_buffers);
 
     //Update the window
     SDL_UpdateWindowSurface( window );
@@ -200,14 +530,23 @@ static int main_loop(application_state & app_state, SDL_Window* window, SDL_Surf
     app_state.gl_state.dt = frame_duration_seconds;
     app_state.gl_state.culm_dt += frame_duration_seconds;
 
+    update_render_resolution(app_state);
+
     return 0;
 }
 
-static void poll_events(application_state & app_state)
+static void poll_events(application_state & app_state, SDL_Window* window)
 {
+#if HAS_THREADS
+    std::lock_guard<std::mutex> lock(input_lock);
+#endif
+
+    auto window_height = 0;
+    SDL_GetWindowSize(window, nullptr, &window_height);
+
     SDL_GetMouseState(&app_state.ui_state.mouse_x, &app_state.ui_state.mouse_y);
     //invert mouse y - want bottom left to be window origin (matches output buffers)
-    app_state.ui_state.mouse_y = app_state.gl_state.output_buffers.frame_buffer.height - app_state.ui_state.mouse_y;
+    app_state.ui_state.mouse_y = window_height - app_state.ui_state.mouse_y;
 
     //reset mouse down state for this frame
     app_state.ui_state.mouse_down_this_frame = false;
@@ -245,6 +584,18 @@ static void poll_events(application_state & app_state)
         }
         break;
 
+        case SDL_KEYDOWN: {
+            auto& requested = app_state.ui_state.requested_model_idx;
+
+            if (e.key.keysym.sym == SDLK_RIGHT) {
+                requested = (requested + 1) % model_count;
+            }
+            else if (e.key.keysym.sym == SDLK_LEFT) {
+                requested = (requested + model_count - 1) % model_count;
+            }
+        }
+        break;
+
         default:
             ;
         }
@@ -266,8 +617,46 @@ static void poll_events(application_state & app_state)
         }
     }
 }
+#endif
+
+static void draw_scene(application_state & app_state)
+{
+    update_active_model(app_state, app_state.ui_state.requested_model_idx);
+    update_model_transform(app_state);
+
+    //render the model
+    draw_model(*app_state.active_model, app_state.gl_state, *app_state.active_shader);
+}
+
+/*
+ * Switches to the requested model once it has loaded, drawing the current
+ * one until then. Runs on the thread that draws, between frames, so models
+ * it unloads can't be in use.
+ */
+static void update_active_model(application_state& app_state, const int requested)
+{
+    auto& loader = global_model_loader;
+
+    use_model(loader, app_state.active_model_idx);
+
+    if (requested != app_state.active_model_idx)
+    {
+        use_model(loader, requested);
+
+        if (model_loaded(loader, requested))
+        {
+            app_state.active_model = &models[requested];
+            app_state.active_model_idx = requested;
+        }
+    }
+
+    //models are browsed in order, the next one along is the likeliest to be asked for
+    prefetch_model(loader, (app_state.active_model_idx + 1) % model_count);
+
+    trim_models(loader);
+}
 
-static void draw_scene(application_state & app_state, SDL_Surface* screen_surface)
+static void update_model_transform(application_state& app_state)
 {
     // animate the model when we aren't manually rotating it
     if(!app_state.ui_state.mouse_down){
@@ -284,9 +673,128 @@ static void draw_scene(application_state & app_state, SDL_Surface* screen_surfac
                                     * rot_x(app_state.target_rot.x)
                                     * rot_y(app_state.target_rot.y)
                                     * trans(app_state.target_trans);
+}
 
-    //render the model
-    draw_model(*app_state.active_model, app_state.gl_state, *app_state.active_shader);
+/*
+ * Runs the post processing chain over the frame, printing how long each
+ * effect's passes take every few seconds.
+ */
+static void post_process(application_state& app_state)
+{
+    static const int frames_between_timings = 240;
+    static int frames = 0;
+
+    if (!app_state.use_fx) return;
+
+    apply_effects(app_state.gl_state.output_buffers, effects, effect_count);
+
+    if (++frames % frames_between_timings == 0) {
+        print_effect_timings(effects, effect_count);
+    }
+}
+
+/*
+ * Builds the file name for one frame of a headless run. Single frames go
+ * to output_path itself, sequences get the frame number before the extension.
+ */
+static void headless_frame_path(char* path, const size_t size, const char* output_path, const int frame, const int frame_count)
+{
+    if (frame_count == 1)
+    {
+        snprintf(path, size, "%s", output_path);
+        return;
+    }
+
+    const auto* extension = strrchr(output_path, '.');
+    const auto stem_length = static_cast<int>(extension != nullptr ? extension - output_path : strlen(output_path));
+
+    snprintf(path, size, "%.*s_%04d%s", stem_length, output_path, frame, extension != nullptr ? extension : "");
+}
+
+/*
+ * Renders frame_count frames without a window and writes each to an image
+ * file (see headless_frame_path(), skipped when output_path is null) and the
+ * video sink if one is open. Frame times are fixed rather than measured so
+ * runs are repeatable, which leaves dynamic resolution nothing to follow.
+ * With cycle_frames set it moves on to the next model every cycle_frames
+ * frames. Fails, stopping early, when a frame can't be written.
+ */
+static bool run_headless(application_state& app_state, const int frame_count, const int cycle_frames, const char* output_path)
+{
+    auto& state = app_state.gl_state;
+    auto& buffers = state.output_buffers;
+
+    const auto start = std::chrono::high_resolution_clock::now();
+
+    for (auto frame = 0; frame < frame_count; frame++)
+    {
+        if (cycle_frames > 0 && frame > 0 && frame % cycle_frames == 0)
+        {
+            auto& requested = app_state.ui_state.requested_model_idx;
+            requested = (requested + 1) % model_count;
+
+            //waited for, so the same arguments switch on the same frame
+            use_model(global_model_loader, requested);
+            wait_for_models(global_model_loader);
+        }
+
+        draw_scene(app_state);
+
+        post_process(app_state);
+
+        //stream in the virtual texture pages this frame asked for
+        update_page_cache(virtual_page_cache);
+
+        //fill whatever nothing drew to before writing the frame out
+        resolve_output_buffers(buffers);
+
+        submit_video_frame(global_video, buffers);
+
+        if (output_path != nullptr)
+        {
+            char path[1024];
+            headless_frame_path(path, sizeof(path), output_path, frame, frame_count);
+
+            if (!save_image(path, buffers.frame_buffer))
+            {
+                return false;
+            }
+        }
+
+        clear_output_buffers(buffers, hsl_to_rgb(app_state.background_color));
+
+        state.dt = headless_frame_ms;
+        state.culm_dt += headless_frame_ms;
+    }
+
+    const auto stop = std::chrono::high_resolution_clock::now();
+    const auto total_ms = std::chrono::duration<double, std::milli>(stop - start).count();
+
+    printf("Wrote %d frames in %.1f ms (%.2f ms per frame)\n", frame_count, total_ms, total_ms / std::max(frame_count, 1));
+    return true;
+}
+
+#if HAS_WINDOW
+/*
+ * Picks the size to render the next frame at from the last frame's time.
+ * Presentation scales whatever size we end up with to the window.
+ */
+static void update_render_resolution(application_state& app_state)
+{
+    if (!app_state.dynamic_resolution) return;
+
+    auto& state = app_state.gl_state;
+    auto& buffers = state.output_buffers;
+
+    update_resolution_scale(app_state.resolution, state.dt);
+
+    auto width = 0, height = 0;
+    scaled_render_size(app_state.resolution, buffers.max_width, buffers.max_height, width, height);
+
+    if (width == buffers.frame_buffer.width && height == buffers.frame_buffer.height) return;
+
+    resize_output_buffers(buffers, width, height);
+    state.viewport = render_viewport(width, height);
 }
 
 struct bit_scan_result
@@ -317,31 +825,328 @@ static bit_scan_result find_least_significant_set_bit(const int value)
     return result;
 }
 
-static void copy_frame_buffer_to_screen(application_state& app_state, SDL_Surface* screen_surface)
+/*
+ * How frames get to the window surface, worked out once from its pixel format.
+ * When the surface stores pixels as rgba or bgra bytes, tightly packed, we
+ * render into it directly and presenting costs nothing beyond the clears of
+ * untouched tiles. Any other 32 bit format falls back to repacking each frame.
+ */
+struct presentation
+{
+    bool direct{};
+
+    //the surface stores pixels as rgba or bgra bytes, frames rendered in that order are copied as is
+    bool native{};
+    pixel_order order = pixel_order::rgba;
+
+    //channel shifts for the repacking fallback
+    int r_shift{}, g_shift{}, b_shift{};
+};
+
+static presentation global_presentation;
+
+/*
+ * Target is the output buffers the app renders into, or nullptr when they
+ * are set up elsewhere (see run_pipelined). They get the surface's byte order
+ * when it has one we support and, if allow_direct is set and the sizes match,
+ * are rendered straight into the surface.
+ */
+static void init_presentation(output_buffers* target, const bool allow_direct, SDL_Surface* screen_surface)
 {
-    auto& frame_buffer = app_state.gl_state.output_buffers.frame_buffer;
+    const auto* format = screen_surface->format;
 
-    auto* frame_pixels = reinterpret_cast<rgba*>(app_state.gl_state.output_buffers.frame_buffer.data);
-    auto* target = static_cast<unsigned int*>(screen_surface->pixels);
+    //the frame buffer, like the rest of the renderer, assumes 32 bit pixels
+    assert(format->BytesPerPixel == 4);
 
-    const auto r_shift = find_least_significant_set_bit(screen_surface->format->Rmask);
-    const auto b_shift = find_least_significant_set_bit(screen_surface->format->Bmask);
-    const auto g_shift = find_least_significant_set_bit(screen_surface->format->Gmask);
+    const auto r_shift = find_least_significant_set_bit(format->Rmask);
+    const auto g_shift = find_least_significant_set_bit(format->Gmask);
+    const auto b_shift = find_least_significant_set_bit(format->Bmask);
 
     assert(r_shift.found);
-    assert(b_shift.found);
     assert(g_shift.found);
+    assert(b_shift.found);
+
+    auto& p = global_presentation;
+    p = presentation{};
+    p.r_shift = r_shift.index;
+    p.g_shift = g_shift.index;
+    p.b_shift = b_shift.index;
+
+    //byte order in memory, for a little endian machine
+    const auto rgba_order = p.r_shift == 0 && p.g_shift == 8 && p.b_shift == 16;
+    const auto bgra_order = p.r_shift == 16 && p.g_shift == 8 && p.b_shift == 0;
+
+    p.native = rgba_order || bgra_order;
+    p.order = bgra_order ? pixel_order::bgra : pixel_order::rgba;
+
+    if (target != nullptr && p.native)
+    {
+        const auto& frame_buffer = target->frame_buffer;
+
+        target->order = p.order;
+
+        p.direct = allow_direct &&
+                   screen_surface->pitch == frame_buffer.width * 4 &&
+                   screen_surface->w == frame_buffer.width &&
+                   screen_surface->h == frame_buffer.height &&
+                   !SDL_MUSTLOCK(screen_surface);
+    }
+
+    if (p.direct)
+    {
+        use_external_frame_buffer(*target, static_cast<unsigned char*>(screen_surface->pixels), p.order);
+    }
+
+    printf(
+        "Presenting %s (%s)\n",
+        p.direct ? "directly from the window surface" : p.native ? "by copying each frame" : "by repacking each frame",
+        SDL_GetPixelFormatName(format->format)
+    );
+}
 
-    for (auto y = 0; y < frame_buffer.height; y++) {
-        for (auto x = 0; x < frame_buffer.width; x++) {
-            const auto old_pixel = *frame_pixels++;
+/*
+ * Repacks one row of rgba pixels into the surface format. The SSE2 path does
+ * four pixels at a time and streams them out when the target is aligned, the
+ * surface is only written here so there is no point pulling it into cache.
+ */
+static void repack_row(const rgba* source, unsigned int* target, const int count, const presentation& p)
+{
+    auto x = 0;
 
-            //don't blit alpha, sdl screen surface doesn't let us anyway
-            const int r = old_pixel.r;
-            const int g = old_pixel.g;
-            const int b = old_pixel.b;
+#if HAS_SSE2
+    const auto byte_mask = _mm_set1_epi32(0xFF);
+    const auto r_shift = _mm_cvtsi32_si128(p.r_shift);
+    const auto g_shift = _mm_cvtsi32_si128(p.g_shift);
+    const auto b_shift = _mm_cvtsi32_si128(p.b_shift);
 
-            *target++ = r << r_shift.index | g << g_shift.index | b << b_shift.index;
+    const auto aligned = (reinterpret_cast<uintptr_t>(target) & 15) == 0;
+
+    for (; x + 4 <= count; x += 4)
+    {
+        const auto pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + x));
+
+        const auto r = _mm_and_si128(pixels, byte_mask);
+        const auto g = _mm_and_si128(_mm_srli_epi32(pixels, 8), byte_mask);
+        const auto b = _mm_and_si128(_mm_srli_epi32(pixels, 16), byte_mask);
+
+        const auto out = _mm_or_si128(
+            _mm_sll_epi32(r, r_shift),
+            _mm_or_si128(_mm_sll_epi32(g, g_shift), _mm_sll_epi32(b, b_shift))
+        );
+
+        if (aligned) _mm_stream_si128(reinterpret_cast<__m128i*>(target + x), out);
+        else _mm_storeu_si128(reinterpret_cast<__m128i*>(target + x), out);
+    }
+#endif
+
+    for (; x < count; x++)
+    {
+        //don't blit alpha, sdl screen surface doesn't let us anyway
+        const unsigned int r = source[x].r;
+        const unsigned int g = source[x].g;
+        const unsigned int b = source[x].b;
+
+        target[x] = r << p.r_shift | g << p.g_shift | b << p.b_shift;
+    }
+}
+
+static void copy_frame_buffer_to_screen(application_state& app_state, SDL_Surface* screen_surface)
+{
+    auto& output_buffers = app_state.gl_state.output_buffers;
+
+    //we rendered into the surface, only the tiles nothing drew to still need their clear
+    if (global_presentation.direct)
+    {
+        resolve_output_buffers(output_buffers);
+        return;
+    }
+
+    present_output_buffers(output_buffers, screen_surface);
+}
+
+/*
+ * Upscales a render smaller than the window. Frames in the surface's own byte
+ * order are upscaled straight into it, anything else goes through a scratch
+ * image and gets repacked.
+ */
+static void present_scaled_output_buffers(output_buffers& output_buffers, SDL_Surface* screen_surface, const bool copy_rows)
+{
+    static image scaled;
+
+    const auto& p = global_presentation;
+    auto* target_pixels = static_cast<unsigned int*>(screen_surface->pixels);
+    const auto target_stride = screen_surface->pitch / static_cast<int>(sizeof(unsigned int));
+
+    if (copy_rows) {
+        upscale_frame(
+            global_upscaler, output_buffers,
+            reinterpret_cast<rgba*>(target_pixels), screen_surface->w, screen_surface->h, target_stride
+        );
+        return;
+    }
+
+    if (scaled.data == nullptr) {
+        scaled.width = screen_surface->w;
+        scaled.height = screen_surface->h;
+        scaled.n_channels = 4;
+        scaled.data = new unsigned char[scaled.width * scaled.height * 4];
+    }
+
+    auto* scaled_pixels = reinterpret_cast<rgba*>(scaled.data);
+    upscale_frame(global_upscaler, output_buffers, scaled_pixels, scaled.width, scaled.height, scaled.width);
+
+    for (auto y = 0; y < scaled.height; y++) {
+        repack_row(scaled_pixels + y * scaled.width, target_pixels + y * target_stride, scaled.width, p);
+    }
+
+#if HAS_SSE2
+    _mm_sfence();
+#endif
+}
+
+/*
+ * Writes a frame we rendered into our own buffers to the surface. Tiles still
+ * pending a clear are filled with the clear colour instead of being read.
+ */
+static void present_output_buffers(output_buffers& output_buffers, SDL_Surface* screen_surface)
+{
+    auto& frame_buffer = output_buffers.frame_buffer;
+    const auto& p = global_presentation;
+
+    //frames in the surface's own byte order only need copying
+    const auto copy_rows = p.native && output_buffers.order == p.order;
+    assert(copy_rows || output_buffers.order == pixel_order::rgba);
+
+    //a render smaller than the window, from "--upscale" or dynamic resolution
+    if (frame_buffer.width != screen_surface->w || frame_buffer.height != screen_surface->h) {
+        present_scaled_output_buffers(output_buffers, screen_surface, copy_rows);
+        return;
+    }
+
+    auto* frame_pixels = reinterpret_cast<rgba*>(frame_buffer.data);
+    auto* target_pixels = static_cast<unsigned int*>(screen_surface->pixels);
+    const auto target_stride = screen_surface->pitch / static_cast<int>(sizeof(unsigned int));
+
+    const auto clear = output_buffers.clear_color;
+    const auto packed_clear = static_cast<unsigned int>(
+        clear.r << p.r_shift | clear.g << p.g_shift | clear.b << p.b_shift
+    );
+
+    for (auto tile_y = 0; tile_y < output_buffers.tiles_y; tile_y++) {
+        for (auto tile_x = 0; tile_x < output_buffers.tiles_x; tile_x++) {
+            const auto x0 = tile_x * output_tile_size;
+            const auto x1 = std::min(x0 + output_tile_size, frame_buffer.width);
+            const auto y0 = tile_y * output_tile_size;
+            const auto y1 = std::min(y0 + output_tile_size, frame_buffer.height);
+
+            //nothing drew here this frame, so the frame buffer still holds an old frame
+            const auto pending_clear = output_buffers.tile_pending_clear[tile_y * output_buffers.tiles_x + tile_x];
+
+            for (auto y = y0; y < y1; y++) {
+                auto* target = target_pixels + y * target_stride + x0;
+
+                if (pending_clear) {
+                    for (auto x = x0; x < x1; x++) *target++ = packed_clear;
+                    continue;
+                }
+
+                const auto* source = frame_pixels + y * frame_buffer.width + x0;
+
+                if (copy_rows) memcpy(target, source, sizeof(rgba) * (x1 - x0));
+                else repack_row(source, target, x1 - x0, p);
+            }
+        }
+    }
+
+#if HAS_SSE2
+    //make the streamed stores visible before sdl reads the surface
+    _mm_sfence();
+#endif
+}
+
+#if HAS_THREADS
+static void render_thread_loop(application_state& app_state)
+{
+    auto& state = app_state.gl_state;
+
+    while (render_thread_running.load(std::memory_order_acquire))
+    {
+        const auto start = std::chrono::high_resolution_clock::now();
+
+        auto requested = 0;
+
+        {
+            std::lock_guard<std::mutex> lock(input_lock);
+            requested = app_state.ui_state.requested_model_idx;
+            update_model_transform(app_state);
+        }
+
+        //loads and unloads models, so kept out of the lock the presenter takes for every batch of input
+        update_active_model(app_state, requested);
+
+        draw_model(*app_state.active_model, state, *app_state.active_shader);
+
+        post_process(app_state);
+
+        //stream in the virtual texture pages this frame asked for
+        update_page_cache(virtual_page_cache);
+
+        //the presenter clears the set once it is shown, tell it what colour to use
+        state.output_buffers.clear_color = hsl_to_rgb(app_state.background_color);
+        state.output_buffers = publish_output_buffers(global_triple_buffer, state.output_buffers);
+
+        //calculate and store delta time
+        const auto stop = std::chrono::high_resolution_clock::now();
+        const auto duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - start);
+
+        const auto frame_duration_seconds = duration.count() / 1000.0f;
+
+        state.dt = frame_duration_seconds;
+        state.culm_dt += frame_duration_seconds;
+
+        update_render_resolution(app_state);
+    }
+}
+
+static void run_pipelined(application_state& app_state, SDL_Window* window, SDL_Surface* screen_surface)
+{
+    auto& state = app_state.gl_state;
+    const auto& frame_buffer = state.output_buffers.frame_buffer;
+    const auto clear_color = hsl_to_rgb(app_state.background_color);
+
+    //render in the surface's byte order when it has one we support, so presenting is a straight copy
+    init_output_triple_buffer(global_triple_buffer, frame_buffer.width, frame_buffer.height, global_presentation.order);
+
+    for (auto& buffers : global_triple_buffer.buffers) {
+        clear_output_buffers(buffers, clear_color);
+    }
+
+    state.output_buffers = global_triple_buffer.buffers[global_triple_buffer.rendering];
+
+    render_thread_running = true;
+    std::thread render_thread(render_thread_loop, std::ref(app_state));
+
+    while (app_state.running) {
+        poll_events(app_state, window);
+
+        auto* frame = acquire_output_buffers(global_triple_buffer);
+
+        //nothing new to show yet, sleep until there is rather than taking a core from the renderer
+        if (frame == nullptr) {
+            wait_for_output_buffers(global_triple_buffer, present_wait_ms);
+            continue;
         }
+
+        present_output_buffers(*frame, screen_surface);
+        submit_video_frame(global_video, *frame);
+        SDL_UpdateWindowSurface(window);
+
+        //clear the set here rather than on the render thread, it comes back ready to draw into
+        recycle_output_buffers(global_triple_buffer);
     }
-}
\ No newline at end of file
+
+    render_thread_running = false;
+    render_thread.join();
+}
+#endif
+#endif
@@ -0,0 +1,113 @@
+#include <cassert>
+#include <cmath>
+#include <cstdlib>
+
+#include "material_texture.h"
+#include "texture_compression.h"
+
+/*
+ * Reads a texel of a linear map at the position matching (x, y) in a
+ * texture of the given size, using nearest neighbour when the sizes differ.
+ */
+static rgba read_resampled(const image& map, const int x, const int y, const int width, const int height)
+{
+    assert(map.format == image_format::rgba8);
+    assert(map.layout == image_layout::linear);
+
+    const auto map_x = map.width == width ? x : x * map.width / width;
+    const auto map_y = map.height == height ? y : y * map.height / height;
+
+    return reinterpret_cast<const rgba*>(map.data)[map_y * map.width + map_x];
+}
+
+void pack_material_texture(
+    const image& diffuse, const image* normal, const image* spec, const image* emission,
+    material_texture& out
+)
+{
+    const auto width = diffuse.width;
+    const auto height = diffuse.height;
+
+    out.width = width;
+    out.height = height;
+    out.data = static_cast<material_texel*>(malloc(sizeof(material_texel) * width * height));
+    assert(out.data != nullptr);
+
+    auto* walk = out.data;
+
+    for (auto y = 0; y < height; y++)
+    {
+        for (auto x = 0; x < width; x++)
+        {
+            const auto dif = read_resampled(diffuse, x, y, width, height);
+
+            material_texel texel{};
+            texel.r = dif.r;
+            texel.g = dif.g;
+            texel.b = dif.b;
+
+            //flat tangent space normal by default
+            texel.normal_x = 128;
+            texel.normal_y = 128;
+
+            if (normal != nullptr)
+            {
+                const auto n = read_resampled(*normal, x, y, width, height);
+                texel.normal_x = n.r;
+                texel.normal_y = n.g;
+            }
+
+            //the shader reads specular power from the blue channel
+            if (spec != nullptr)
+            {
+                texel.spec = read_resampled(*spec, x, y, width, height).b;
+            }
+
+            if (emission != nullptr)
+            {
+                texel.emission = pack_565(read_resampled(*emission, x, y, width, height));
+            }
+
+            *walk++ = texel;
+        }
+    }
+}
+
+void free_material_texture(material_texture& tex)
+{
+    free(tex.data);
+    tex = material_texture{};
+}
+
+inline material_texel get_material_texel(const material_texture& tex, const int x, int y)
+{
+    //read from bottom up
+    y = tex.height - y - 1;
+
+    //bounds check
+    assert(x >= 0 && x < tex.width);
+    assert(y >= 0 && y < tex.height);
+
+    return tex.data[y * tex.width + x];
+}
+
+inline rgba material_diffuse(const material_texel& texel)
+{
+    return { texel.r, texel.g, texel.b, 255 };
+}
+
+inline v3 material_normal(const material_texel& texel)
+{
+    const auto nx = static_cast<float>(texel.normal_x) / 255.0f * 2.0f - 1.0f;
+    const auto ny = static_cast<float>(texel.normal_y) / 255.0f * 2.0f - 1.0f;
+
+    //tangent space normals always point out of the surface, so z is positive
+    const auto nz_sq = 1.0f - nx * nx - ny * ny;
+
+    return { nx, ny, nz_sq > 0 ? std::sqrt(nz_sq) : 0.0f };
+}
+
+inline rgba material_emission(const material_texel& texel)
+{
+    return unpack_565(texel.emission);
+}
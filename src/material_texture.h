@@ -0,0 +1,53 @@
+#ifndef MATERIAL_TEXTURE_H
+#define MATERIAL_TEXTURE_H
+
+#include <cstdint>
+
+#include "image.h"
+
+/*
+ * One texel of every map a mesh uses, packed into 8 bytes so the shader gets
+ * diffuse, normal, spec and emission from a single aligned load that never
+ * straddles a cache line.
+ *
+ * The normal only stores x and y, z is rebuilt when sampled. Emission is
+ * stored as rgb565.
+ */
+struct material_texel
+{
+    uint8_t r, g, b;
+    uint8_t spec;
+    uint8_t normal_x, normal_y;
+    uint16_t emission;
+};
+
+static_assert(sizeof(material_texel) == 8, "material texels must be 8 bytes");
+
+/*
+ * A mesh's maps interleaved into one row-major texture, at the resolution of
+ * the diffuse map. This relies on all maps of a mesh sharing one uv layout,
+ * which holds for every model in obj/.
+ */
+struct material_texture
+{
+    int width{}, height{};
+    material_texel* data{};
+};
+
+/*
+ * Packs the maps into out. Only diffuse is required; missing maps are stored
+ * as a flat normal, zero spec and no emission. Maps with a different size to
+ * the diffuse map are resampled to it. All maps must be linear rgba8.
+ */
+void pack_material_texture(
+    const image& diffuse, const image* normal, const image* spec, const image* emission,
+    material_texture& out
+);
+void free_material_texture(material_texture& tex);
+
+inline material_texel get_material_texel(const material_texture& tex, int x, int y);
+inline rgba material_diffuse(const material_texel& texel);
+inline v3 material_normal(const material_texel& texel);
+inline rgba material_emission(const material_texel& texel);
+
+#endif
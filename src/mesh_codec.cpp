@@ -0,0 +1,549 @@
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#include "mesh_codec.h"
+
+static const char quantized_mesh_magic[4] = { 'Q', 'M', 'S', 'H' };
+static const uint32_t quantized_mesh_version = 2;
+
+//flags
+static const uint32_t quantized_mesh_lz = 1;
+static const uint32_t quantized_mesh_index16 = 2;
+
+struct quantized_mesh_header
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t flags;
+
+    uint32_t vert_count;
+    uint32_t face_count;
+    uint32_t uv_count;
+    uint32_t normal_count;
+    uint32_t reserved;
+
+    float position_min[3];
+    float position_max[3];
+    float uv_min[2];
+    float uv_max[2];
+
+    //size of the payload once decompressed, and as stored after the header
+    uint64_t payload_size;
+    uint64_t stored_size;
+
+    //the .bin this was made from
+    uint64_t source_size;
+    int64_t source_mtime;
+};
+
+static_assert(sizeof(quantized_mesh_header) == 104, "quantized_mesh_header is part of the file format");
+
+/*
+ * LZ77 in the style of LZ4. Each sequence is a token, whose high nibble is
+ * the number of literals and low nibble the match length less 4, then the
+ * literals and a 16 bit offset back to the match. A nibble of 15 continues
+ * in the following bytes, each adding up to 255. The last sequence is
+ * literals only.
+ */
+static const size_t lz_min_match = 4;
+static const size_t lz_max_offset = 65535;
+static const int lz_hash_bits = 14;
+
+static uint32_t read_u32(const unsigned char* bytes)
+{
+    uint32_t value = 0;
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+static void put_lz_length(std::vector<unsigned char>& out, size_t length)
+{
+    while (length >= 255)
+    {
+        out.push_back(255);
+        length -= 255;
+    }
+
+    out.push_back(static_cast<unsigned char>(length));
+}
+
+static void put_lz_sequence(
+    std::vector<unsigned char>& out, const unsigned char* literals, const size_t literal_count,
+    const size_t offset, const size_t match_length
+)
+{
+    const auto match_code = match_length > 0 ? match_length - lz_min_match : 0;
+
+    out.push_back(static_cast<unsigned char>((std::min<size_t>(literal_count, 15) << 4) | std::min<size_t>(match_code, 15)));
+
+    if (literal_count >= 15) put_lz_length(out, literal_count - 15);
+    out.insert(out.end(), literals, literals + literal_count);
+
+    if (match_length == 0) return;
+
+    out.push_back(static_cast<unsigned char>(offset & 0xFF));
+    out.push_back(static_cast<unsigned char>(offset >> 8));
+
+    if (match_code >= 15) put_lz_length(out, match_code - 15);
+}
+
+static void lz_compress(const unsigned char* in, const size_t size, std::vector<unsigned char>& out)
+{
+    std::vector<int64_t> last_seen(static_cast<size_t>(1) << lz_hash_bits, -1);
+
+    size_t anchor = 0;
+    size_t i = 0;
+
+    while (i + lz_min_match <= size)
+    {
+        const auto sequence = read_u32(in + i);
+        const auto hash = (sequence * 2654435761u) >> (32 - lz_hash_bits);
+
+        const auto candidate = last_seen[hash];
+        last_seen[hash] = static_cast<int64_t>(i);
+
+        if (candidate < 0 || i - static_cast<size_t>(candidate) > lz_max_offset || read_u32(in + candidate) != sequence)
+        {
+            i++;
+            continue;
+        }
+
+        auto length = lz_min_match;
+        while (i + length < size && in[candidate + length] == in[i + length]) length++;
+
+        put_lz_sequence(out, in + anchor, i - anchor, i - static_cast<size_t>(candidate), length);
+
+        i += length;
+        anchor = i;
+    }
+
+    put_lz_sequence(out, in + anchor, size - anchor, 0, 0);
+}
+
+static bool read_lz_length(const unsigned char*& in, const unsigned char* end, size_t& length)
+{
+    for (;;)
+    {
+        if (in == end) return false;
+
+        const auto byte = *in++;
+        length += byte;
+
+        if (byte < 255) return true;
+    }
+}
+
+/*
+ * Fails unless the input decodes to exactly size bytes.
+ */
+static bool lz_decompress(const unsigned char* in, const size_t in_size, unsigned char* out, const size_t size)
+{
+    const auto* end = in + in_size;
+    size_t written = 0;
+
+    while (in < end)
+    {
+        const auto token = *in++;
+
+        size_t literal_count = token >> 4;
+        if (literal_count == 15 && !read_lz_length(in, end, literal_count)) return false;
+
+        if (static_cast<size_t>(end - in) < literal_count || size - written < literal_count) return false;
+
+        memcpy(out + written, in, literal_count);
+        in += literal_count;
+        written += literal_count;
+
+        //the last sequence has no match
+        if (in == end) break;
+
+        if (end - in < 2) return false;
+
+        const auto offset = static_cast<size_t>(in[0]) | static_cast<size_t>(in[1]) << 8;
+        in += 2;
+
+        size_t match_length = token & 0xF;
+        if (match_length == 15 && !read_lz_length(in, end, match_length)) return false;
+        match_length += lz_min_match;
+
+        if (offset == 0 || offset > written || size - written < match_length) return false;
+
+        //matches can overlap what they write
+        for (size_t i = 0; i < match_length; i++, written++) out[written] = out[written - offset];
+    }
+
+    return written == size;
+}
+
+/*
+ * Stores values of bytes_per_value bytes as planes, every value's low byte
+ * first, then every second byte and so on.
+ */
+static void put_planes(std::vector<unsigned char>& out, const std::vector<uint32_t>& values, const int bytes_per_value)
+{
+    for (auto plane = 0; plane < bytes_per_value; plane++)
+    {
+        for (const auto value : values) out.push_back(static_cast<unsigned char>(value >> (plane * 8)));
+    }
+}
+
+static bool read_planes(
+    const unsigned char*& in, const unsigned char* end, uint32_t* values, const size_t count, const int bytes_per_value
+)
+{
+    if (static_cast<size_t>(end - in) / bytes_per_value < count) return false;
+
+    for (size_t i = 0; i < count; i++) values[i] = 0;
+
+    for (auto plane = 0; plane < bytes_per_value; plane++)
+    {
+        for (size_t i = 0; i < count; i++) values[i] |= static_cast<uint32_t>(*in++) << (plane * 8);
+    }
+
+    return true;
+}
+
+static uint32_t quantize_unorm16(const float value, const float min, const float max)
+{
+    const auto extent = max - min;
+    if (extent <= 0) return 0;
+
+    const auto unit = std::min(std::max((value - min) / extent, 0.0f), 1.0f);
+    return static_cast<uint32_t>(std::lround(unit * 65535.0f));
+}
+
+static float dequantize_unorm16(const uint32_t value, const float min, const float max)
+{
+    return min + (max - min) * (static_cast<float>(value) / 65535.0f);
+}
+
+static uint32_t quantize_snorm16(const float value)
+{
+    const auto clamped = std::min(std::max(value, -1.0f), 1.0f);
+    return static_cast<uint16_t>(static_cast<int16_t>(std::lround(clamped * 32767.0f)));
+}
+
+static float dequantize_snorm16(const uint32_t value)
+{
+    return std::max(static_cast<float>(static_cast<int16_t>(value)) / 32767.0f, -1.0f);
+}
+
+static float sign_not_zero(const float value)
+{
+    return value >= 0 ? 1.0f : -1.0f;
+}
+
+/*
+ * Octahedral normals, see:
+ *      https://knarkowicz.wordpress.com/2014/04/16/octahedron-normal-vector-encoding/
+ */
+static v2 encode_octahedral(const v3& n)
+{
+    const auto l1 = std::fabs(n.x) + std::fabs(n.y) + std::fabs(n.z);
+    if (l1 <= 0) return v2{ 0, 0 };
+
+    auto x = n.x / l1;
+    auto y = n.y / l1;
+
+    //fold the lower hemisphere over the upper one
+    if (n.z < 0)
+    {
+        const auto folded_x = (1 - std::fabs(y)) * sign_not_zero(x);
+        const auto folded_y = (1 - std::fabs(x)) * sign_not_zero(y);
+
+        x = folded_x;
+        y = folded_y;
+    }
+
+    return v2{ x, y };
+}
+
+static v3 decode_octahedral(const float x, const float y)
+{
+    v3 n{ x, y, 1 - std::fabs(x) - std::fabs(y) };
+
+    if (n.z < 0)
+    {
+        n.x = (1 - std::fabs(y)) * sign_not_zero(x);
+        n.y = (1 - std::fabs(x)) * sign_not_zero(y);
+    }
+
+    const auto length = std::sqrt(n.x * n.x + n.y * n.y + n.z * n.z);
+    return v3{ n.x / length, n.y / length, n.z / length };
+}
+
+bool encode_quantized_mesh(
+    const mesh& mesh, const bool compress, const quantized_mesh_source& source, std::vector<unsigned char>& out
+)
+{
+    quantized_mesh_header header{};
+    memcpy(header.magic, quantized_mesh_magic, sizeof(header.magic));
+    header.version = quantized_mesh_version;
+    header.source_size = source.size;
+    header.source_mtime = source.mtime;
+    header.vert_count = static_cast<uint32_t>(mesh.vert_count);
+    header.face_count = static_cast<uint32_t>(mesh.face_count);
+    header.uv_count = static_cast<uint32_t>(mesh.uv_count);
+    header.normal_count = static_cast<uint32_t>(mesh.normal_count);
+
+    const auto largest_count = std::max({ mesh.vert_count, mesh.uv_count, mesh.normal_count });
+    const auto index_bytes = largest_count <= 65536 ? 2 : 4;
+    if (index_bytes == 2) header.flags |= quantized_mesh_index16;
+
+    for (auto axis = 0; axis < 3; axis++)
+    {
+        header.position_min[axis] = mesh.vert_count > 0 ? mesh.verts[0].e[axis] : 0;
+        header.position_max[axis] = header.position_min[axis];
+    }
+
+    for (size_t i = 0; i < mesh.vert_count; i++)
+    {
+        for (auto axis = 0; axis < 3; axis++)
+        {
+            header.position_min[axis] = std::min(header.position_min[axis], mesh.verts[i].e[axis]);
+            header.position_max[axis] = std::max(header.position_max[axis], mesh.verts[i].e[axis]);
+        }
+    }
+
+    for (auto axis = 0; axis < 2; axis++)
+    {
+        header.uv_min[axis] = mesh.uv_count > 0 ? mesh.uvs[0].e[axis] : 0;
+        header.uv_max[axis] = header.uv_min[axis];
+    }
+
+    for (size_t i = 0; i < mesh.uv_count; i++)
+    {
+        for (auto axis = 0; axis < 2; axis++)
+        {
+            header.uv_min[axis] = std::min(header.uv_min[axis], mesh.uvs[i].e[axis]);
+            header.uv_max[axis] = std::max(header.uv_max[axis], mesh.uvs[i].e[axis]);
+        }
+    }
+
+    std::vector<unsigned char> payload;
+    std::vector<uint32_t> values;
+
+    //positions
+    for (size_t i = 0; i < mesh.vert_count; i++)
+    {
+        for (auto axis = 0; axis < 3; axis++)
+        {
+            values.push_back(quantize_unorm16(mesh.verts[i].e[axis], header.position_min[axis], header.position_max[axis]));
+        }
+    }
+
+    put_planes(payload, values, 2);
+    values.clear();
+
+    //normals
+    for (size_t i = 0; i < mesh.normal_count; i++)
+    {
+        const auto packed = encode_octahedral(mesh.normals[i]);
+
+        values.push_back(quantize_snorm16(packed.x));
+        values.push_back(quantize_snorm16(packed.y));
+    }
+
+    put_planes(payload, values, 2);
+    values.clear();
+
+    //uvs
+    for (size_t i = 0; i < mesh.uv_count; i++)
+    {
+        for (auto axis = 0; axis < 2; axis++)
+        {
+            values.push_back(quantize_unorm16(mesh.uvs[i].e[axis], header.uv_min[axis], header.uv_max[axis]));
+        }
+    }
+
+    put_planes(payload, values, 2);
+    values.clear();
+
+    //faces, in memory order
+    for (size_t i = 0; i < mesh.face_count; i++)
+    {
+        const auto& face = mesh.faces[i];
+
+        for (auto vert_no = 0; vert_no < 3; vert_no++) values.push_back(static_cast<uint32_t>(face.verts.e[vert_no]));
+        for (auto vert_no = 0; vert_no < 3; vert_no++) values.push_back(static_cast<uint32_t>(face.uv.e[vert_no]));
+        for (auto vert_no = 0; vert_no < 3; vert_no++) values.push_back(static_cast<uint32_t>(face.normal.e[vert_no]));
+    }
+
+    put_planes(payload, values, index_bytes);
+
+    header.payload_size = payload.size();
+
+    std::vector<unsigned char> compressed;
+    if (compress) lz_compress(payload.data(), payload.size(), compressed);
+
+    //not worth decompressing if it barely shrinks
+    const auto use_lz = compress && compressed.size() < payload.size() - payload.size() / 16;
+    if (use_lz) header.flags |= quantized_mesh_lz;
+
+    const auto& stored = use_lz ? compressed : payload;
+    header.stored_size = stored.size();
+
+    out.resize(sizeof(header));
+    memcpy(out.data(), &header, sizeof(header));
+    out.insert(out.end(), stored.begin(), stored.end());
+
+    return true;
+}
+
+bool read_quantized_mesh_source(const unsigned char* bytes, const size_t size, quantized_mesh_source& out)
+{
+    quantized_mesh_header header{};
+    if (size < sizeof(header)) return false;
+
+    memcpy(&header, bytes, sizeof(header));
+
+    if (memcmp(header.magic, quantized_mesh_magic, sizeof(header.magic)) != 0 || header.version != quantized_mesh_version)
+    {
+        return false;
+    }
+
+    out.size = header.source_size;
+    out.mtime = header.source_mtime;
+    return true;
+}
+
+bool decode_quantized_mesh(const unsigned char* bytes, const size_t size, mesh& out)
+{
+    quantized_mesh_header header{};
+    if (size < sizeof(header)) return false;
+
+    memcpy(&header, bytes, sizeof(header));
+
+    if (
+        memcmp(header.magic, quantized_mesh_magic, sizeof(header.magic)) != 0 ||
+        header.version != quantized_mesh_version ||
+        size - sizeof(header) != header.stored_size
+    )
+    {
+        return false;
+    }
+
+    const auto index_bytes = header.flags & quantized_mesh_index16 ? 2 : 4;
+
+    const auto expected_payload =
+        (static_cast<uint64_t>(header.vert_count) * 3 + static_cast<uint64_t>(header.normal_count) * 2 +
+         static_cast<uint64_t>(header.uv_count) * 2) * 2 +
+        static_cast<uint64_t>(header.face_count) * 9 * index_bytes;
+
+    if (header.payload_size != expected_payload) return false;
+
+    const auto* stored = bytes + sizeof(header);
+    std::vector<unsigned char> decompressed;
+
+    if (header.flags & quantized_mesh_lz)
+    {
+        decompressed.resize(static_cast<size_t>(header.payload_size));
+
+        if (!lz_decompress(stored, static_cast<size_t>(header.stored_size), decompressed.data(), decompressed.size()))
+        {
+            return false;
+        }
+
+        stored = decompressed.data();
+    }
+    else if (header.stored_size != header.payload_size)
+    {
+        return false;
+    }
+
+    const auto* in = stored;
+    const auto* end = stored + header.payload_size;
+
+    std::vector<uint32_t> values;
+
+    //positions
+    values.resize(static_cast<size_t>(header.vert_count) * 3);
+    if (!read_planes(in, end, values.data(), values.size(), 2)) return false;
+
+    auto* verts = new v3[header.vert_count];
+    assert(verts != nullptr);
+
+    for (size_t i = 0; i < header.vert_count; i++)
+    {
+        for (auto axis = 0; axis < 3; axis++)
+        {
+            verts[i].e[axis] = dequantize_unorm16(values[i * 3 + axis], header.position_min[axis], header.position_max[axis]);
+        }
+    }
+
+    //normals
+    values.resize(static_cast<size_t>(header.normal_count) * 2);
+    if (!read_planes(in, end, values.data(), values.size(), 2)) return false;
+
+    auto* normals = new v3[header.normal_count];
+    assert(normals != nullptr);
+
+    for (size_t i = 0; i < header.normal_count; i++)
+    {
+        normals[i] = decode_octahedral(dequantize_snorm16(values[i * 2]), dequantize_snorm16(values[i * 2 + 1]));
+    }
+
+    //uvs
+    values.resize(static_cast<size_t>(header.uv_count) * 2);
+    if (!read_planes(in, end, values.data(), values.size(), 2)) return false;
+
+    auto* uvs = new v2[header.uv_count];
+    assert(uvs != nullptr);
+
+    for (size_t i = 0; i < header.uv_count; i++)
+    {
+        for (auto axis = 0; axis < 2; axis++)
+        {
+            uvs[i].e[axis] = dequantize_unorm16(values[i * 2 + axis], header.uv_min[axis], header.uv_max[axis]);
+        }
+    }
+
+    //faces, checking every index so a damaged file can't send the renderer out of bounds
+    values.resize(static_cast<size_t>(header.face_count) * 9);
+    if (!read_planes(in, end, values.data(), values.size(), index_bytes)) return false;
+
+    auto* faces = new face[header.face_count];
+    assert(faces != nullptr);
+
+    const uint32_t limits[3] = { header.vert_count, header.uv_count, header.normal_count };
+
+    for (size_t i = 0; i < header.face_count; i++)
+    {
+        const auto* face_values = &values[i * 9];
+        v3_i* targets[3] = { &faces[i].verts, &faces[i].uv, &faces[i].normal };
+
+        for (auto stream = 0; stream < 3; stream++)
+        {
+            for (auto vert_no = 0; vert_no < 3; vert_no++)
+            {
+                const auto index = face_values[stream * 3 + vert_no];
+
+                if (index >= limits[stream])
+                {
+                    delete[] verts;
+                    delete[] normals;
+                    delete[] uvs;
+                    delete[] faces;
+                    return false;
+                }
+
+                targets[stream]->e[vert_no] = static_cast<int>(index);
+            }
+        }
+    }
+
+    out.verts = verts;
+    out.normals = normals;
+    out.uvs = uvs;
+    out.faces = faces;
+
+    out.vert_count = header.vert_count;
+    out.normal_count = header.normal_count;
+    out.uv_count = header.uv_count;
+    out.face_count = header.face_count;
+
+    return true;
+}
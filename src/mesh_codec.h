@@ -0,0 +1,51 @@
+#ifndef MESH_CODEC_H
+#define MESH_CODEC_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "file.h"
+
+/*
+ * A compact alternative to the .bin mesh format, written next to a mesh's
+ * .bin as ".qmsh". Run the app with "--quantize-meshes" to convert every
+ * mesh in obj/conf.bin; meshes with a .qmsh are loaded from it from then on,
+ * for as long as the .bin keeps the size and modification time it had.
+ *
+ *  positions: 3x16 bits, quantized within the mesh's bounding box.
+ *  normals: 2x16 bits, octahedral.
+ *  uvs: 2x16 bits, quantized within the uv bounding box (uvs can wrap
+ *  outside 0-1).
+ *  faces: 16 bit indices when every count fits, 32 bit otherwise.
+ *
+ * Each array's 16 bit values are stored as a plane of low bytes followed by
+ * a plane of high bytes, which makes them far more repetitive. The whole
+ * payload can then be compressed with a small LZ77 coder. Meshes are
+ * decoded to the usual float arrays on load, so rendering is unchanged
+ * apart from the quantization error, which is below a texel of a 4k
+ * texture and 1/65535 of the model's size.
+ */
+struct quantized_mesh_source
+{
+    uint64_t size{};
+    int64_t mtime{};
+};
+
+bool encode_quantized_mesh(
+    const mesh& mesh, bool compress, const quantized_mesh_source& source, std::vector<unsigned char>& out
+);
+
+/*
+ * Reads the source a .qmsh was made from, failing on anything that isn't a
+ * .qmsh of the current version.
+ */
+bool read_quantized_mesh_source(const unsigned char* bytes, size_t size, quantized_mesh_source& out);
+
+/*
+ * Decodes into freshly allocated arrays owned by mesh, failing on anything
+ * that isn't a valid .qmsh.
+ */
+bool decode_quantized_mesh(const unsigned char* bytes, size_t size, mesh& out);
+
+#endif
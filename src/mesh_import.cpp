@@ -0,0 +1,958 @@
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "mesh_import.h"
+
+//a corner of an .obj face, indices into the file's arrays
+struct obj_corner
+{
+    int position{};
+    int uv{};
+    int normal{};
+};
+
+struct obj_material
+{
+    std::string name;
+
+    //paths relative to the working directory, empty when the map isn't given
+    std::string diffuse;
+    std::string normal;
+    std::string spec;
+    std::string emission;
+
+    //Kd, used for a diffuse map when there is none
+    rgba colour{ 255, 255, 255, 255 };
+    bool allow_lighting = true;
+};
+
+//the triangles using one material, three corners each
+struct obj_group
+{
+    int material{};
+    std::vector<obj_corner> corners;
+};
+
+struct obj_data
+{
+    std::vector<v3> positions;
+    std::vector<v2> uvs;
+    std::vector<v3> normals;
+
+    std::vector<obj_material> materials;
+    std::vector<obj_group> groups;
+};
+
+//a mesh with one index per vertex, as written out
+struct import_mesh
+{
+    int material{};
+
+    std::vector<v3> positions;
+    std::vector<v2> uvs;
+    std::vector<v3> normals;
+    std::vector<int> indices;
+};
+
+static bool read_line(FILE* f, std::string& line)
+{
+    line.clear();
+
+    for (;;)
+    {
+        const auto c = fgetc(f);
+        if (c == EOF) return !line.empty();
+        if (c == '\n') return true;
+        if (c != '\r') line.push_back(static_cast<char>(c));
+    }
+}
+
+static const char* skip_spaces(const char* str)
+{
+    while (*str == ' ' || *str == '\t') str++;
+    return str;
+}
+
+//the rest of the line, without trailing spaces
+static std::string rest_of_line(const char* str)
+{
+    std::string rest = skip_spaces(str);
+    while (!rest.empty() && (rest.back() == ' ' || rest.back() == '\t')) rest.pop_back();
+
+    return rest;
+}
+
+static std::string directory_of(const char* path)
+{
+    const auto* slash = strrchr(path, '/');
+    const auto* back_slash = strrchr(path, '\\');
+    if (back_slash != nullptr && (slash == nullptr || back_slash > slash)) slash = back_slash;
+
+    return slash != nullptr ? std::string(path, slash + 1) : std::string();
+}
+
+/*
+ * Map statements can start with options ("-bm 0.5 normal.png"), the path is
+ * taken to be the last word.
+ */
+static std::string map_path(const std::string& directory, const char* args)
+{
+    const auto rest = rest_of_line(args);
+    const auto last_space = rest.find_last_of(" \t");
+
+    return directory + (last_space != std::string::npos ? rest.substr(last_space + 1) : rest);
+}
+
+static int find_material(obj_data& data, const std::string& name)
+{
+    for (size_t i = 0; i < data.materials.size(); i++)
+    {
+        if (data.materials[i].name == name) return static_cast<int>(i);
+    }
+
+    obj_material material;
+    material.name = name;
+    data.materials.push_back(material);
+
+    return static_cast<int>(data.materials.size() - 1);
+}
+
+/*
+ * Every use of a material goes into the same group.
+ */
+static int find_group(obj_data& data, const int material)
+{
+    for (size_t i = 0; i < data.groups.size(); i++)
+    {
+        if (data.groups[i].material == material) return static_cast<int>(i);
+    }
+
+    data.groups.push_back(obj_group{ material, {} });
+    return static_cast<int>(data.groups.size() - 1);
+}
+
+static bool read_mtl(const char* path, obj_data& data)
+{
+    FILE* f = nullptr;
+    open_binary_file(path, f);
+    if (f == nullptr) return false;
+
+    const auto directory = directory_of(path);
+
+    std::string line;
+    obj_material* material = nullptr;
+
+    while (read_line(f, line))
+    {
+        const auto* str = skip_spaces(line.c_str());
+        const auto* args = str;
+        while (*args != 0 && *args != ' ' && *args != '\t') args++;
+
+        const auto keyword = std::string(str, args);
+
+        if (keyword == "newmtl")
+        {
+            material = &data.materials[find_material(data, rest_of_line(args))];
+            continue;
+        }
+
+        if (material == nullptr) continue;
+
+        if (keyword == "map_Kd") material->diffuse = map_path(directory, args);
+        else if (keyword == "map_Bump" || keyword == "map_bump" || keyword == "bump" || keyword == "norm") material->normal = map_path(directory, args);
+        else if (keyword == "map_Ks") material->spec = map_path(directory, args);
+        else if (keyword == "map_Ke") material->emission = map_path(directory, args);
+        else if (keyword == "illum") material->allow_lighting = atoi(args) != 0;
+        else if (keyword == "Kd")
+        {
+            float r = 1, g = 1, b = 1;
+            sscanf(args, "%f %f %f", &r, &g, &b);
+
+            const auto to_byte = [](const float value)
+            {
+                return static_cast<unsigned char>(std::lround(std::min(std::max(value, 0.0f), 1.0f) * 255));
+            };
+
+            material->colour = rgba{ to_byte(r), to_byte(g), to_byte(b), 255 };
+        }
+    }
+
+    fclose(f);
+    return true;
+}
+
+/*
+ * Turns a 1 based or negative (counted back from the end) .obj index into a
+ * 0 based one, -1 when it is out of range.
+ */
+static int resolve_index(const long index, const size_t count)
+{
+    const auto resolved = index < 0 ? static_cast<long>(count) + index : index - 1;
+    return resolved >= 0 && resolved < static_cast<long>(count) ? static_cast<int>(resolved) : -1;
+}
+
+/*
+ * Parses "v", "v/vt", "v//vn" or "v/vt/vn", leaving missing indices at -1.
+ */
+static bool parse_corner(const char*& str, const obj_data& data, obj_corner& out)
+{
+    char* end = nullptr;
+
+    out = obj_corner{ -1, -1, -1 };
+
+    const auto position = strtol(str, &end, 10);
+    if (end == str) return false;
+
+    out.position = resolve_index(position, data.positions.size());
+    str = end;
+
+    if (*str == '/')
+    {
+        str++;
+
+        if (*str != '/')
+        {
+            const auto uv = strtol(str, &end, 10);
+            if (end != str) out.uv = resolve_index(uv, data.uvs.size());
+            str = end;
+        }
+
+        if (*str == '/')
+        {
+            str++;
+
+            const auto normal = strtol(str, &end, 10);
+            if (end != str) out.normal = resolve_index(normal, data.normals.size());
+            str = end;
+        }
+    }
+
+    return out.position >= 0;
+}
+
+static bool read_obj(const char* path, obj_data& data)
+{
+    FILE* f = nullptr;
+    open_binary_file(path, f);
+
+    if (f == nullptr)
+    {
+        printf("Could not open %s.\n", path);
+        return false;
+    }
+
+    const auto directory = directory_of(path);
+
+    std::string line;
+    auto line_no = 0;
+    auto group = -1;
+
+    std::vector<obj_corner> polygon;
+
+    while (read_line(f, line))
+    {
+        line_no++;
+
+        const auto* str = skip_spaces(line.c_str());
+        const auto* args = str;
+        while (*args != 0 && *args != ' ' && *args != '\t') args++;
+
+        const auto keyword = std::string(str, args);
+
+        if (keyword == "v")
+        {
+            v3 position{};
+            sscanf(args, "%f %f %f", &position.x, &position.y, &position.z);
+            data.positions.push_back(position);
+        }
+        else if (keyword == "vt")
+        {
+            v2 uv{};
+            sscanf(args, "%f %f", &uv.x, &uv.y);
+            data.uvs.push_back(uv);
+        }
+        else if (keyword == "vn")
+        {
+            v3 normal{};
+            sscanf(args, "%f %f %f", &normal.x, &normal.y, &normal.z);
+            data.normals.push_back(normal);
+        }
+        else if (keyword == "mtllib")
+        {
+            const auto mtl_path = directory + rest_of_line(args);
+            if (!read_mtl(mtl_path.c_str(), data)) printf("Could not open %s, using plain materials.\n", mtl_path.c_str());
+        }
+        else if (keyword == "usemtl")
+        {
+            group = find_group(data, find_material(data, rest_of_line(args)));
+        }
+        else if (keyword == "f")
+        {
+            //faces before any usemtl get a plain material
+            if (group < 0) group = find_group(data, find_material(data, std::string()));
+
+            polygon.clear();
+
+            const auto* corner_str = skip_spaces(args);
+
+            while (*corner_str != 0)
+            {
+                obj_corner corner;
+
+                if (!parse_corner(corner_str, data, corner))
+                {
+                    printf("%s:%d has a face with a bad index, skipping it.\n", path, line_no);
+                    polygon.clear();
+                    break;
+                }
+
+                polygon.push_back(corner);
+                corner_str = skip_spaces(corner_str);
+            }
+
+            //fan out from the first corner
+            auto& corners = data.groups[group].corners;
+
+            for (size_t i = 2; i < polygon.size(); i++)
+            {
+                corners.push_back(polygon[0]);
+                corners.push_back(polygon[i - 1]);
+                corners.push_back(polygon[i]);
+            }
+        }
+    }
+
+    fclose(f);
+    return true;
+}
+
+/*
+ * Gives every corner a normal and a uv. Files with any corner missing a
+ * normal get area weighted normals for every position instead, and corners
+ * without a uv share one at the origin.
+ */
+static void fill_missing_attributes(obj_data& data)
+{
+    auto missing_normals = false;
+    auto missing_uvs = false;
+
+    for (const auto& group : data.groups)
+    {
+        for (const auto& corner : group.corners)
+        {
+            missing_normals = missing_normals || corner.normal < 0;
+            missing_uvs = missing_uvs || corner.uv < 0;
+        }
+    }
+
+    if (missing_normals)
+    {
+        data.normals.assign(data.positions.size(), v3{ 0, 0, 0 });
+
+        for (auto& group : data.groups)
+        {
+            for (size_t i = 0; i + 2 < group.corners.size(); i += 3)
+            {
+                const auto& p0 = data.positions[group.corners[i].position];
+                const auto& p1 = data.positions[group.corners[i + 1].position];
+                const auto& p2 = data.positions[group.corners[i + 2].position];
+
+                //the cross product's length is twice the area
+                const auto face_normal = cross(p1 - p0, p2 - p0);
+
+                for (auto j = 0; j < 3; j++)
+                {
+                    auto& normal = data.normals[group.corners[i + j].position];
+                    normal = normal + face_normal;
+                }
+            }
+
+            for (auto& corner : group.corners) corner.normal = corner.position;
+        }
+    }
+
+    if (missing_uvs)
+    {
+        const auto origin = static_cast<int>(data.uvs.size());
+        data.uvs.push_back(v2{ 0, 0 });
+
+        for (auto& group : data.groups)
+        {
+            for (auto& corner : group.corners)
+            {
+                if (corner.uv < 0) corner.uv = origin;
+            }
+        }
+    }
+
+    for (auto& normal : data.normals)
+    {
+        const auto length = std::sqrt(normal.x * normal.x + normal.y * normal.y + normal.z * normal.z);
+        normal = length > 0 ? v3{ normal.x / length, normal.y / length, normal.z / length } : v3{ 0, 0, 1 };
+    }
+}
+
+/*
+ * One vertex per distinct position/uv/normal triplet, and triangles that
+ * have area.
+ */
+static import_mesh weld_group(const obj_data& data, const obj_group& group, size_t& degenerate_count)
+{
+    import_mesh mesh;
+    mesh.material = group.material;
+
+    std::unordered_map<uint64_t, int> vertices;
+    vertices.reserve(group.corners.size());
+
+    const auto vertex_for = [&](const obj_corner& corner)
+    {
+        const auto key =
+            static_cast<uint64_t>(corner.position) << 42 |
+            static_cast<uint64_t>(corner.uv) << 21 |
+            static_cast<uint64_t>(corner.normal);
+
+        const auto found = vertices.find(key);
+        if (found != vertices.end()) return found->second;
+
+        const auto index = static_cast<int>(mesh.positions.size());
+        vertices.emplace(key, index);
+
+        mesh.positions.push_back(data.positions[corner.position]);
+        mesh.uvs.push_back(data.uvs[corner.uv]);
+        mesh.normals.push_back(data.normals[corner.normal]);
+
+        return index;
+    };
+
+    for (size_t i = 0; i + 2 < group.corners.size(); i += 3)
+    {
+        const auto& p0 = data.positions[group.corners[i].position];
+        const auto& p1 = data.positions[group.corners[i + 1].position];
+        const auto& p2 = data.positions[group.corners[i + 2].position];
+
+        const auto area = cross(p1 - p0, p2 - p0);
+
+        if (area.x == 0 && area.y == 0 && area.z == 0)
+        {
+            degenerate_count++;
+            continue;
+        }
+
+        for (auto j = 0; j < 3; j++) mesh.indices.push_back(vertex_for(group.corners[i + j]));
+    }
+
+    return mesh;
+}
+
+/*
+ * Forsyth's vertex cache optimisation, see:
+ *      https://tomforsyth1000.github.io/papers/fast_vert_cache_opt.html
+ *
+ * Greedily picks the triangle whose vertices score highest: recently used
+ * ones, which are still in the cache, and ones with few triangles left,
+ * which would otherwise be stranded. Returns where it had to start over
+ * away from the cache, which makes for good places to split the order.
+ */
+static const int vertex_cache_size = 32;
+
+static float vertex_cache_score(const int cache_position, const int triangles_left)
+{
+    if (triangles_left == 0) return -1;
+
+    auto score = 0.0f;
+
+    if (cache_position >= 0)
+    {
+        //the last triangle's vertices all score the same, so it isn't favoured to use one twice
+        score = cache_position < 3
+            ? 0.75f
+            : std::pow(1 - static_cast<float>(cache_position - 3) / (vertex_cache_size - 3), 1.5f);
+    }
+
+    return score + 2.0f / std::sqrt(static_cast<float>(triangles_left));
+}
+
+static std::vector<bool> optimise_vertex_cache(import_mesh& mesh)
+{
+    const auto vertex_count = mesh.positions.size();
+    const auto triangle_count = mesh.indices.size() / 3;
+
+    //triangles of each vertex, the first triangles_left of them still to be drawn
+    std::vector<int> triangles_left(vertex_count, 0);
+    for (const auto index : mesh.indices) triangles_left[index]++;
+
+    std::vector<int> first_triangle(vertex_count + 1, 0);
+    for (size_t i = 0; i < vertex_count; i++) first_triangle[i + 1] = first_triangle[i] + triangles_left[i];
+
+    std::vector<int> vertex_triangles(mesh.indices.size());
+    std::vector<int> filled(vertex_count, 0);
+
+    for (size_t i = 0; i < mesh.indices.size(); i++)
+    {
+        const auto index = mesh.indices[i];
+        vertex_triangles[first_triangle[index] + filled[index]++] = static_cast<int>(i / 3);
+    }
+
+    std::vector<int> cache_position(vertex_count, -1);
+    std::vector<float> vertex_score(vertex_count);
+    for (size_t i = 0; i < vertex_count; i++) vertex_score[i] = vertex_cache_score(-1, triangles_left[i]);
+
+    std::vector<float> triangle_score(triangle_count);
+    std::vector<bool> drawn(triangle_count, false);
+
+    for (size_t i = 0; i < triangle_count; i++)
+    {
+        triangle_score[i] =
+            vertex_score[mesh.indices[i * 3]] + vertex_score[mesh.indices[i * 3 + 1]] + vertex_score[mesh.indices[i * 3 + 2]];
+    }
+
+    std::vector<int> cache;
+    std::vector<int> next_cache;
+    std::vector<int> ordered;
+    ordered.reserve(mesh.indices.size());
+
+    std::vector<bool> restarts;
+    restarts.reserve(triangle_count);
+
+    size_t next_undrawn = 0;
+    auto best = -1;
+
+    for (size_t drawn_count = 0; drawn_count < triangle_count; drawn_count++)
+    {
+        const auto restart = best < 0;
+
+        //nothing in the cache is left to draw, carry on from the first triangle that isn't drawn
+        if (restart)
+        {
+            while (drawn[next_undrawn]) next_undrawn++;
+            best = static_cast<int>(next_undrawn);
+        }
+
+        drawn[best] = true;
+        restarts.push_back(restart);
+
+        next_cache.clear();
+
+        for (auto i = 0; i < 3; i++)
+        {
+            const auto index = mesh.indices[best * 3 + i];
+            ordered.push_back(index);
+            next_cache.push_back(index);
+
+            //move the triangle past the ones left to draw
+            auto* triangles = &vertex_triangles[first_triangle[index]];
+            auto& left = triangles_left[index];
+
+            for (auto j = 0; j < left; j++)
+            {
+                if (triangles[j] == best)
+                {
+                    std::swap(triangles[j], triangles[left - 1]);
+                    break;
+                }
+            }
+
+            left--;
+        }
+
+        for (const auto index : cache)
+        {
+            if (std::find(next_cache.begin(), next_cache.begin() + 3, index) == next_cache.begin() + 3) next_cache.push_back(index);
+        }
+
+        //vertices pushed out of the cache
+        for (size_t i = vertex_cache_size; i < next_cache.size(); i++)
+        {
+            const auto index = next_cache[i];
+            cache_position[index] = -1;
+            vertex_score[index] = vertex_cache_score(-1, triangles_left[index]);
+        }
+
+        if (next_cache.size() > vertex_cache_size) next_cache.resize(vertex_cache_size);
+        std::swap(cache, next_cache);
+
+        for (size_t i = 0; i < cache.size(); i++)
+        {
+            const auto index = cache[i];
+            cache_position[index] = static_cast<int>(i);
+            vertex_score[index] = vertex_cache_score(static_cast<int>(i), triangles_left[index]);
+        }
+
+        //the next triangle is one that uses a vertex in the cache
+        best = -1;
+        auto best_score = -1.0f;
+
+        for (const auto index : cache)
+        {
+            const auto* triangles = &vertex_triangles[first_triangle[index]];
+
+            for (auto j = 0; j < triangles_left[index]; j++)
+            {
+                const auto triangle = triangles[j];
+
+                triangle_score[triangle] =
+                    vertex_score[mesh.indices[triangle * 3]] +
+                    vertex_score[mesh.indices[triangle * 3 + 1]] +
+                    vertex_score[mesh.indices[triangle * 3 + 2]];
+
+                if (triangle_score[triangle] > best_score)
+                {
+                    best = triangle;
+                    best_score = triangle_score[triangle];
+                }
+            }
+        }
+    }
+
+    mesh.indices = ordered;
+    return restarts;
+}
+
+/*
+ * Cache misses per triangle with a cache of vertex_cache_size, 3 for no
+ * reuse at all and 0.5 for a perfect grid.
+ */
+static float average_cache_miss_ratio(const import_mesh& mesh)
+{
+    std::vector<int> cache;
+    size_t misses = 0;
+
+    for (const auto index : mesh.indices)
+    {
+        const auto found = std::find(cache.begin(), cache.end(), index);
+
+        if (found != cache.end())
+        {
+            cache.erase(found);
+        }
+        else
+        {
+            misses++;
+            if (cache.size() == vertex_cache_size) cache.pop_back();
+        }
+
+        cache.insert(cache.begin(), index);
+    }
+
+    return mesh.indices.empty() ? 0 : static_cast<float>(misses) / (mesh.indices.size() / 3);
+}
+
+/*
+ * Splits the cache order into clusters, at restarts and once a cluster is
+ * overdraw_cluster_faces long, then draws the clusters facing out from the
+ * middle of the mesh first. Those are the likeliest to be in front of the
+ * others, so more of what follows fails the depth test before shading.
+ */
+static const size_t overdraw_cluster_faces = 128;
+
+static void optimise_overdraw(import_mesh& mesh, const std::vector<bool>& restarts)
+{
+    struct cluster
+    {
+        size_t first{};
+        size_t count{};
+        float facing{};
+    };
+
+    const auto triangle_count = mesh.indices.size() / 3;
+
+    std::vector<cluster> clusters;
+
+    for (size_t i = 0; i < triangle_count; i++)
+    {
+        if (clusters.empty() || restarts[i] || clusters.back().count >= overdraw_cluster_faces)
+        {
+            clusters.push_back(cluster{ i, 0, 0 });
+        }
+
+        clusters.back().count++;
+    }
+
+    const auto triangle_centre = [&](const size_t triangle)
+    {
+        const auto& p0 = mesh.positions[mesh.indices[triangle * 3]];
+        const auto& p1 = mesh.positions[mesh.indices[triangle * 3 + 1]];
+        const auto& p2 = mesh.positions[mesh.indices[triangle * 3 + 2]];
+
+        return v3{ (p0.x + p1.x + p2.x) / 3, (p0.y + p1.y + p2.y) / 3, (p0.z + p1.z + p2.z) / 3 };
+    };
+
+    v3 mesh_centre{ 0, 0, 0 };
+
+    for (size_t i = 0; i < triangle_count; i++) mesh_centre = mesh_centre + triangle_centre(i);
+    mesh_centre = mesh_centre * (1.0f / std::max<size_t>(triangle_count, 1));
+
+    for (auto& c : clusters)
+    {
+        v3 centre{ 0, 0, 0 };
+        v3 normal{ 0, 0, 0 };
+
+        for (auto i = c.first; i < c.first + c.count; i++)
+        {
+            const auto& p0 = mesh.positions[mesh.indices[i * 3]];
+            const auto& p1 = mesh.positions[mesh.indices[i * 3 + 1]];
+            const auto& p2 = mesh.positions[mesh.indices[i * 3 + 2]];
+
+            centre = centre + triangle_centre(i);
+            normal = normal + cross(p1 - p0, p2 - p0);
+        }
+
+        centre = centre * (1.0f / c.count);
+
+        const auto length = std::sqrt(normal.x * normal.x + normal.y * normal.y + normal.z * normal.z);
+        if (length > 0) normal = normal * (1.0f / length);
+
+        c.facing = (centre - mesh_centre).inner(normal);
+    }
+
+    std::stable_sort(clusters.begin(), clusters.end(), [](const cluster& a, const cluster& b)
+    {
+        return a.facing > b.facing;
+    });
+
+    std::vector<int> sorted;
+    sorted.reserve(mesh.indices.size());
+
+    for (const auto& c : clusters)
+    {
+        sorted.insert(sorted.end(), mesh.indices.begin() + c.first * 3, mesh.indices.begin() + (c.first + c.count) * 3);
+    }
+
+    mesh.indices = sorted;
+}
+
+/*
+ * Renumbers vertices in the order the triangles first use them, so fetches
+ * walk forwards through the arrays.
+ */
+static void optimise_vertex_fetch(import_mesh& mesh)
+{
+    std::vector<int> remap(mesh.positions.size(), -1);
+
+    import_mesh reordered;
+    reordered.material = mesh.material;
+
+    for (auto& index : mesh.indices)
+    {
+        if (remap[index] < 0)
+        {
+            remap[index] = static_cast<int>(reordered.positions.size());
+
+            reordered.positions.push_back(mesh.positions[index]);
+            reordered.uvs.push_back(mesh.uvs[index]);
+            reordered.normals.push_back(mesh.normals[index]);
+        }
+
+        index = remap[index];
+    }
+
+    reordered.indices = mesh.indices;
+    mesh = reordered;
+}
+
+static const char* copy_string(const std::string& str)
+{
+    auto* copy = new char[str.size() + 1];
+    memcpy(copy, str.c_str(), str.size() + 1);
+
+    return copy;
+}
+
+/*
+ * Materials without a diffuse map get a small one in their Kd colour, the
+ * renderer expects every mesh to have one.
+ */
+static bool write_colour_map(const std::string& path, const rgba colour)
+{
+    const auto size = 4;
+
+    image map{};
+    map.width = size;
+    map.height = size;
+    map.n_channels = 4;
+    map.layout = image_layout::linear;
+    map.format = image_format::rgba8;
+
+    std::vector<rgba> texels(size * size, colour);
+    map.data = reinterpret_cast<unsigned char*>(texels.data());
+
+    return save_image(path.c_str(), map);
+}
+
+bool import_obj(const char* obj_path, const char* conf_path, const import_settings& settings)
+{
+    const auto start = std::chrono::high_resolution_clock::now();
+
+    obj_data data;
+    if (!read_obj(obj_path, data)) return false;
+
+    fill_missing_attributes(data);
+
+    //too many for the welding keys, checked after filling in as that can add a uv
+    const size_t max_count = static_cast<size_t>(1) << 21;
+
+    if (data.positions.size() >= max_count || data.uvs.size() >= max_count || data.normals.size() >= max_count)
+    {
+        printf("%s is too large to import.\n", obj_path);
+        return false;
+    }
+
+    size_t degenerate_count = 0;
+    std::vector<import_mesh> meshes;
+
+    for (const auto& group : data.groups)
+    {
+        auto mesh = weld_group(data, group, degenerate_count);
+        if (mesh.indices.empty()) continue;
+
+        const auto miss_ratio_before = average_cache_miss_ratio(mesh);
+
+        const auto restarts = optimise_vertex_cache(mesh);
+        optimise_overdraw(mesh, restarts);
+        optimise_vertex_fetch(mesh);
+
+        printf(
+            "Mesh %u: %u vertices, %u triangles, %.2f cache misses per triangle, %.2f before\n",
+            static_cast<unsigned>(meshes.size()),
+            static_cast<unsigned>(mesh.positions.size()),
+            static_cast<unsigned>(mesh.indices.size() / 3),
+            average_cache_miss_ratio(mesh),
+            miss_ratio_before
+        );
+
+        meshes.push_back(std::move(mesh));
+    }
+
+    if (meshes.empty())
+    {
+        printf("%s has no triangles.\n", obj_path);
+        return false;
+    }
+
+    if (degenerate_count > 0) printf("Dropped %u triangles without area\n", static_cast<unsigned>(degenerate_count));
+
+    //centre on the bounding box, then scale so the furthest vertex is 1 away
+    v3 bounds_min = meshes[0].positions[0];
+    v3 bounds_max = bounds_min;
+
+    for (const auto& mesh : meshes)
+    {
+        for (const auto& p : mesh.positions)
+        {
+            bounds_min = v3{ std::min(bounds_min.x, p.x), std::min(bounds_min.y, p.y), std::min(bounds_min.z, p.z) };
+            bounds_max = v3{ std::max(bounds_max.x, p.x), std::max(bounds_max.y, p.y), std::max(bounds_max.z, p.z) };
+        }
+    }
+
+    const auto centre = (bounds_min + bounds_max) * 0.5f;
+    auto radius = 0.0f;
+
+    for (const auto& mesh : meshes)
+    {
+        for (const auto& p : mesh.positions)
+        {
+            const auto offset = p - centre;
+            radius = std::max(radius, offset.x * offset.x + offset.y * offset.y + offset.z * offset.z);
+        }
+    }
+
+    radius = std::sqrt(radius);
+    const auto scale = radius > 0 ? 1 / radius : 1.0f;
+
+    printf(
+        "Bounds (%.3f %.3f %.3f) to (%.3f %.3f %.3f), scaled by %g\n",
+        bounds_min.x, bounds_min.y, bounds_min.z, bounds_max.x, bounds_max.y, bounds_max.z, scale
+    );
+
+    //outputs are named after the .obj
+    std::string stem = obj_path;
+    if (stem.size() > 4 && stem.compare(stem.size() - 4, 4, ".obj") == 0) stem.resize(stem.size() - 4);
+
+    const auto* file_name = stem.c_str() + directory_of(stem.c_str()).size();
+
+    model imported{};
+    imported.name = copy_string(settings.name != nullptr ? settings.name : file_name);
+    imported.author = settings.author != nullptr ? copy_string(settings.author) : nullptr;
+    imported.url = settings.url != nullptr ? copy_string(settings.url) : nullptr;
+    imported.background = rgb_to_hsl(eggshell);
+    imported.text_col = rgba{ 0, 0, 0, 255 };
+    imported.mesh_count = meshes.size();
+    imported.meshes = new mesh[meshes.size()];
+    assert(imported.meshes != nullptr);
+
+    for (size_t i = 0; i < meshes.size(); i++)
+    {
+        auto& source = meshes[i];
+        auto& target = imported.meshes[i];
+        const auto& material = data.materials[source.material];
+
+        for (auto& p : source.positions) p = (p - centre) * scale;
+
+        //one index for everything, so every triplet of a face is the same
+        std::vector<face> faces(source.indices.size() / 3);
+
+        for (size_t j = 0; j < faces.size(); j++)
+        {
+            for (auto k = 0; k < 3; k++)
+            {
+                const auto index = source.indices[j * 3 + k];
+
+                faces[j].verts.e[k] = index;
+                faces[j].uv.e[k] = index;
+                faces[j].normal.e[k] = index;
+            }
+        }
+
+        target.verts = source.positions.data();
+        target.vert_count = source.positions.size();
+        target.uvs = source.uvs.data();
+        target.uv_count = source.uvs.size();
+        target.normals = source.normals.data();
+        target.normal_count = source.normals.size();
+        target.faces = faces.data();
+        target.face_count = faces.size();
+
+        const auto geo_path = stem + "_" + std::to_string(i);
+        if (!write_mesh((geo_path + ".bin").c_str(), target)) return false;
+
+        auto diffuse_path = material.diffuse;
+
+        if (diffuse_path.empty())
+        {
+            diffuse_path = geo_path + "_colour.png";
+
+            if (!write_colour_map(diffuse_path, material.colour)) return false;
+        }
+
+        //the arrays were only borrowed for writing
+        target = mesh{};
+
+        target.allow_lighting = material.allow_lighting;
+        target.geo_path = copy_string(geo_path);
+        target.diffuse_path = copy_string(diffuse_path);
+
+        target.has_normal_map = !material.normal.empty();
+        target.normal_path = target.has_normal_map ? copy_string(material.normal) : nullptr;
+
+        target.has_specular_map = !material.spec.empty();
+        target.specular_path = target.has_specular_map ? copy_string(material.spec) : nullptr;
+
+        target.has_emissive_map = !material.emission.empty();
+        target.emission_path = target.has_emissive_map ? copy_string(material.emission) : nullptr;
+    }
+
+    const auto stop = std::chrono::high_resolution_clock::now();
+    const auto duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - start);
+
+    printf("Imported %s as %u meshes in %.1f ms\n", obj_path, static_cast<unsigned>(meshes.size()), duration.count() / 1000.0);
+
+    return add_conf_model(conf_path, imported);
+}
@@ -0,0 +1,40 @@
+#ifndef MESH_IMPORT_H
+#define MESH_IMPORT_H
+
+#include "file.h"
+
+/*
+ * Converts Wavefront .obj files into the app's .bin meshes and adds them to
+ * a conf file, run the app with "--import path.obj" to use it.
+ *
+ * Each material the .obj uses becomes a mesh, with its maps taken from the
+ * .mtl file (map_Kd, map_Bump or norm, map_Ks and map_Ke). Every distinct
+ * position/uv/normal combination becomes one vertex, so a face's three
+ * index triplets are always equal and a single index addresses everything
+ * a vertex needs. Along the way the converter:
+ *
+ *  - triangulates polygons as fans and drops triangles without area.
+ *  - generates smooth normals when the file has none.
+ *  - centres the model on its bounding box and scales it to fit a sphere
+ *    of radius 1, which is what the camera frames.
+ *  - orders triangles for the post transform vertex cache (Forsyth), then
+ *    sorts runs of them so outward facing ones draw first and hide what is
+ *    behind them, and numbers vertices in the order they are first used.
+ *
+ * Tangents aren't stored, the normal mapping shader derives them per pixel.
+ */
+struct import_settings
+{
+    //the model's name, the file's name when not given
+    const char* name{};
+    const char* author{};
+    const char* url{};
+};
+
+/*
+ * Writes "<obj path without .obj>_<n>.bin" for each mesh and adds the model
+ * to the conf file at conf_path, replacing one of the same name.
+ */
+bool import_obj(const char* obj_path, const char* conf_path, const import_settings& settings);
+
+#endif
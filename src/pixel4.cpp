@@ -0,0 +1,82 @@
+#include <algorithm>
+#include <cstring>
+
+#include "pixel4.h"
+
+#if HAS_SSE2
+inline pixel4 load_pixel(const rgba& p)
+{
+    int bits;
+    memcpy(&bits, &p, sizeof(bits));
+
+    const auto zero = _mm_setzero_si128();
+    auto wide = _mm_unpacklo_epi8(_mm_cvtsi32_si128(bits), zero);
+    wide = _mm_unpacklo_epi16(wide, zero);
+
+    return { _mm_cvtepi32_ps(wide) };
+}
+
+inline rgba store_pixel(const pixel4& p)
+{
+    //the packs saturate, so out of range channels clamp to 0-255
+    auto narrow = _mm_cvtps_epi32(p.v);
+    narrow = _mm_packs_epi32(narrow, narrow);
+    narrow = _mm_packus_epi16(narrow, narrow);
+
+    const auto bits = _mm_cvtsi128_si32(narrow);
+
+    rgba out;
+    memcpy(&out, &bits, sizeof(out));
+    return out;
+}
+
+inline pixel4 splat(const float f) { return { _mm_set1_ps(f) }; }
+inline void unpack_pixel(const pixel4& p, float out[4]) { _mm_storeu_ps(out, p.v); }
+
+inline pixel4 operator + (const pixel4& a, const pixel4& b) { return { _mm_add_ps(a.v, b.v) }; }
+inline pixel4 operator - (const pixel4& a, const pixel4& b) { return { _mm_sub_ps(a.v, b.v) }; }
+inline pixel4 operator * (const pixel4& a, const pixel4& b) { return { _mm_mul_ps(a.v, b.v) }; }
+inline pixel4 operator / (const pixel4& a, const pixel4& b) { return { _mm_div_ps(a.v, b.v) }; }
+inline pixel4 min4(const pixel4& a, const pixel4& b) { return { _mm_min_ps(a.v, b.v) }; }
+inline pixel4 max4(const pixel4& a, const pixel4& b) { return { _mm_max_ps(a.v, b.v) }; }
+#else
+inline pixel4 load_pixel(const rgba& p)
+{
+    return { { static_cast<float>(p.e[0]), static_cast<float>(p.e[1]), static_cast<float>(p.e[2]), static_cast<float>(p.e[3]) } };
+}
+
+inline rgba store_pixel(const pixel4& p)
+{
+    rgba out;
+    for (auto i = 0; i < 4; i++)
+    {
+        out.e[i] = static_cast<unsigned char>(std::max(0.0f, std::min(255.0f, p.e[i] + 0.5f)));
+    }
+    return out;
+}
+
+inline pixel4 splat(const float f) { return { { f, f, f, f } }; }
+inline void unpack_pixel(const pixel4& p, float out[4]) { memcpy(out, p.e, sizeof(p.e)); }
+
+#define PIXEL4_OP(name, expr)                                           \
+    inline pixel4 name(const pixel4& a, const pixel4& b)                \
+    {                                                                   \
+        pixel4 out;                                                     \
+        for (auto i = 0; i < 4; i++) out.e[i] = expr;                   \
+        return out;                                                     \
+    }
+
+PIXEL4_OP(operator +, a.e[i] + b.e[i])
+PIXEL4_OP(operator -, a.e[i] - b.e[i])
+PIXEL4_OP(operator *, a.e[i] * b.e[i])
+PIXEL4_OP(operator /, a.e[i] / b.e[i])
+PIXEL4_OP(min4, std::min(a.e[i], b.e[i]))
+PIXEL4_OP(max4, std::max(a.e[i], b.e[i]))
+
+#undef PIXEL4_OP
+#endif
+
+inline bool same_pixel(const rgba& a, const rgba& b)
+{
+    return memcmp(&a, &b, sizeof(rgba)) == 0;
+}
@@ -0,0 +1,38 @@
+#ifndef PIXEL4_H
+#define PIXEL4_H
+
+#include "image.h"
+#include "platform_specific.h"
+
+/*
+ * The four channels of a pixel as floats, so full screen filters can be
+ * written once for the SSE2 and scalar paths. Channels stay in 0-255 and in
+ * the byte order of the buffer they were loaded from.
+ */
+#if HAS_SSE2
+struct pixel4
+{
+    __m128 v;
+};
+#else
+struct pixel4
+{
+    float e[4];
+};
+#endif
+
+inline pixel4 load_pixel(const rgba& p);
+inline rgba store_pixel(const pixel4& p);
+inline pixel4 splat(float f);
+inline void unpack_pixel(const pixel4& p, float out[4]);
+
+inline pixel4 operator + (const pixel4& a, const pixel4& b);
+inline pixel4 operator - (const pixel4& a, const pixel4& b);
+inline pixel4 operator * (const pixel4& a, const pixel4& b);
+inline pixel4 operator / (const pixel4& a, const pixel4& b);
+inline pixel4 min4(const pixel4& a, const pixel4& b);
+inline pixel4 max4(const pixel4& a, const pixel4& b);
+
+inline bool same_pixel(const rgba& a, const rgba& b);
+
+#endif
@@ -1,10 +1,129 @@
 #include "platform_specific.h"
 
+#if defined(_MSC_VER)
+#include <fcntl.h>
+#include <io.h>
+
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 inline void open_binary_file(const char * path, FILE* & f)
 {
-#ifndef EMSCRIPTEN
+#if defined(_MSC_VER)
     fopen_s(&f, path, "rb");
 #else
     f = fopen(path, "rb");
 #endif
-}
\ No newline at end of file
+}
+
+inline void create_binary_file(const char * path, FILE* & f)
+{
+#if defined(_MSC_VER)
+    fopen_s(&f, path, "wb");
+#else
+    f = fopen(path, "wb");
+#endif
+}
+
+/*
+ * Hands back stdout for binary output, and points the stdout everything else
+ * prints to at stderr so logging can't end up in the middle of the data.
+ */
+inline FILE* claim_stdout()
+{
+    fflush(stdout);
+
+#if defined(_MSC_VER)
+    const auto fd = _dup(_fileno(stdout));
+    if (fd < 0) return nullptr;
+
+    _setmode(fd, _O_BINARY);
+    _dup2(_fileno(stderr), _fileno(stdout));
+
+    return _fdopen(fd, "wb");
+#else
+    const auto fd = dup(fileno(stdout));
+    if (fd < 0) return nullptr;
+
+    dup2(fileno(stderr), fileno(stdout));
+
+    return fdopen(fd, "wb");
+#endif
+}
+
+/*
+ * Fails for empty files, which have nothing to map.
+ */
+inline bool map_file(const char * path, mapped_file& out)
+{
+    out = mapped_file{};
+
+#if defined(_MSC_VER)
+    const auto file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) return false;
+
+    LARGE_INTEGER size{};
+    const auto mapping = GetFileSizeEx(file, &size) && size.QuadPart > 0
+        ? CreateFileMappingA(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr)
+        : nullptr;
+
+    //the mapping keeps the file open
+    CloseHandle(file);
+    if (mapping == nullptr) return false;
+
+    auto* view = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+
+    if (view == nullptr)
+    {
+        CloseHandle(mapping);
+        return false;
+    }
+
+    out.data = static_cast<unsigned char*>(view);
+    out.size = static_cast<size_t>(size.QuadPart);
+    out.mapping = mapping;
+#else
+    const auto fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat info{};
+
+    if (fstat(fd, &info) != 0 || info.st_size <= 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    auto* view = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+
+    //the mapping keeps the file open
+    close(fd);
+    if (view == MAP_FAILED) return false;
+
+    out.data = static_cast<unsigned char*>(view);
+    out.size = static_cast<size_t>(info.st_size);
+#endif
+
+    return true;
+}
+
+inline void unmap_file(mapped_file& file)
+{
+    if (file.data == nullptr) return;
+
+#if defined(_MSC_VER)
+    UnmapViewOfFile(file.data);
+    CloseHandle(file.mapping);
+#else
+    munmap(file.data, file.size);
+#endif
+
+    file = mapped_file{};
+}
@@ -4,11 +4,62 @@
 #include <cstdio>
 
 inline void open_binary_file(const char * path, FILE* & f);
+inline void create_binary_file(const char * path, FILE* & f);
+inline FILE* claim_stdout();
 
-#ifndef EMSCRIPTEN
+/*
+ * A whole file mapped into memory. Pages are shared with every other process
+ * mapping the same file, and copied on write, so writes never reach the file.
+ */
+struct mapped_file
+{
+    unsigned char* data{};
+    size_t size{};
+
+#if defined(_MSC_VER)
+    void* mapping{};
+#endif
+};
+
+inline bool map_file(const char * path, mapped_file& out);
+inline void unmap_file(mapped_file& file);
+
+#if defined(_MSC_VER)
 #define FORMAT_PRINT(buf, format, buf_size, arg) sprintf_s(buf, buf_size, format, arg);
 #else
-#define FORMAT_PRINT(buf, format, buf_size, arg) sprintf(buf, format, arg);
+#define FORMAT_PRINT(buf, format, buf_size, arg) snprintf(buf, buf_size, format, arg);
+#endif
+
+/*
+ * SSE2 is part of x86-64, so desktop builds always have it. Emscripten only
+ * gets it when building with -msse2 -msimd128, otherwise the scalar
+ * fallbacks are used.
+ */
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HAS_SSE2 1
+#include <emmintrin.h>
+#else
+#define HAS_SSE2 0
+#endif
+
+/*
+ * Emscripten builds run on the browser's main thread unless built with
+ * pthreads, desktop builds always have threads.
+ */
+#if !defined(EMSCRIPTEN) || defined(__EMSCRIPTEN_PTHREADS__)
+#define HAS_THREADS 1
+#else
+#define HAS_THREADS 0
+#endif
+
+/*
+ * Headless builds (-DHEADLESS, see CMakeLists.txt) leave SDL out entirely,
+ * frames are only ever written to image files.
+ */
+#ifndef HEADLESS
+#define HAS_WINDOW 1
+#else
+#define HAS_WINDOW 0
 #endif
 
 #endif
\ No newline at end of file
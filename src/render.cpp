@@ -1,5 +1,10 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
 #include "render.h"
 #include "file.h"
+#include "jobs.h"
 
 void init_output_buffers(output_buffers & output_buffers, const int width, const int height)
 {
@@ -11,13 +16,12 @@ void init_output_buffers(output_buffers & output_buffers, const int width, const
     
     const auto size = width * height * n_channels;
 
-    //alloc and init frame buffer
+    //alloc frame buffer, its contents are filled in lazily by the tile clears
     frame_buffer.height = height;
     frame_buffer.width = width;
     frame_buffer.n_channels = n_channels;
     frame_buffer.data = new unsigned char[size];
     assert(frame_buffer.data != nullptr);
-    memset(frame_buffer.data, 0, size);
 
     //alloc and init temp buffer
     temp_buffer.height = height;
@@ -27,31 +31,291 @@ void init_output_buffers(output_buffers & output_buffers, const int width, const
     assert(temp_buffer.data != nullptr);
     memset(temp_buffer.data, 0, size);
 
-    //alloc and init z buffer
+    //alloc z buffer, also filled in by the tile clears
     const auto z_buffer_size = width * height;
     z_buffer = new float[z_buffer_size];
     assert(z_buffer != nullptr);
-    for (auto i = 0; i < width * height; i++)
+
+    output_buffers.max_width = width;
+    output_buffers.max_height = height;
+
+    //alloc tile flags and start with every tile pending a clear to black
+    output_buffers.tiles_x = (width + output_tile_size - 1) / output_tile_size;
+    output_buffers.tiles_y = (height + output_tile_size - 1) / output_tile_size;
+    output_buffers.tile_pending_clear = new unsigned char[output_buffers.tiles_x * output_buffers.tiles_y];
+    assert(output_buffers.tile_pending_clear != nullptr);
+
+    clear_output_buffers(output_buffers, rgba{ 0, 0, 0, 0 });
+}
+
+/*
+ * Only flags the tiles, the actual clear happens when a tile is first drawn
+ * to, see prepare_output_tiles().
+ */
+void clear_output_buffers(output_buffers& output_buffers, const rgba& clear_color)
+{
+    output_buffers.clear_color = clear_color;
+    memset(output_buffers.tile_pending_clear, 1, output_buffers.tiles_x * output_buffers.tiles_y);
+}
+
+/*
+ * Changes the size the buffers are rendered at without reallocating them.
+ * Rows stay tightly packed at the new width, so the contents don't survive
+ * and every tile is flagged for a clear.
+ */
+void resize_output_buffers(output_buffers& output_buffers, const int width, const int height)
+{
+    auto& frame_buffer = output_buffers.frame_buffer;
+
+    if (frame_buffer.width == width && frame_buffer.height == height) return;
+
+    assert(width > 0 && width <= output_buffers.max_width);
+    assert(height > 0 && height <= output_buffers.max_height);
+
+    frame_buffer.width = width;
+    frame_buffer.height = height;
+    output_buffers.temp_buffer.width = width;
+    output_buffers.temp_buffer.height = height;
+
+    output_buffers.tiles_x = (width + output_tile_size - 1) / output_tile_size;
+    output_buffers.tiles_y = (height + output_tile_size - 1) / output_tile_size;
+    memset(output_buffers.tile_pending_clear, 1, output_buffers.tiles_x * output_buffers.tiles_y);
+}
+
+/*
+ * Renders straight into memory owned by someone else, typically the window
+ * surface, in that memory's pixel order. The memory must be tightly packed
+ * and as large as the frame buffer. Every tile is flagged for a clear since
+ * the new memory holds whatever was there before.
+ */
+void use_external_frame_buffer(output_buffers& output_buffers, unsigned char* pixels, const pixel_order order)
+{
+    auto& frame_buffer = output_buffers.frame_buffer;
+
+    assert(pixels != nullptr);
+
+    if (!output_buffers.external_frame_buffer)
     {
-        z_buffer[i] = min_z_buffer_val;
+        delete[] frame_buffer.data;
     }
+
+    frame_buffer.data = pixels;
+    output_buffers.external_frame_buffer = true;
+    output_buffers.order = order;
+
+    memset(output_buffers.tile_pending_clear, 1, output_buffers.tiles_x * output_buffers.tiles_y);
 }
 
-void clear_output_buffers(output_buffers& output_buffers, const rgba& clear_color)
+inline rgba to_output_order(const output_buffers& output_buffers, const rgba& col)
+{
+    if (output_buffers.order == pixel_order::bgra)
+    {
+        return rgba{ col.b, col.g, col.r, col.a };
+    }
+
+    return col;
+}
+
+static void clear_output_tile(output_buffers& output_buffers, const int tile_x, const int tile_y)
 {
     auto& frame_buffer = output_buffers.frame_buffer;
-    auto* z_buffer = output_buffers.z_buffer;
+    const auto clear_color = to_output_order(output_buffers, output_buffers.clear_color);
 
-    for (auto i = 0; i < frame_buffer.width * frame_buffer.height; i++)
+    const auto x0 = tile_x * output_tile_size;
+    const auto x1 = std::min(x0 + output_tile_size, frame_buffer.width);
+    const auto row0 = tile_y * output_tile_size;
+    const auto row1 = std::min(row0 + output_tile_size, frame_buffer.height);
+
+    for (auto row = row0; row < row1; row++)
     {
-        z_buffer[i] = min_z_buffer_val;
-    } 
+        auto* z_walk = output_buffers.z_buffer + row * frame_buffer.width + x0;
+        auto* col_walk = reinterpret_cast<rgba*>(frame_buffer.data) + row * frame_buffer.width + x0;
+
+        for (auto x = x0; x < x1; x++)
+        {
+            *z_walk++ = min_z_buffer_val;
+            *col_walk++ = clear_color;
+        }
+    }
+
+    output_buffers.tile_pending_clear[tile_y * output_buffers.tiles_x + tile_x] = 0;
+}
+
+/*
+ * Clears any pending tiles overlapping a screen space rectangle (inclusive,
+ * bottom up y like the rasterizer), ahead of drawing into it.
+ */
+inline void prepare_output_tiles(output_buffers& output_buffers, const int min_x, const int min_y, const int max_x, const int max_y)
+{
+    const auto height = output_buffers.frame_buffer.height;
+
+    //screen y is bottom up, buffer rows are top down
+    const auto tile_x0 = min_x / output_tile_size;
+    const auto tile_x1 = max_x / output_tile_size;
+    const auto tile_y0 = (height - 1 - max_y) / output_tile_size;
+    const auto tile_y1 = (height - 1 - min_y) / output_tile_size;
+
+    for (auto tile_y = tile_y0; tile_y <= tile_y1; tile_y++)
+    {
+        for (auto tile_x = tile_x0; tile_x <= tile_x1; tile_x++)
+        {
+            if (output_buffers.tile_pending_clear[tile_y * output_buffers.tiles_x + tile_x])
+            {
+                clear_output_tile(output_buffers, tile_x, tile_y);
+            }
+        }
+    }
+}
+
+/*
+ * Clears every tile still pending, for consumers that read the whole frame or
+ * z buffer rather than presenting tile by tile.
+ */
+void resolve_output_buffers(output_buffers& output_buffers)
+{
+    for (auto tile_y = 0; tile_y < output_buffers.tiles_y; tile_y++)
+    {
+        for (auto tile_x = 0; tile_x < output_buffers.tiles_x; tile_x++)
+        {
+            if (output_buffers.tile_pending_clear[tile_y * output_buffers.tiles_x + tile_x])
+            {
+                clear_output_tile(output_buffers, tile_x, tile_y);
+            }
+        }
+    }
+}
+
+/*
+ * Render cost is close to proportional to the pixel count, so the scale
+ * moves by the square root of how far off target the frame time is. The
+ * change is damped and only made outside a band around the target, which
+ * keeps the resolution from hunting back and forth.
+ */
+void update_resolution_scale(resolution_scaler& scaler, const float frame_ms)
+{
+    scaler.smoothed_ms = scaler.smoothed_ms > 0 ? scaler.smoothed_ms * 0.9f + frame_ms * 0.1f : frame_ms;
+
+    if (scaler.smoothed_ms > scaler.target_ms * 1.05f || scaler.smoothed_ms < scaler.target_ms * 0.85f)
+    {
+        const auto wanted = scaler.scale * std::sqrt(scaler.target_ms / std::max(scaler.smoothed_ms, 0.01f));
+        scaler.scale += (wanted - scaler.scale) * 0.5f;
+    }
+
+    scaler.scale = std::max(scaler.min_scale, std::min(scaler.max_scale, scaler.scale));
+}
+
+/*
+ * Sizes snap to multiples of 8 so small changes in scale don't resize every frame.
+ */
+void scaled_render_size(const resolution_scaler& scaler, const int max_width, const int max_height, int& width, int& height)
+{
+    const auto snap = [](const float size, const int max_size)
+    {
+        const auto snapped = static_cast<int>(size) / 8 * 8;
+        return std::max(std::min(8, max_size), std::min(snapped, max_size));
+    };
+
+    width = snap(static_cast<float>(max_width) * scaler.scale, max_width);
+    height = snap(static_cast<float>(max_height) * scaler.scale, max_height);
+}
+
+void init_output_triple_buffer(output_triple_buffer& triple_buffer, const int width, const int height, const pixel_order order)
+{
+    for (auto& buffers : triple_buffer.buffers)
+    {
+        init_output_buffers(buffers, width, height);
+        buffers.order = order;
+    }
+
+    triple_buffer.middle = 1;
+    triple_buffer.rendering = 0;
+    triple_buffer.presenting = 2;
+
+    for (auto& cleared : triple_buffer.cleared) cleared = false;
+}
+
+/*
+ * Called by the renderer with the buffers it just finished (which may be a
+ * copy of the set it was handed, with an updated clear colour). Makes them
+ * the fresh middle set and returns the set to render the next frame into.
+ */
+output_buffers& publish_output_buffers(output_triple_buffer& triple_buffer, const output_buffers& finished)
+{
+    triple_buffer.buffers[triple_buffer.rendering] = finished;
+
+    const auto previous = triple_buffer.middle.exchange(
+        triple_buffer.rendering | output_triple_buffer_fresh, std::memory_order_acq_rel
+    );
+
+    triple_buffer.rendering = previous & ~output_triple_buffer_fresh;
+    auto& next = triple_buffer.buffers[triple_buffer.rendering];
+
+#if HAS_THREADS
+    //the lock orders this with a presenter that has just seen nothing fresh and is about to sleep
+    {
+        std::lock_guard<std::mutex> lock(triple_buffer.publish_lock);
+    }
+
+    triple_buffer.published.notify_one();
+#endif
 
-    auto* walk = reinterpret_cast<rgba*>(frame_buffer.data);
-    for(auto i = 0; i < frame_buffer.width * frame_buffer.height; i++)
+    //a frame the presenter never picked up comes straight back, still holding its pixels
+    if (!triple_buffer.cleared[triple_buffer.rendering])
     {
-        *walk++ = clear_color;
+        clear_output_buffers(next, finished.clear_color);
     }
+
+    triple_buffer.cleared[triple_buffer.rendering] = false;
+    return next;
+}
+
+/*
+ * Called by the presenter. Returns the newest finished frame, or nullptr if
+ * nothing was published since the last call. The returned set stays the
+ * presenter's until the next successful call.
+ */
+output_buffers* acquire_output_buffers(output_triple_buffer& triple_buffer)
+{
+    if ((triple_buffer.middle.load(std::memory_order_relaxed) & output_triple_buffer_fresh) == 0)
+    {
+        return nullptr;
+    }
+
+    const auto previous = triple_buffer.middle.exchange(triple_buffer.presenting, std::memory_order_acq_rel);
+
+    triple_buffer.presenting = previous & ~output_triple_buffer_fresh;
+    return &triple_buffer.buffers[triple_buffer.presenting];
+}
+
+#if HAS_THREADS
+/*
+ * Called by the presenter when acquire_output_buffers() had nothing for it.
+ * Returns once a frame is published, or after timeout_ms so the presenter
+ * keeps handling input while the renderer is slow.
+ */
+void wait_for_output_buffers(output_triple_buffer& triple_buffer, const int timeout_ms)
+{
+    std::unique_lock<std::mutex> lock(triple_buffer.publish_lock);
+
+    triple_buffer.published.wait_for(lock, std::chrono::milliseconds(timeout_ms), [&]
+    {
+        return (triple_buffer.middle.load(std::memory_order_relaxed) & output_triple_buffer_fresh) != 0;
+    });
+}
+#endif
+
+/*
+ * Called by the presenter once it is done with its set. Clears it fully, so
+ * the renderer gets it back ready to draw into without clearing any tiles.
+ */
+void recycle_output_buffers(output_triple_buffer& triple_buffer)
+{
+    auto& buffers = triple_buffer.buffers[triple_buffer.presenting];
+
+    clear_output_buffers(buffers, buffers.clear_color);
+    resolve_output_buffers(buffers);
+
+    triple_buffer.cleared[triple_buffer.presenting] = true;
 }
 
 /*
@@ -125,12 +389,111 @@ inline int clamp(int val, const int min, const int max){
     return val;
 }
 
+/*
+ * Log2 of the uv step per pixel over a triangle, from the ratio of its area
+ * in uv space to its area on screen.
+ */
+static float triangle_uv_lod(const v2 screen[3], const v2 uv[3])
+{
+    const auto screen_a = screen[1] - screen[0];
+    const auto screen_b = screen[2] - screen[0];
+    const auto uv_a = uv[1] - uv[0];
+    const auto uv_b = uv[2] - uv[0];
+
+    const auto screen_area = std::abs(screen_a.x * screen_b.y - screen_a.y * screen_b.x);
+    const auto uv_area = std::abs(uv_a.x * uv_b.y - uv_a.y * uv_b.x);
+
+    return 0.5f * std::log2(std::max(uv_area, 1e-12f) / std::max(screen_area, 1e-6f));
+}
+
+/*
+ * The geometry stage for faces [first, last) of a mesh: back face culling,
+ * vertex fetch, the vertex shader, clipping and triangle setup, appending
+ * what survives to out. Runs on the job system's threads, so it only reads
+ * the mesh, state and shader.
+ *
+ * Clipping is trivial rejection only. Triangles entirely off screen or
+ * without area are dropped (unless drawing wireframes), neither would have
+ * passed a pixel's barycentric test. Triangles crossing the near plane are
+ * rasterized unclipped, as they always have been.
+ */
+static void setup_triangles(
+    const mesh& mesh, const v3& view_position_object_space, const render_state& state, const shader& shader,
+    const int first, const int last, std::vector<setup_triangle>& out
+)
+{
+    const auto& frame_buffer = state.output_buffers.frame_buffer;
+
+    out.clear();
+
+    for (auto face_no = first; face_no < last; face_no++) {
+        const auto& face = mesh.faces[face_no];
+
+        //calculate triangle normal
+        auto normal = cross(
+            mesh.verts[face.verts.y] - mesh.verts[face.verts.x],
+            mesh.verts[face.verts.z] - mesh.verts[face.verts.x]
+        ).normalise();
+
+        //cull the triangle if it is back facing
+        if (
+            state.backspace_culling &&
+            normal.inner(mesh.verts[face.verts.x] - view_position_object_space) >= 0
+        )
+        {
+            continue;
+        }
+
+        setup_triangle tri;
+        tri.sequence = face_no;
+        tri.face_normal = normal;
+
+        v2 screen[3];
+
+        for (auto vert_no = 0; vert_no < 3; vert_no++) {
+            //run the vertex shader
+            tri.clip[vert_no] = shader.vertex(mesh.verts[face.verts.e[vert_no]], face_no, vert_no, tri.varyings);
+
+            //map coordinates to the screen
+            const auto projected = project_3d(state.viewport * tri.clip[vert_no]);
+            screen[vert_no] = v2{ projected.x, projected.y };
+            tri.screen[vert_no] = v3_to_v2(projected);
+
+            tri.varyings.uv[vert_no] = mesh.uvs[face.uv.e[vert_no]];
+            tri.normals[vert_no] = mesh.normals[face.normal.e[vert_no]];
+        }
+
+        const auto& t0 = tri.screen[0];
+        const auto& t1 = tri.screen[1];
+        const auto& t2 = tri.screen[2];
+
+        const auto min_x = r_min(t0.x, t1.x, t2.x);
+        const auto max_x = r_max(t0.x, t1.x, t2.x);
+        const auto min_y = r_min(t0.y, t1.y, t2.y);
+        const auto max_y = r_max(t0.y, t1.y, t2.y);
+
+        if (max_x < 0 || max_y < 0 || min_x >= frame_buffer.width || min_y >= frame_buffer.height) continue;
+
+        //no pixel passes the barycentric test of a triangle without area
+        const auto area = (t2.x - t0.x) * (t1.y - t0.y) - (t1.x - t0.x) * (t2.y - t0.y);
+        if (area == 0 && !state.wire_frame) continue;
+
+        tri.min_x = clamp(min_x, 0, frame_buffer.width - 1);
+        tri.max_x = clamp(max_x, 0, frame_buffer.width - 1);
+        tri.min_y = clamp(min_y, 0, frame_buffer.height - 1);
+        tri.max_y = clamp(max_y, 0, frame_buffer.height - 1);
+
+        tri.varyings.uv_lod = triangle_uv_lod(screen, tri.varyings.uv);
+
+        out.push_back(tri);
+    }
+}
+
 /*
  *  This function rasterizes a triangle to the screen.
  *
- *  It takes the coordinates for a triangle in world space, and converts
- *  them to screen coordinates. It then calculates an axis aligned bounding box
- *  for the triangle, where each unit is a single pixel.
+ *  It takes a triangle from the geometry stage, already in screen coordinates
+ *  with an axis aligned bounding box where each unit is a single pixel.
  *
  *  It iterates over this bounding box. At each step, the current point is converted to
  *  barycentric coordinates. If the point is within the triangle we perform depth testing
@@ -141,36 +504,34 @@ inline int clamp(int val, const int min, const int max){
  *      https://fgiesen.wordpress.com/2013/02/08/triangle-rasterization-in-practice/
  *      https://github.com/ssloy/tinyrenderer/wiki/Lesson-2-Triangle-rasterization-and-back-face-culling
  */
-void triangle(
-    const v4& vtx0, const v4& vtx1, const v4& vtx2,
-    const v2& uv0, const v2& uv1, const v2& uv2,
-    const v3& n0, const v3& n1, const v3& n2,
-    const v3& tri_normal,
-    render_state & state,
-    shader & shader
-){
+void rasterize_triangle(const setup_triangle& tri, render_state & state, shader & shader)
+{
     auto& frame_buffer = state.output_buffers.frame_buffer;
     auto& z_buffer = state.output_buffers.z_buffer;
-    
-    //map coordinates to the screen
-    auto vtx0_screen = state.viewport * vtx0;
-    auto vtx1_screen = state.viewport * vtx1;
-    auto vtx2_screen = state.viewport * vtx2;
-
-    //project from 4d to 2d
-    auto t0 = v3_to_v2(project_3d(vtx0_screen));
-    auto t1 = v3_to_v2(project_3d(vtx1_screen));
-    auto t2 = v3_to_v2(project_3d(vtx2_screen));
-
-    //find triangle bounding box x range
-    auto min_x = clamp(r_min(t0.x, t1.x, t2.x), 0, frame_buffer.width - 1);
-    auto max_x = clamp(r_max(t0.x, t1.x, t2.x), 0, frame_buffer.width - 1);
-    assert(min_x <= max_x);
-
-    //find triangle bounding box y range
-    auto min_y = clamp(r_min(t0.y, t1.y, t2.y), 0, frame_buffer.height - 1);
-    auto max_y = clamp(r_max(t0.y, t1.y, t2.y), 0, frame_buffer.height - 1);
-    assert(min_y <= max_y);
+
+    const auto& vtx0 = tri.clip[0];
+    const auto& vtx1 = tri.clip[1];
+    const auto& vtx2 = tri.clip[2];
+
+    const auto& t0 = tri.screen[0];
+    const auto& t1 = tri.screen[1];
+    const auto& t2 = tri.screen[2];
+
+    const auto& uv0 = tri.varyings.uv[0];
+    const auto& uv1 = tri.varyings.uv[1];
+    const auto& uv2 = tri.varyings.uv[2];
+
+    const auto& n0 = tri.normals[0];
+    const auto& n1 = tri.normals[1];
+    const auto& n2 = tri.normals[2];
+
+    const auto min_x = tri.min_x, max_x = tri.max_x;
+    const auto min_y = tri.min_y, max_y = tri.max_y;
+
+    //clear the tiles we are about to draw into (the wireframe stays inside the box too)
+    prepare_output_tiles(state.output_buffers, min_x, min_y, max_x, max_y);
+
+    shader.begin_triangle(tri.varyings);
 
     //iterate over the triangle 
     for(auto y = min_y; y <= max_y; y++){
@@ -186,7 +547,7 @@ void triangle(
 
                 //get current z buffer value
                 auto* z_point = &z_buffer[
-                    static_cast<int>(x + (frame_buffer.height - y) * frame_buffer.width)
+                    static_cast<int>(x + (frame_buffer.height - y - 1) * frame_buffer.width)
                 ];
                 
                 //only render the pixel if we are closer to the camera then the current z buffer value
@@ -206,13 +567,13 @@ void triangle(
                         interpolated_normal = (n0 * clip_space_bc.x + n1 * clip_space_bc.y + n2 * clip_space_bc.z).normalise();
                     }
                     else{
-                        interpolated_normal = tri_normal;
+                        interpolated_normal = tri.face_normal;
                     }
 
                     //apply fragment shader to get pixel color
                     rgba col{};
                     if(shader.fragment(clip_space_bc, col, interpolated_normal, interpolated_uv, v2_i{ x, y })){
-                        set_pixel(frame_buffer, col, x, y);
+                        set_pixel(frame_buffer, to_output_order(state.output_buffers, col), x, y);
                     }
                 }
             }
@@ -221,9 +582,78 @@ void triangle(
 
     //draw triangle wireframe if wireframe is on
     if (state.wire_frame) {
-        draw_line(t0, t1, frame_buffer, blue);
-        draw_line(t1, t2, frame_buffer, blue);
-        draw_line(t2, t0, frame_buffer, blue);
+        const auto wire_col = to_output_order(state.output_buffers, blue);
+
+        draw_line(t0, t1, frame_buffer, wire_col);
+        draw_line(t1, t2, frame_buffer, wire_col);
+        draw_line(t2, t0, frame_buffer, wire_col);
+    }
+}
+
+/*
+ * Runs every enabled effect over the frame, leaving the result in the frame
+ * buffer. Effects read whole buffers, so any tiles still pending a clear are
+ * cleared first.
+ */
+void apply_effects(output_buffers& output_buffers, screen_space_effect* effects[], const int effect_count)
+{
+    resolve_output_buffers(output_buffers);
+
+    auto* source = &output_buffers.frame_buffer;
+    auto* target = &output_buffers.temp_buffer;
+
+    for (auto i = 0; i < effect_count; i++)
+    {
+        auto& effect = *effects[i];
+        if (!effect.enabled) continue;
+
+        assert(effect.pass_count() <= max_effect_passes);
+        effect.prepare(output_buffers);
+
+        for (auto pass = 0; pass < effect.pass_count(); pass++)
+        {
+            const auto start = std::chrono::high_resolution_clock::now();
+
+            for_each_row_band(effect.pass_rows(pass, output_buffers), [&](const int first_row, const int last_row)
+            {
+                effect.run_pass(pass, output_buffers, *source, *target, first_row, last_row);
+            });
+
+            const auto stop = std::chrono::high_resolution_clock::now();
+            const auto ms = std::chrono::duration<float, std::milli>(stop - start).count();
+            effect.pass_ms[pass] = effect.pass_ms[pass] > 0 ? effect.pass_ms[pass] * 0.9f + ms * 0.1f : ms;
+
+            if (effect.writes_target(pass)) std::swap(source, target);
+        }
+    }
+
+    if (source == &output_buffers.frame_buffer) return;
+
+    //the result ended up in the temp buffer, memory we were handed has to stay where it is
+    if (output_buffers.external_frame_buffer)
+    {
+        const auto& frame_buffer = output_buffers.frame_buffer;
+        memcpy(frame_buffer.data, output_buffers.temp_buffer.data, static_cast<size_t>(frame_buffer.width) * frame_buffer.height * sizeof(rgba));
+    }
+    else
+    {
+        std::swap(output_buffers.frame_buffer.data, output_buffers.temp_buffer.data);
+    }
+}
+
+void print_effect_timings(screen_space_effect* effects[], const int effect_count)
+{
+    for (auto i = 0; i < effect_count; i++)
+    {
+        auto& effect = *effects[i];
+        if (!effect.enabled) continue;
+
+        printf("%s:", effect.name());
+        for (auto pass = 0; pass < effect.pass_count(); pass++)
+        {
+            printf(" %.2f", effect.pass_ms[pass]);
+        }
+        printf(" ms\n");
     }
 }
 
@@ -244,44 +674,41 @@ void draw_model(model & obj, render_state & state, shader & shader)
     */
     const auto view_position_object_space = m4_to_m3(state.projection * state.model_view).invert() * state.eye;
 
+    auto& geometry = state.geometry;
+
     for(size_t i = 0; i < obj.mesh_count; i++)
     {
         auto& mesh = obj.meshes[i];
         shader.mesh_to_draw = &mesh;
 
         shader.begin_pass();
-        
-        for (size_t face_no = 0; face_no < mesh.face_count; face_no++) {
-            auto& face = mesh.faces[face_no];
-
-            //calculate triangle normal
-            auto normal = cross(
-                mesh.verts[face.verts.y] - mesh.verts[face.verts.x],
-                mesh.verts[face.verts.z] - mesh.verts[face.verts.x]
-            ).normalise();
-
-            //cull the triangle if it is back facing
-            if (
-                state.backspace_culling &&
-                normal.inner(mesh.verts[face.verts.x] - view_position_object_space) >= 0
-            )
+
+        //without its diffuse map there is nothing to shade the mesh with, see load_mesh_map()
+        const auto textured = mesh.diffuse.data != nullptr || mesh.virtual_diffuse != nullptr || mesh.has_material_texture;
+
+        const auto face_count = static_cast<int>(mesh.face_count);
+        if (face_count == 0 || !textured) continue;
+
+        geometry.chunk_count = clamp((face_count + min_geometry_chunk_faces - 1) / min_geometry_chunk_faces, 1, max_geometry_chunks);
+        const auto chunk_faces = (face_count + geometry.chunk_count - 1) / geometry.chunk_count;
+
+        //set up every chunk in parallel, a job may be handed several chunks when running inline
+        parallel_for(face_count, chunk_faces, [&](const int first, const int last)
+        {
+            for (auto chunk = first / chunk_faces; chunk * chunk_faces < last; chunk++)
             {
-                continue;
+                const auto chunk_last = std::min((chunk + 1) * chunk_faces, face_count);
+                setup_triangles(mesh, view_position_object_space, state, shader, chunk * chunk_faces, chunk_last, geometry.chunks[chunk]);
             }
+        });
 
-            //run the vertex shader
-            v4 tri[3];
-            for (auto vert_no = 0; vert_no < 3; vert_no++) {
-                tri[vert_no] = shader.vertex(mesh.verts[face.verts.e[vert_no]], face_no, vert_no);
+        //rasterize in submission order
+        for (auto chunk = 0; chunk < geometry.chunk_count; chunk++)
+        {
+            for (const auto& tri : geometry.chunks[chunk])
+            {
+                rasterize_triangle(tri, state, shader);
             }
-
-            //rasterize the triangle
-            triangle(
-                tri[0], tri[1], tri[2],
-                mesh.uvs[face.uv.x],mesh.uvs[face.uv.y],mesh.uvs[face.uv.z],
-                mesh.normals[face.normal.x], mesh.normals[face.normal.y], mesh.normals[face.normal.z],
-                normal, state, shader
-            );
         }
     }
-}
\ No newline at end of file
+}
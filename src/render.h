@@ -1,16 +1,53 @@
 #if !defined(RENDER_H)
 #define RENDER_H
 
+#include <atomic>
+#include <vector>
+
 #include "maths.h"
 #include "image.h"
+#include "platform_specific.h"
+
+#if HAS_THREADS
+#include <condition_variable>
+#include <mutex>
+#endif
 
-struct screen_space_effect;
 static const int min_z_buffer_val = -1000;
 
+/*
+ * The output buffers are split into square tiles so clears can be lazy.
+ * Clearing only flags every tile as pending; a pending tile is filled with
+ * the clear colour and depth the first time rasterization touches it, and
+ * tiles nothing touched are written straight to the screen at present time
+ * without ever being filled. Tiles are counted from the top left of the
+ * buffers, matching their memory layout.
+ */
+static const int output_tile_size = 32;
+
+/*
+ * Byte order of the frame buffer's pixels. Rendering in the order of the
+ * surface we present to lets presentation hand the frame over without
+ * repacking it. Shaders always work in rgba, the swizzle happens on store.
+ */
+enum class pixel_order { rgba, bgra };
+
 struct output_buffers{
     image frame_buffer;
     image temp_buffer;
     float * z_buffer{};
+
+    //the buffers are allocated at this size and can be resized to anything up to it
+    int max_width{}, max_height{};
+
+    int tiles_x{}, tiles_y{};
+    unsigned char * tile_pending_clear{};
+    rgba clear_color{};
+
+    pixel_order order = pixel_order::rgba;
+
+    //true when the frame buffer is memory we were handed, eg the window surface
+    bool external_frame_buffer{};
 };
 
 /*
@@ -20,6 +57,123 @@ struct output_buffers{
  */
 void init_output_buffers(output_buffers& output_buffers, int width, int height);
 void clear_output_buffers(output_buffers& output_buffers, const rgba& clear_color);
+inline void prepare_output_tiles(output_buffers& output_buffers, int min_x, int min_y, int max_x, int max_y);
+void resolve_output_buffers(output_buffers& output_buffers);
+void resize_output_buffers(output_buffers& output_buffers, int width, int height);
+void use_external_frame_buffer(output_buffers& output_buffers, unsigned char* pixels, pixel_order order);
+inline rgba to_output_order(const output_buffers& output_buffers, const rgba& col);
+
+/*
+ * Three sets of output buffers shared by a rendering and a presenting thread
+ * without locks. The renderer owns one set, the presenter owns another and
+ * the third is handed between them through an atomic exchange, tagged as
+ * fresh when it holds a frame the presenter hasn't seen. The renderer never
+ * waits: it swaps its finished frame for whatever is in the middle, dropping
+ * a frame the presenter never picked up. A presenter with nothing new to
+ * show can sleep until a frame is published, see wait_for_output_buffers().
+ */
+struct output_triple_buffer
+{
+    output_buffers buffers[3];
+
+    //index of the middle set, with output_triple_buffer_fresh set when it holds a new frame
+    std::atomic<int> middle{ 1 };
+
+    int rendering = 0;
+    int presenting = 2;
+
+    //sets the presenter already cleared, the rest are cleared lazily by the renderer
+    bool cleared[3]{};
+
+#if HAS_THREADS
+    //signalled each time a frame is published
+    std::mutex publish_lock;
+    std::condition_variable published;
+#endif
+};
+
+static const int output_triple_buffer_fresh = 4;
+
+void init_output_triple_buffer(output_triple_buffer& triple_buffer, int width, int height, pixel_order order);
+output_buffers& publish_output_buffers(output_triple_buffer& triple_buffer, const output_buffers& finished);
+output_buffers* acquire_output_buffers(output_triple_buffer& triple_buffer);
+void recycle_output_buffers(output_triple_buffer& triple_buffer);
+
+#if HAS_THREADS
+void wait_for_output_buffers(output_triple_buffer& triple_buffer, int timeout_ms);
+#endif
+
+/*
+ * Picks the render resolution from frame times, to keep them near a target.
+ * The resolution is a scale of the output buffers' maximum size so changing
+ * it never reallocates, see resize_output_buffers().
+ */
+struct resolution_scaler
+{
+    float target_ms = 16.6f;
+    float min_scale = 0.5f;
+    float max_scale = 1.0f;
+
+    float scale = 1.0f;
+
+    //frame time averaged over the last few frames, so a single slow frame doesn't resize
+    float smoothed_ms{};
+};
+
+void update_resolution_scale(resolution_scaler& scaler, float frame_ms);
+void scaled_render_size(const resolution_scaler& scaler, int max_width, int max_height, int& width, int& height);
+
+/*
+ * What a triangle's fragments need from its vertices, beyond the attributes
+ * the rasterizer interpolates. The geometry stage fills in the uvs and lod,
+ * the vertex shader anything else, and the rasterizer hands them back to the
+ * shader through begin_triangle() before shading the triangle.
+ */
+struct triangle_varyings
+{
+    //positions after the shader's own transform, divided through by w
+    v3 ndc[3];
+    v2 uv[3];
+
+    //log2 of the uv step per pixel, adding a texture's log2 size gives its mip level
+    float uv_lod;
+};
+
+/*
+ * A face that survived culling and clipping, transformed and ready to
+ * rasterize.
+ */
+struct setup_triangle
+{
+    //index of the face in its mesh, consumers that reorder triangles sort on it to restore submission order
+    int sequence;
+
+    v4 clip[3];
+    v2_i screen[3];
+
+    //screen space bounding box, clamped to the frame buffer
+    int min_x, min_y, max_x, max_y;
+
+    v3 normals[3];
+    v3 face_normal;
+
+    triangle_varyings varyings;
+};
+
+/*
+ * Output of the geometry stage. Each mesh's faces are split into up to
+ * max_geometry_chunks runs, set up in parallel, each into its own queue, so
+ * reading the queues in order gives the triangles in submission order. The
+ * queues keep their memory between meshes and frames.
+ */
+static const int max_geometry_chunks = 64;
+static const int min_geometry_chunk_faces = 512;
+
+struct geometry_queues
+{
+    std::vector<setup_triangle> chunks[max_geometry_chunks];
+    int chunk_count{};
+};
 
 struct render_state{
     v3 eye{};
@@ -31,7 +185,8 @@ struct render_state{
     m4 projection{};
     m4 viewport{};
 
-    output_buffers output_buffers;
+    ::output_buffers output_buffers;
+    geometry_queues geometry;
 
     bool backspace_culling = true;
     bool wire_frame = false;
@@ -53,7 +208,11 @@ struct shader
     
     virtual const char* name() = 0;
     virtual void begin_pass() = 0;
-    virtual v4 vertex(v3 & vertex, int face_no, int vert_no) = 0;
+
+    //runs on the geometry stage's threads, so mustn't change the shader, per triangle outputs go in varyings
+    virtual v4 vertex(const v3& vertex, int face_no, int vert_no, triangle_varyings& varyings) const = 0;
+
+    virtual void begin_triangle(const triangle_varyings& varyings) {}
     virtual bool fragment(const v3& bar, rgba & col, v3 interpolated_normal, v2 interpolated_uv, const v2_i& screen_pos) = 0;
 
     shader() = default;
@@ -68,6 +227,48 @@ struct shader
         virtual ~shader() = default;
 };
 
+/*
+ * A full screen effect run over a finished frame. Each pass reads one of the
+ * frame and temp buffers and writes the other, apply_effects() swaps them
+ * in between so a chain of passes never allocates. Passes run over bands of
+ * rows in parallel, a pass may only write the rows it is given.
+ */
+static const int max_effect_passes = 4;
+
+struct screen_space_effect
+{
+    bool enabled = true;
+
+    //milliseconds each pass took, averaged over recent frames
+    float pass_ms[max_effect_passes]{};
+
+    virtual const char* name() = 0;
+    virtual int pass_count() = 0;
+
+    //called once a frame before the first pass, off the worker threads
+    virtual void prepare(const output_buffers& buffers) {}
+
+    //passes that only write the effect's own scratch data don't swap the buffers
+    virtual bool writes_target(int pass) { return true; }
+    virtual int pass_rows(int pass, const output_buffers& buffers) { return buffers.frame_buffer.height; }
+
+    virtual void run_pass(int pass, const output_buffers& buffers, const image& source, image& target, int first_row, int last_row) = 0;
+
+    screen_space_effect() = default;
+
+    /* Prevent any accidental copying */
+    screen_space_effect& operator = (screen_space_effect && rhs) = delete;
+    screen_space_effect& operator = (screen_space_effect & rhs) = delete;
+    screen_space_effect(const screen_space_effect & rhs) = delete;
+    screen_space_effect(screen_space_effect&&) = delete;
+
+    protected:
+        virtual ~screen_space_effect() = default;
+};
+
+void apply_effects(output_buffers& output_buffers, screen_space_effect* effects[], int effect_count);
+void print_effect_timings(screen_space_effect* effects[], int effect_count);
+
 void draw_model(model & obj, render_state& state, shader& shader);
 void draw_line(v2_i v0, v2_i v1, image& out, rgba col);
 
@@ -0,0 +1,165 @@
+#include <cassert>
+#include <cmath>
+#include <cstring>
+
+#include "sampler.h"
+#include "platform_specific.h"
+
+inline uv_fixed to_fixed_uv(const v2& uv)
+{
+    return {
+        static_cast<int>(std::floor(uv.x * uv_fixed_one)),
+        static_cast<int>(std::floor(uv.y * uv_fixed_one))
+    };
+}
+
+/*
+ * Maps a texel coordinate that may be outside the texture back inside it.
+ */
+inline int wrap_coord(const int coord, const int size, const wrap_mode wrap)
+{
+    if (coord >= 0 && coord < size)
+    {
+        return coord;
+    }
+
+    switch (wrap)
+    {
+    case wrap_mode::clamp:
+        return coord < 0 ? 0 : size - 1;
+
+    case wrap_mode::mirror: {
+        const auto period = size * 2;
+        auto wrapped = coord % period;
+        if (wrapped < 0) wrapped += period;
+
+        return wrapped < size ? wrapped : period - wrapped - 1;
+    }
+
+    default: {
+        auto wrapped = coord % size;
+        if (wrapped < 0) wrapped += size;
+
+        return wrapped;
+    }
+    }
+}
+
+/*
+ * Scales a fixed point coordinate by a texture dimension, giving the texel
+ * coordinate in 24.8 fixed point.
+ */
+inline int scale_fixed_coord(const int coord, const int size)
+{
+    return static_cast<int>((static_cast<long long>(coord) * size) >> (uv_fixed_shift - 8));
+}
+
+/*
+ * Blends a 2x2 block of texels, ordered (x0, y0), (x1, y0), (x0, y1), (x1, y1),
+ * with 8 bit fractional weights. The SSE2 path blends all four texels
+ * and channels at once in 16 bit lanes.
+ */
+rgba bilinear_blend(const rgba texels[4], const int frac_x, const int frac_y)
+{
+    assert(frac_x >= 0 && frac_x <= 256);
+    assert(frac_y >= 0 && frac_y <= 256);
+
+    //weights sum to exactly 256, so the blend can't overflow 16 bits
+    const auto w01 = (frac_x * (256 - frac_y)) >> 8;
+    const auto w10 = ((256 - frac_x) * frac_y) >> 8;
+    const auto w11 = (frac_x * frac_y) >> 8;
+    const auto w00 = 256 - w01 - w10 - w11;
+
+#if HAS_SSE2
+    int packed[4];
+    memcpy(packed, texels, sizeof(packed));
+
+    const auto zero = _mm_setzero_si128();
+    const auto pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(packed));
+
+    //widen to 16 bits, the y0 row in one register and the y1 row in the other
+    const auto row0 = _mm_unpacklo_epi8(pixels, zero);
+    const auto row1 = _mm_unpackhi_epi8(pixels, zero);
+
+    const auto row0_weights = _mm_set_epi16(w01, w01, w01, w01, w00, w00, w00, w00);
+    const auto row1_weights = _mm_set_epi16(w11, w11, w11, w11, w10, w10, w10, w10);
+
+    //weight every channel, then add the x0 and x1 halves together
+    auto sum = _mm_add_epi16(_mm_mullo_epi16(row0, row0_weights), _mm_mullo_epi16(row1, row1_weights));
+    sum = _mm_add_epi16(sum, _mm_srli_si128(sum, 8));
+    sum = _mm_srli_epi16(sum, 8);
+
+    const auto result = _mm_cvtsi128_si32(_mm_packus_epi16(sum, sum));
+
+    rgba ret;
+    memcpy(&ret, &result, sizeof(ret));
+    return ret;
+#else
+    rgba ret{};
+    for (auto c = 0; c < 4; c++)
+    {
+        const auto sum =
+            texels[0].e[c] * w00 + texels[1].e[c] * w01 +
+            texels[2].e[c] * w10 + texels[3].e[c] * w11;
+
+        ret.e[c] = static_cast<unsigned char>(sum >> 8);
+    }
+    return ret;
+#endif
+}
+
+inline rgba sample(const sampler& s, image& tex, const uv_fixed& uv)
+{
+    const auto x = scale_fixed_coord(uv.u, tex.width);
+    const auto y = scale_fixed_coord(uv.v, tex.height);
+
+    if (s.filter == filter_mode::point)
+    {
+        return get_pixel(tex, wrap_coord(x >> 8, tex.width, s.wrap), wrap_coord(y >> 8, tex.height, s.wrap));
+    }
+
+    //move to texel centres, so integer coordinates sit half way between texels
+    const auto cx = x - 128;
+    const auto cy = y - 128;
+
+    const auto x0 = wrap_coord(cx >> 8, tex.width, s.wrap);
+    const auto x1 = wrap_coord((cx >> 8) + 1, tex.width, s.wrap);
+    const auto y0 = wrap_coord(cy >> 8, tex.height, s.wrap);
+    const auto y1 = wrap_coord((cy >> 8) + 1, tex.height, s.wrap);
+
+    const rgba texels[4] = {
+        get_pixel(tex, x0, y0),
+        get_pixel(tex, x1, y0),
+        get_pixel(tex, x0, y1),
+        get_pixel(tex, x1, y1)
+    };
+
+    return bilinear_blend(texels, cx & 255, cy & 255);
+}
+
+inline v3 sample_normal(const sampler& s, image& tex, const uv_fixed& uv)
+{
+    //bc5 rebuilds z per texel, so let it skip the rgba round trip when it can
+    if (s.filter == filter_mode::point)
+    {
+        const auto x = scale_fixed_coord(uv.u, tex.width) >> 8;
+        const auto y = scale_fixed_coord(uv.v, tex.height) >> 8;
+
+        return get_normal(tex, wrap_coord(x, tex.width, s.wrap), wrap_coord(y, tex.height, s.wrap));
+    }
+
+    return unpack_normal(sample(s, tex, uv));
+}
+
+/*
+ * Material textures are always point sampled: blending packed normals and
+ * rgb565 emission per channel would need unpacking every texel first, which
+ * defeats the point of the single fetch.
+ */
+inline material_texel sample_material(const sampler& s, const material_texture& tex, const uv_fixed& uv)
+{
+    const auto x = scale_fixed_coord(uv.u, tex.width) >> 8;
+    const auto y = scale_fixed_coord(uv.v, tex.height) >> 8;
+
+    return get_material_texel(tex, wrap_coord(x, tex.width, s.wrap), wrap_coord(y, tex.height, s.wrap));
+}
@@ -0,0 +1,52 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "image.h"
+#include "material_texture.h"
+
+/*
+ * How texture coordinates outside of 0-1 are handled.
+ */
+enum class wrap_mode
+{
+    repeat,
+    clamp,
+    mirror
+};
+
+enum class filter_mode
+{
+    point,
+    bilinear
+};
+
+struct sampler
+{
+    wrap_mode wrap = wrap_mode::repeat;
+    filter_mode filter = filter_mode::point;
+};
+
+/*
+ * Texture coordinates in 16.16 fixed point. A fragment's uv is converted
+ * once, then every texture it samples scales it by its own size with an
+ * integer multiply, so maps of different resolutions line up.
+ */
+static const int uv_fixed_shift = 16;
+static const int uv_fixed_one = 1 << uv_fixed_shift;
+
+struct uv_fixed
+{
+    int u, v;
+};
+
+inline uv_fixed to_fixed_uv(const v2& uv);
+inline int wrap_coord(int coord, int size, wrap_mode wrap);
+inline int scale_fixed_coord(int coord, int size);
+
+inline rgba sample(const sampler& s, image& tex, const uv_fixed& uv);
+inline v3 sample_normal(const sampler& s, image& tex, const uv_fixed& uv);
+inline material_texel sample_material(const sampler& s, const material_texture& tex, const uv_fixed& uv);
+
+rgba bilinear_blend(const rgba texels[4], int frac_x, int frac_y);
+
+#endif
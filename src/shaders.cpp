@@ -1,24 +1,24 @@
+#include <algorithm>
 #include <cmath>
 
 #include "render.h"
 #include "file.h"
-
-v2_i get_tex_indicies(const v2& uv, const mesh& mesh)
-{
-    return {
-        static_cast<int>(uv.x * static_cast<float>(mesh.diffuse.width - 1)),
-        static_cast<int>(uv.y * static_cast<float>(mesh.diffuse.height - 1))
-    };
-}
+#include "sampler.h"
 
 struct blinn_shader_normal_map final : public shader{
     m4 model_view_proj{};
     m3 normal_mat{};
 
-    //outputs for fragment
+    //varyings of the triangle being shaded
     v3 ndc_vertex[3]{};
     v2 vertex_uv[3]{};
 
+    //log2 of uv units per pixel for the current triangle, picks virtual texture mips
+    float uv_lod{};
+
+    //used for every map the shader reads
+    sampler map_sampler{};
+
     const char* name() override { return "Blinn Normal Map"; }
 
     void begin_pass() override
@@ -28,25 +28,51 @@ struct blinn_shader_normal_map final : public shader{
         model_view_proj = renderer_state->projection * renderer_state->model_view;
     }
 
-    v4 vertex(v3 & vertex, int face_no, int vert_no) override
+    v4 vertex(const v3& vertex, int face_no, int vert_no, triangle_varyings& varyings) const override
     {
         const auto ret = model_view_proj  * project_4d(vertex);
 
+        //the tangent frame is only needed for normal mapping
         if(mesh_to_draw -> allow_lighting && mesh_to_draw->has_normal_map){
-            ndc_vertex[vert_no] = project_3d(renderer_state->projection * renderer_state->model_view * project_4d(vertex));
-            vertex_uv[vert_no] = mesh_to_draw->uvs[mesh_to_draw->faces[face_no].uv.e[vert_no]];
+            varyings.ndc[vert_no] = project_3d(ret);
         }
 
         return ret;
     }
 
+    void begin_triangle(const triangle_varyings& varyings) override
+    {
+        for (auto i = 0; i < 3; i++) {
+            ndc_vertex[i] = varyings.ndc[i];
+            vertex_uv[i] = varyings.uv[i];
+        }
+
+        uv_lod = varyings.uv_lod;
+    }
+
+    rgba sample_map(image& map, virtual_texture* virtual_map, const uv_fixed& uv) const
+    {
+        if (virtual_map != nullptr) {
+            return sample_virtual(map_sampler, *virtual_map, uv, uv_lod + virtual_map->log2_size);
+        }
+
+        return sample(map_sampler, map, uv);
+    }
+
 
 
     bool fragment(const v3& bar, rgba & col, v3 interpolated_normal, v2 interpolated_uv, const v2_i& screen_pos) override
     {
-        const auto tex_indicies = get_tex_indicies(interpolated_uv, *mesh_to_draw);
-        
-        auto dif = get_pixel(mesh_to_draw->diffuse, tex_indicies.x, tex_indicies.y);
+        const auto uv = to_fixed_uv(interpolated_uv);
+
+        //a packed material gives us every map from a single fetch
+        const auto packed = mesh_to_draw->has_material_texture;
+        material_texel material{};
+        if (packed) {
+            material = sample_material(map_sampler, mesh_to_draw->material, uv);
+        }
+
+        auto dif = packed ? material_diffuse(material) : sample_map(mesh_to_draw->diffuse, mesh_to_draw->virtual_diffuse, uv);
         col = dif;
 
         //skip lighting calculations
@@ -69,7 +95,15 @@ struct blinn_shader_normal_map final : public shader{
 
             auto b = m3{ i, j, interpolated_normal }.transpose();
 
-            normal = get_normal(mesh_to_draw->normal, tex_indicies.x, tex_indicies.y);
+            if (packed) {
+                normal = material_normal(material);
+            }
+            else if (mesh_to_draw->virtual_normal != nullptr) {
+                normal = unpack_normal(sample_map(mesh_to_draw->normal, mesh_to_draw->virtual_normal, uv));
+            }
+            else {
+                normal = sample_normal(map_sampler, mesh_to_draw->normal, uv);
+            }
 
             normal = (b * normal).normalise();
         }
@@ -88,14 +122,14 @@ struct blinn_shader_normal_map final : public shader{
         float spec = 0;
         if(mesh_to_draw->has_specular_map)
         {
-            auto spec_rgb = get_pixel(mesh_to_draw->spec, tex_indicies.x, tex_indicies.y);
+            const auto spec_power = packed ? material.spec : sample_map(mesh_to_draw->spec, mesh_to_draw->virtual_spec, uv).b;
 
             auto r = (normal * (normal.inner(l)) * 2 - l).normalise();
             if (r.z < 0) {
                 r.z = 0;
             }
             
-            spec = pow(r.z, 5 + spec_rgb.b);
+            spec = pow(r.z, 5 + spec_power);
         }
         
         col = col * (1.2f * diffuse + 0.6f * spec);
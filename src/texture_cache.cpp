@@ -0,0 +1,163 @@
+#include <cstdio>
+#include <cstring>
+#include <sys/stat.h>
+
+#include "texture_cache.h"
+
+static const char texture_cache_magic[4] = { 'D', 'T', 'E', 'X' };
+static const uint32_t texture_cache_version = 1;
+
+struct texture_cache_header
+{
+    char magic[4];
+    uint32_t version;
+
+    uint64_t source_size;
+    int64_t source_mtime;
+    uint64_t content_hash;
+
+    int32_t width;
+    int32_t height;
+    uint32_t layout;
+    uint32_t format;
+    int32_t channel;
+    int32_t tiles_x;
+
+    uint64_t data_size;
+};
+
+//the texels follow the header, which is a cache line long
+static_assert(sizeof(texture_cache_header) == 64, "texture_cache_header is part of the file format");
+
+/*
+ * "<path>.<conversion>.tex". Compressed formats are always tiled, and only
+ * bc4 takes a single channel, so only those distinguish conversions.
+ */
+static void cached_texture_path(
+    const char* path, char* out, const size_t out_size,
+    const image_layout layout, const image_format format, const int channel
+)
+{
+    switch (format)
+    {
+    case image_format::bc1:
+        snprintf(out, out_size, "%s.bc1.tex", path);
+        break;
+    case image_format::bc4:
+        snprintf(out, out_size, "%s.bc4_%d.tex", path, channel);
+        break;
+    case image_format::bc5:
+        snprintf(out, out_size, "%s.bc5.tex", path);
+        break;
+    default:
+        snprintf(out, out_size, "%s.%s.tex", path, layout == image_layout::tiled ? "rgba8_tiled" : "rgba8");
+        break;
+    }
+}
+
+bool stat_texture_source(const char* path, texture_source& out)
+{
+    struct stat source_stat{};
+    if (stat(path, &source_stat) != 0) return false;
+
+    out.size = static_cast<uint64_t>(source_stat.st_size);
+    out.mtime = static_cast<int64_t>(source_stat.st_mtime);
+
+    return true;
+}
+
+bool load_cached_texture(
+    const char* path, image& out, texture_source& source,
+    const image_layout layout, const image_format format, const int channel
+)
+{
+    char cache_path[1024];
+    cached_texture_path(path, cache_path, sizeof(cache_path), layout, format, channel);
+
+    mapped_file file;
+    if (!map_file(cache_path, file)) return false;
+
+    texture_cache_header header{};
+    if (file.size >= sizeof(header)) memcpy(&header, file.data, sizeof(header));
+
+    image cached{};
+    cached.width = header.width;
+    cached.height = header.height;
+    cached.layout = static_cast<image_layout>(header.layout);
+    cached.format = static_cast<image_format>(header.format);
+    cached.tiles_x = header.tiles_x;
+
+    const auto tiled = cached.format != image_format::rgba8 || cached.layout == image_layout::tiled;
+    const auto tiles_x = tiled ? (header.width + image_tile_size - 1) / image_tile_size : 0;
+
+    const auto valid =
+        file.size >= sizeof(header) &&
+        memcmp(header.magic, texture_cache_magic, sizeof(header.magic)) == 0 &&
+        header.version == texture_cache_version &&
+        cached.format == format && (format != image_format::rgba8 || cached.layout == layout) &&
+        (format != image_format::bc4 || header.channel == channel) &&
+        header.width > 0 && header.height > 0 && header.tiles_x == tiles_x &&
+        header.data_size == image_data_size(cached) &&
+        file.size - sizeof(header) >= header.data_size;
+
+    if (!valid)
+    {
+        unmap_file(file);
+        return false;
+    }
+
+    cached.data = file.data + sizeof(header);
+    cached.mapping = file;
+
+    source.size = header.source_size;
+    source.mtime = header.source_mtime;
+    source.content_hash = header.content_hash;
+
+    out = cached;
+    return true;
+}
+
+void save_cached_texture(const char* path, const image& img, const int channel, const texture_source& source)
+{
+    char cache_path[1024];
+    cached_texture_path(path, cache_path, sizeof(cache_path), img.layout, img.format, channel);
+
+    //written under a name of its own and renamed, so a run loading the same texture never sees half a file
+    char temp_path[1024 + 32];
+    snprintf(temp_path, sizeof(temp_path), "%s.%p.tmp", cache_path, static_cast<const void*>(img.data));
+
+    FILE* f = nullptr;
+    create_binary_file(temp_path, f);
+    if (f == nullptr) return;
+
+    texture_cache_header header{};
+    memcpy(header.magic, texture_cache_magic, sizeof(header.magic));
+    header.version = texture_cache_version;
+    header.source_size = source.size;
+    header.source_mtime = source.mtime;
+    header.content_hash = source.content_hash;
+    header.width = img.width;
+    header.height = img.height;
+    header.layout = static_cast<uint32_t>(img.layout);
+    header.format = static_cast<uint32_t>(img.format);
+    header.channel = channel;
+    header.tiles_x = img.tiles_x;
+    header.data_size = image_data_size(img);
+
+    const auto written =
+        fwrite(&header, sizeof(header), 1, f) == 1 &&
+        fwrite(img.data, 1, header.data_size, f) == header.data_size;
+
+    if (fclose(f) != 0 || !written)
+    {
+        remove(temp_path);
+        return;
+    }
+
+#if defined(_MSC_VER)
+    //windows won't rename over an existing file
+    remove(cache_path);
+#endif
+
+    if (rename(temp_path, cache_path) != 0) remove(temp_path);
+}
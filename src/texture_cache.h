@@ -0,0 +1,50 @@
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+
+#include <cstdint>
+
+#include "image.h"
+
+/*
+ * Decoded textures saved next to their source image, so later runs map the
+ * finished texels instead of decoding and compressing the png or jpeg again.
+ *
+ * Each way of converting a source (layout, format, channel) gets its own
+ * file, "diffuse.png.bc1.tex" for example. A cache file records the size,
+ * modification time and content hash of the source it was made from, and
+ * the caller compares those with the source before using it. Texels start
+ * 64 bytes into the file, so the mapped image is as aligned as a decoded
+ * one.
+ *
+ * Images have no mip chain outside of virtual textures, which keep their own
+ * page files, so there are no mips to cache.
+ */
+struct texture_source
+{
+    uint64_t size{};
+    int64_t mtime{};
+    uint64_t content_hash{};
+};
+
+/*
+ * Size and modification time of the file at path, the content hash is left
+ * alone.
+ */
+bool stat_texture_source(const char* path, texture_source& out);
+
+/*
+ * Maps the cached conversion of path, and fills in the source it was made
+ * from. Free the image with free_image() as usual.
+ */
+bool load_cached_texture(
+    const char* path, image& out, texture_source& source,
+    image_layout layout, image_format format, int channel
+);
+
+/*
+ * Writes img out as the cached conversion of path. Failing to write is not
+ * an error, the texture is decoded again next time.
+ */
+void save_cached_texture(const char* path, const image& img, int channel, const texture_source& source);
+
+#endif
@@ -0,0 +1,390 @@
+#include <cassert>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+#include "texture_compression.h"
+
+/*
+ * Block compression for textures, done once at load time.
+ *
+ * The encoders favour speed and simplicity over quality: bc1 end points are
+ * the extreme texels along the block's colour bounding box diagonal and bc4
+ * end points are the block's min and max. Both then pick the closest palette
+ * entry for every texel. That is plenty for the diffuse, normal and spec maps
+ * in obj/, and keeps startup fast.
+ *
+ * The decoders work on a single texel, so sampling costs a handful of integer
+ * operations rather than decoding a whole block per fetch.
+ */
+
+uint16_t pack_565(const rgba& col)
+{
+    return static_cast<uint16_t>(
+        ((col.r * 31 + 127) / 255) << 11 |
+        ((col.g * 63 + 127) / 255) << 5 |
+        ((col.b * 31 + 127) / 255)
+    );
+}
+
+rgba unpack_565(const uint16_t col)
+{
+    const auto r = (col >> 11) & 31;
+    const auto g = (col >> 5) & 63;
+    const auto b = col & 31;
+
+    return {
+        static_cast<unsigned char>(r << 3 | r >> 2),
+        static_cast<unsigned char>(g << 2 | g >> 4),
+        static_cast<unsigned char>(b << 3 | b >> 2),
+        255
+    };
+}
+
+static rgba lerp_color(const rgba& a, const rgba& b, const int a_weight, const int b_weight)
+{
+    const auto total = a_weight + b_weight;
+
+    return {
+        static_cast<unsigned char>((a.r * a_weight + b.r * b_weight) / total),
+        static_cast<unsigned char>((a.g * a_weight + b.g * b_weight) / total),
+        static_cast<unsigned char>((a.b * a_weight + b.b * b_weight) / total),
+        255
+    };
+}
+
+static void bc1_palette(const bc1_block& block, rgba palette[4])
+{
+    palette[0] = unpack_565(block.color0);
+    palette[1] = unpack_565(block.color1);
+
+    if (block.color0 > block.color1)
+    {
+        palette[2] = lerp_color(palette[0], palette[1], 2, 1);
+        palette[3] = lerp_color(palette[0], palette[1], 1, 2);
+    }
+    else
+    {
+        palette[2] = lerp_color(palette[0], palette[1], 1, 1);
+        palette[3] = rgba{ 0, 0, 0, 0 };
+    }
+}
+
+static int bc4_value(const int value0, const int value1, const int index)
+{
+    if (index == 0) return value0;
+    if (index == 1) return value1;
+
+    //eight value mode
+    if (value0 > value1)
+    {
+        return ((8 - index) * value0 + (index - 1) * value1) / 7;
+    }
+
+    //six value mode, with explicit 0 and 255
+    if (index == 6) return 0;
+    if (index == 7) return 255;
+
+    return ((6 - index) * value0 + (index - 1) * value1) / 5;
+}
+
+static int color_distance_sq(const rgba& a, const rgba& b)
+{
+    const auto dr = a.r - b.r;
+    const auto dg = a.g - b.g;
+    const auto db = a.b - b.b;
+
+    return dr * dr + dg * dg + db * db;
+}
+
+static bc1_block encode_bc1_block(const rgba texels[16])
+{
+    rgba min_col = texels[0];
+    rgba max_col = texels[0];
+
+    for (auto i = 1; i < 16; i++)
+    {
+        for (auto c = 0; c < 3; c++)
+        {
+            min_col.e[c] = std::min(min_col.e[c], texels[i].e[c]);
+            max_col.e[c] = std::max(max_col.e[c], texels[i].e[c]);
+        }
+    }
+
+    //pick the texels furthest apart along the bounding box diagonal as end points
+    const int axis[3] = { max_col.r - min_col.r, max_col.g - min_col.g, max_col.b - min_col.b };
+
+    auto min_proj = 0, max_proj = 0;
+    auto min_idx = 0, max_idx = 0;
+
+    for (auto i = 0; i < 16; i++)
+    {
+        const auto proj = texels[i].r * axis[0] + texels[i].g * axis[1] + texels[i].b * axis[2];
+
+        if (i == 0 || proj < min_proj) { min_proj = proj; min_idx = i; }
+        if (i == 0 || proj > max_proj) { max_proj = proj; max_idx = i; }
+    }
+
+    bc1_block block{};
+    block.color0 = pack_565(texels[max_idx]);
+    block.color1 = pack_565(texels[min_idx]);
+
+    //flat block, every texel uses color0
+    if (block.color0 == block.color1)
+    {
+        return block;
+    }
+
+    //color0 > color1 selects the four colour mode
+    if (block.color0 < block.color1)
+    {
+        std::swap(block.color0, block.color1);
+    }
+
+    rgba palette[4];
+    bc1_palette(block, palette);
+
+    for (auto i = 0; i < 16; i++)
+    {
+        auto best = 0;
+        auto best_dist = color_distance_sq(texels[i], palette[0]);
+
+        for (auto p = 1; p < 4; p++)
+        {
+            const auto dist = color_distance_sq(texels[i], palette[p]);
+            if (dist < best_dist)
+            {
+                best_dist = dist;
+                best = p;
+            }
+        }
+
+        block.indices |= static_cast<uint32_t>(best) << (2 * i);
+    }
+
+    return block;
+}
+
+static bc4_block encode_bc4_block(const unsigned char values[16])
+{
+    auto min_val = values[0];
+    auto max_val = values[0];
+
+    for (auto i = 1; i < 16; i++)
+    {
+        min_val = std::min(min_val, values[i]);
+        max_val = std::max(max_val, values[i]);
+    }
+
+    bc4_block block{};
+    block.value0 = max_val;
+    block.value1 = min_val;
+
+    //flat block, every texel uses value0
+    if (max_val == min_val)
+    {
+        return block;
+    }
+
+    uint64_t bits = 0;
+
+    for (auto i = 0; i < 16; i++)
+    {
+        auto best = 0;
+        auto best_dist = 256;
+
+        for (auto index = 0; index < 8; index++)
+        {
+            const auto dist = std::abs(bc4_value(max_val, min_val, index) - values[i]);
+            if (dist < best_dist)
+            {
+                best_dist = dist;
+                best = index;
+            }
+        }
+
+        bits |= static_cast<uint64_t>(best) << (3 * i);
+    }
+
+    for (auto i = 0; i < 6; i++)
+    {
+        block.indices[i] = static_cast<uint8_t>(bits >> (8 * i));
+    }
+
+    return block;
+}
+
+/*
+ * Gathers the 16 texels of a block from a linear image, top row first.
+ * Texels past the edge of the image repeat the last row/column.
+ */
+static void gather_block(const image& source, const int block_x, const int block_y, rgba texels[16])
+{
+    const auto* pixels = reinterpret_cast<const rgba*>(source.data);
+
+    for (auto y = 0; y < 4; y++)
+    {
+        for (auto x = 0; x < 4; x++)
+        {
+            const auto px = std::min(block_x * 4 + x, source.width - 1);
+            const auto py = std::min(block_y * 4 + y, source.height - 1);
+
+            texels[y * 4 + x] = pixels[py * source.width + px];
+        }
+    }
+}
+
+void compress_image(const image& source, image& out, const image_format format, const int channel)
+{
+    assert(source.n_channels == 4);
+    assert(source.format == image_format::rgba8);
+    assert(source.layout == image_layout::linear);
+    assert(format != image_format::rgba8);
+    assert(channel >= 0 && channel < 4);
+
+    const auto blocks_x = (source.width + 3) / 4;
+    const auto blocks_y = (source.height + 3) / 4;
+
+    out = image{};
+    out.width = source.width;
+    out.height = source.height;
+    out.n_channels = 4;
+    out.layout = image_layout::tiled;
+    out.format = format;
+    out.tiles_x = blocks_x;
+
+    const auto size = image_data_size(out);
+    out.data = static_cast<unsigned char*>(malloc(size));
+    assert(out.data != nullptr);
+
+    rgba texels[16];
+    unsigned char values[16];
+
+    for (auto by = 0; by < blocks_y; by++)
+    {
+        for (auto bx = 0; bx < blocks_x; bx++)
+        {
+            gather_block(source, bx, by, texels);
+
+            const auto block_idx = by * blocks_x + bx;
+
+            switch (format)
+            {
+            case image_format::bc1: {
+                reinterpret_cast<bc1_block*>(out.data)[block_idx] = encode_bc1_block(texels);
+            }
+            break;
+
+            case image_format::bc4: {
+                for (auto i = 0; i < 16; i++) values[i] = texels[i].e[channel];
+                reinterpret_cast<bc4_block*>(out.data)[block_idx] = encode_bc4_block(values);
+            }
+            break;
+
+            case image_format::bc5: {
+                auto& block = reinterpret_cast<bc5_block*>(out.data)[block_idx];
+
+                for (auto i = 0; i < 16; i++) values[i] = texels[i].r;
+                block.x = encode_bc4_block(values);
+
+                for (auto i = 0; i < 16; i++) values[i] = texels[i].g;
+                block.y = encode_bc4_block(values);
+            }
+            break;
+
+            default:
+                assert(false);
+            }
+        }
+    }
+}
+
+/*
+ * Finds the block holding a texel and the texel's index within it. Uses the
+ * same bottom up addressing as get_pixel().
+ */
+inline int locate_block_texel(const image& img, const int x, int y, int& texel)
+{
+    y = img.height - y - 1;
+
+    assert(x >= 0 && x < img.width);
+    assert(y >= 0 && y < img.height);
+
+    texel = ((y & 3) << 2) | (x & 3);
+    return (y >> 2) * img.tiles_x + (x >> 2);
+}
+
+inline int decode_bc4_texel(const bc4_block& block, const int texel)
+{
+    uint64_t bits;
+    memcpy(&bits, &block, sizeof(bits));
+
+    //indices are the 48 bits following the two end points
+    const auto index = static_cast<int>((bits >> (16 + 3 * texel)) & 7);
+
+    return bc4_value(block.value0, block.value1, index);
+}
+
+inline rgba get_pixel_bc1(image& img, const int x, const int y)
+{
+    assert(img.format == image_format::bc1);
+
+    auto texel = 0;
+    const auto& block = reinterpret_cast<const bc1_block*>(img.data)[locate_block_texel(img, x, y, texel)];
+
+    const auto index = (block.indices >> (2 * texel)) & 3;
+    const auto col0 = unpack_565(block.color0);
+
+    if (index == 0) return col0;
+
+    const auto col1 = unpack_565(block.color1);
+
+    if (index == 1) return col1;
+
+    if (block.color0 > block.color1)
+    {
+        return index == 2 ? lerp_color(col0, col1, 2, 1) : lerp_color(col0, col1, 1, 2);
+    }
+
+    return index == 2 ? lerp_color(col0, col1, 1, 1) : rgba{ 0, 0, 0, 0 };
+}
+
+inline rgba get_pixel_bc4(image& img, const int x, const int y)
+{
+    assert(img.format == image_format::bc4);
+
+    auto texel = 0;
+    const auto& block = reinterpret_cast<const bc4_block*>(img.data)[locate_block_texel(img, x, y, texel)];
+
+    const auto value = static_cast<unsigned char>(decode_bc4_texel(block, texel));
+
+    return { value, value, value, 255 };
+}
+
+inline rgba get_pixel_bc5(image& img, const int x, const int y)
+{
+    const auto normal = get_normal_bc5(img, x, y);
+
+    return {
+        static_cast<unsigned char>((normal.x + 1.0f) * 127.5f),
+        static_cast<unsigned char>((normal.y + 1.0f) * 127.5f),
+        static_cast<unsigned char>((normal.z + 1.0f) * 127.5f),
+        255
+    };
+}
+
+inline v3 get_normal_bc5(image& img, const int x, const int y)
+{
+    assert(img.format == image_format::bc5);
+
+    auto texel = 0;
+    const auto& block = reinterpret_cast<const bc5_block*>(img.data)[locate_block_texel(img, x, y, texel)];
+
+    const auto nx = static_cast<float>(decode_bc4_texel(block.x, texel)) / 255.0f * 2.0f - 1.0f;
+    const auto ny = static_cast<float>(decode_bc4_texel(block.y, texel)) / 255.0f * 2.0f - 1.0f;
+
+    //tangent space normals always point out of the surface, so z is positive
+    const auto nz_sq = 1.0f - nx * nx - ny * ny;
+
+    return { nx, ny, nz_sq > 0 ? std::sqrt(nz_sq) : 0.0f };
+}
@@ -0,0 +1,51 @@
+#ifndef TEXTURE_COMPRESSION_H
+#define TEXTURE_COMPRESSION_H
+
+#include <cstdint>
+
+#include "image.h"
+
+/*
+ * On disk these match the BC1/BC4/BC5 block layouts used by GPUs, so blocks
+ * encoded here can be checked against any DDS viewer.
+ */
+struct bc1_block
+{
+    uint16_t color0;
+    uint16_t color1;
+    uint32_t indices;
+};
+
+struct bc4_block
+{
+    uint8_t value0;
+    uint8_t value1;
+    uint8_t indices[6];
+};
+
+struct bc5_block
+{
+    bc4_block x;
+    bc4_block y;
+};
+
+static_assert(sizeof(bc1_block) == 8, "bc1 blocks must be 8 bytes");
+static_assert(sizeof(bc4_block) == 8, "bc4 blocks must be 8 bytes");
+static_assert(sizeof(bc5_block) == 16, "bc5 blocks must be 16 bytes");
+
+/*
+ * Encodes a linear rgba8 image into a block compressed format. channel picks
+ * which source channel is stored for bc4. For bc5 the source is treated as a
+ * tangent space normal map and only x and y are kept.
+ */
+void compress_image(const image& source, image& out, image_format format, int channel = 0);
+
+uint16_t pack_565(const rgba& col);
+rgba unpack_565(uint16_t col);
+
+inline rgba get_pixel_bc1(image& img, int x, int y);
+inline rgba get_pixel_bc4(image& img, int x, int y);
+inline rgba get_pixel_bc5(image& img, int x, int y);
+inline v3 get_normal_bc5(image& img, int x, int y);
+
+#endif
@@ -0,0 +1,416 @@
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "texture_cache.h"
+#include "texture_registry.h"
+#include "platform_specific.h"
+
+/*
+ * Collapses "." and ".." segments, repeated separators and backslashes, so
+ * equivalent relative paths compare equal. Leading ".." segments are kept.
+ */
+void normalise_path(const char* path, char* out, const size_t out_size)
+{
+    assert(out_size > 0);
+
+    static const int max_segments = 128;
+    const char* segment_start[max_segments];
+    size_t segment_len[max_segments];
+    auto segment_count = 0;
+
+    const auto absolute = path[0] == '/' || path[0] == '\\';
+
+    for (auto* walk = path; *walk != 0;)
+    {
+        while (*walk == '/' || *walk == '\\') walk++;
+
+        const auto* start = walk;
+        while (*walk != 0 && *walk != '/' && *walk != '\\') walk++;
+
+        const auto len = static_cast<size_t>(walk - start);
+
+        if (len == 0 || (len == 1 && start[0] == '.')) continue;
+
+        const auto is_parent = len == 2 && start[0] == '.' && start[1] == '.';
+        const auto can_pop =
+            segment_count > 0 &&
+            !(segment_len[segment_count - 1] == 2 && strncmp(segment_start[segment_count - 1], "..", 2) == 0);
+
+        if (is_parent && can_pop)
+        {
+            segment_count--;
+            continue;
+        }
+
+        assert(segment_count < max_segments);
+        segment_start[segment_count] = start;
+        segment_len[segment_count] = len;
+        segment_count++;
+    }
+
+    size_t written = 0;
+    if (absolute && written + 1 < out_size) out[written++] = '/';
+
+    for (auto i = 0; i < segment_count; i++)
+    {
+        if (i > 0 && written + 1 < out_size) out[written++] = '/';
+
+        for (size_t c = 0; c < segment_len[i] && written + 1 < out_size; c++)
+        {
+            out[written++] = segment_start[i][c];
+        }
+    }
+
+    out[written] = 0;
+}
+
+/*
+ * 64 bit FNV-1a, see:
+ *      http://www.isthe.com/chongo/tech/comp/fnv/index.html
+ */
+static uint64_t hash_bytes(const unsigned char* bytes, const size_t size)
+{
+    uint64_t hash = 14695981039346656037ull;
+
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+
+    return hash;
+}
+
+static unsigned char* read_whole_file(const char* path, size_t& size)
+{
+    FILE* f = nullptr;
+    open_binary_file(path, f);
+    if (f == nullptr) return nullptr;
+
+    fseek(f, 0, SEEK_END);
+    const auto length = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    if (length <= 0)
+    {
+        fclose(f);
+        return nullptr;
+    }
+
+    size = static_cast<size_t>(length);
+    auto* bytes = static_cast<unsigned char*>(malloc(size));
+    assert(bytes != nullptr);
+
+    const auto num_read = fread(bytes, 1, size, f);
+    fclose(f);
+
+    if (num_read != size)
+    {
+        free(bytes);
+        return nullptr;
+    }
+
+    return bytes;
+}
+
+static char* copy_string(const char* str)
+{
+    const auto len = strlen(str);
+
+    auto* copy = new char[len + 1];
+    memcpy(copy, str, len + 1);
+
+    return copy;
+}
+
+static bool same_options(const texture_entry& entry, const image_layout layout, const image_format format, const int channel)
+{
+    //compressed images are always tiled, so the layout doesn't distinguish them
+    return entry.format == format &&
+           (format != image_format::rgba8 || entry.layout == layout) &&
+           (format != image_format::bc4 || entry.channel == channel);
+}
+
+static texture_entry* find_by_path(const texture_registry& registry, const char* normalised, const image_layout layout, const image_format format, const int channel)
+{
+    for (auto* entry : registry.entries)
+    {
+        if (!same_options(*entry, layout, format, channel)) continue;
+
+        for (auto* entry_path : entry->paths)
+        {
+            if (strcmp(entry_path, normalised) == 0) return entry;
+        }
+    }
+
+    return nullptr;
+}
+
+static texture_entry* find_by_content(
+    const texture_registry& registry, const uint64_t content_hash, const size_t size,
+    const image_layout layout, const image_format format, const int channel
+)
+{
+    for (auto* entry : registry.entries)
+    {
+        if (
+            entry->content_hash == content_hash && entry->content_size == size &&
+            same_options(*entry, layout, format, channel)
+        )
+        {
+            return entry;
+        }
+    }
+
+    return nullptr;
+}
+
+/*
+ * Hands out a reference to an entry already holding this texture, matching
+ * by path and then by content. Call with the lock held.
+ */
+static bool share_loaded_texture(
+    texture_registry& registry, const char* normalised, const uint64_t content_hash, const size_t size,
+    const image_layout layout, const image_format format, const int channel, image& out
+)
+{
+    auto* entry = find_by_path(registry, normalised, layout, format, channel);
+
+    if (entry != nullptr)
+    {
+        registry.path_hits++;
+    }
+    else
+    {
+        entry = find_by_content(registry, content_hash, size, layout, format, channel);
+        if (entry == nullptr) return false;
+
+        //remember this path too, so the next request hits by path
+        entry->paths.push_back(copy_string(normalised));
+        registry.content_hits++;
+    }
+
+    entry->ref_count++;
+
+    out = entry->texture;
+    return true;
+}
+
+static bool share_by_path(
+    texture_registry& registry, const char* normalised,
+    const image_layout layout, const image_format format, const int channel, image& out
+)
+{
+#if HAS_THREADS
+    std::lock_guard<std::mutex> lock(registry.lock);
+#endif
+
+    auto* entry = find_by_path(registry, normalised, layout, format, channel);
+    if (entry == nullptr) return false;
+
+    entry->ref_count++;
+    registry.path_hits++;
+
+    out = entry->texture;
+    return true;
+}
+
+/*
+ * Adds a texture we decoded or mapped from the disk cache, unless another
+ * thread added the same one while we were working, in which case ours is
+ * dropped and theirs shared.
+ */
+static void add_texture(
+    texture_registry& registry, const char* normalised, image& texture, const texture_source& source,
+    const image_layout layout, const image_format format, const int channel, const bool from_cache, image& out
+)
+{
+#if HAS_THREADS
+    std::lock_guard<std::mutex> lock(registry.lock);
+#endif
+
+    if (share_loaded_texture(registry, normalised, source.content_hash, source.size, layout, format, channel, out))
+    {
+        free_image(texture);
+        return;
+    }
+
+    auto* entry = new texture_entry;
+    assert(entry != nullptr);
+
+    entry->texture = texture;
+    entry->ref_count = 1;
+    entry->layout = layout;
+    entry->format = format;
+    entry->channel = channel;
+    entry->content_hash = source.content_hash;
+    entry->content_size = source.size;
+    entry->paths.push_back(copy_string(normalised));
+
+    registry.entries.push_back(entry);
+
+    if (from_cache) registry.cache_hits++;
+    else registry.decoded++;
+
+    out = entry->texture;
+}
+
+/*
+ * Maps the texture's conversion from the disk cache if it was made from
+ * this source. Loose files are matched by size and modification time, files
+ * already in memory by size and content.
+ */
+static bool acquire_from_cache(
+    texture_registry& registry, const char* normalised, const texture_source& source, const bool match_content,
+    const image_layout layout, const image_format format, const int channel, image& out
+)
+{
+    if (!registry.disk_cache) return false;
+
+    image cached{};
+    texture_source cached_source{};
+    if (!load_cached_texture(normalised, cached, cached_source, layout, format, channel)) return false;
+
+    const auto current =
+        cached_source.size == source.size &&
+        (match_content ? cached_source.content_hash == source.content_hash : cached_source.mtime == source.mtime);
+
+    if (!current)
+    {
+        free_image(cached);
+        return false;
+    }
+
+    add_texture(registry, normalised, cached, cached_source, layout, format, channel, true, out);
+    return true;
+}
+
+/*
+ * Shares a texture matching the file's contents, or decodes it into a new
+ * entry and writes it to the disk cache.
+ */
+static bool acquire_by_content(
+    texture_registry& registry, const char* normalised, const unsigned char* bytes, const texture_source& source,
+    const image_layout layout, const image_format format, const int channel, image& out
+)
+{
+    {
+#if HAS_THREADS
+        std::lock_guard<std::mutex> lock(registry.lock);
+#endif
+        //another thread may have loaded it since we looked
+        if (share_loaded_texture(registry, normalised, source.content_hash, source.size, layout, format, channel, out))
+        {
+            return true;
+        }
+    }
+
+    image decoded{};
+    if (!decode_image(bytes, static_cast<size_t>(source.size), decoded, layout, format, channel)) return false;
+
+    if (registry.disk_cache) save_cached_texture(normalised, decoded, channel, source);
+
+    add_texture(registry, normalised, decoded, source, layout, format, channel, false, out);
+    return true;
+}
+
+bool acquire_texture(
+    texture_registry& registry, const char* path, image& out,
+    const image_layout layout, const image_format format, const int channel
+)
+{
+    char normalised[1024];
+    normalise_path(path, normalised, sizeof(normalised));
+
+    if (share_by_path(registry, normalised, layout, format, channel, out)) return true;
+
+    texture_source source{};
+
+    if (stat_texture_source(normalised, source) && acquire_from_cache(registry, normalised, source, false, layout, format, channel, out))
+    {
+        return true;
+    }
+
+    size_t size = 0;
+    auto* bytes = read_whole_file(normalised, size);
+    if (bytes == nullptr) return false;
+
+    source.size = size;
+    source.content_hash = hash_bytes(bytes, size);
+
+    const auto acquired = acquire_by_content(registry, normalised, bytes, source, layout, format, channel, out);
+    free(bytes);
+
+    return acquired;
+}
+
+bool acquire_texture_bytes(
+    texture_registry& registry, const char* path, const unsigned char* bytes, const size_t size, image& out,
+    const image_layout layout, const image_format format, const int channel
+)
+{
+    char normalised[1024];
+    normalise_path(path, normalised, sizeof(normalised));
+
+    if (share_by_path(registry, normalised, layout, format, channel, out)) return true;
+
+    texture_source source{};
+    source.size = size;
+    source.content_hash = hash_bytes(bytes, size);
+
+    if (acquire_from_cache(registry, normalised, source, true, layout, format, channel, out)) return true;
+
+    return acquire_by_content(registry, normalised, bytes, source, layout, format, channel, out);
+}
+
+void release_texture(texture_registry& registry, image& img)
+{
+    if (img.data == nullptr) return;
+
+#if HAS_THREADS
+    std::lock_guard<std::mutex> lock(registry.lock);
+#endif
+
+    for (size_t i = 0; i < registry.entries.size(); i++)
+    {
+        auto* entry = registry.entries[i];
+        if (entry->texture.data != img.data) continue;
+
+        assert(entry->ref_count > 0);
+        entry->ref_count--;
+
+        if (entry->ref_count == 0)
+        {
+            free_image(entry->texture);
+            for (auto* entry_path : entry->paths) delete[] entry_path;
+            delete entry;
+
+            registry.entries[i] = registry.entries.back();
+            registry.entries.pop_back();
+        }
+
+        img = image{};
+        return;
+    }
+
+    //not one of ours
+    assert(false);
+}
+
+size_t registry_texture_bytes(const texture_registry& registry)
+{
+#if HAS_THREADS
+    std::lock_guard<std::mutex> lock(registry.lock);
+#endif
+
+    size_t bytes = 0;
+
+    for (const auto* entry : registry.entries)
+    {
+        bytes += image_data_size(entry->texture);
+    }
+
+    return bytes;
+}
@@ -0,0 +1,92 @@
+#ifndef TEXTURE_REGISTRY_H
+#define TEXTURE_REGISTRY_H
+
+#include <cstdint>
+#include <vector>
+
+#include "image.h"
+#include "platform_specific.h"
+
+#if HAS_THREADS
+#include <mutex>
+#endif
+
+/*
+ * Shares decoded textures between every mesh and model that uses them.
+ *
+ * Textures are looked up by normalised path first, so "./obj/car/../car/a.png"
+ * and "obj/car/a.png" are the same texture. On a path miss the file is read
+ * and hashed, so identical files under different names are still decoded
+ * once. Each texture is also keyed by how it was converted (layout, format,
+ * channel), since the same file loaded as a diffuse and as a spec map ends
+ * up as different pixels.
+ *
+ * Decoded textures are also written to a cache on disk, see texture_cache.h.
+ * A later run that misses by path maps the finished texels from there while
+ * the source file is unchanged, instead of reading and decoding it.
+ *
+ * Meshes keep their image by value; it is a handle sharing the registry's
+ * pixels. release_texture() drops a reference and frees the pixels when the
+ * last user lets go.
+ *
+ * Every function is safe to call from several threads at once. Files are read
+ * and decoded outside the lock, so two threads acquiring identical files for
+ * the first time can both decode them; the second one then throws its copy
+ * away and shares the first.
+ */
+struct texture_entry
+{
+    image texture;
+    int ref_count{};
+
+    image_layout layout{};
+    image_format format{};
+    int channel{};
+
+    uint64_t content_hash{};
+    size_t content_size{};
+
+    //every normalised path this texture has been requested under
+    std::vector<char*> paths;
+};
+
+struct texture_registry
+{
+    std::vector<texture_entry*> entries;
+
+    //keep decoded textures on disk between runs, see texture_cache.h
+    bool disk_cache = true;
+
+    size_t decoded{};
+    size_t cache_hits{};
+    size_t path_hits{};
+    size_t content_hits{};
+
+#if HAS_THREADS
+    mutable std::mutex lock;
+#endif
+};
+
+bool acquire_texture(
+    texture_registry& registry, const char* path, image& out,
+    image_layout layout = image_layout::linear,
+    image_format format = image_format::rgba8, int channel = 0
+);
+
+/*
+ * Like acquire_texture(), for a file already in memory, such as one in an
+ * asset archive. path is only used as the texture's name.
+ */
+bool acquire_texture_bytes(
+    texture_registry& registry, const char* path, const unsigned char* bytes, size_t size, image& out,
+    image_layout layout = image_layout::linear,
+    image_format format = image_format::rgba8, int channel = 0
+);
+
+void release_texture(texture_registry& registry, image& img);
+
+size_t registry_texture_bytes(const texture_registry& registry);
+
+void normalise_path(const char* path, char* out, size_t out_size);
+
+#endif
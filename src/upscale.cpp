@@ -0,0 +1,318 @@
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+
+#include "upscale.h"
+#include "pixel4.h"
+#include "jobs.h"
+
+/*
+ * Weights red and blue equally, so the result doesn't depend on which of
+ * rgba or bgra the buffer is in.
+ */
+static inline float luma(const rgba& p)
+{
+    return (p.e[0] * 0.25f + p.e[1] * 0.5f + p.e[2] * 0.25f) * (1.0f / 255);
+}
+
+/*
+ * Central differences of luminance and depth. Whichever marks the stronger
+ * edge gives the direction, depth catches silhouettes against backgrounds
+ * of a similar colour.
+ */
+static void analyse_edges(upscaler& upscaler, const output_buffers& source, const int first_row, const int last_row)
+{
+    const auto& frame_buffer = source.frame_buffer;
+    const auto width = frame_buffer.width;
+    const auto height = frame_buffer.height;
+
+    const auto* pixels = reinterpret_cast<const rgba*>(frame_buffer.data);
+    const auto* depth = source.z_buffer;
+
+    for (auto y = first_row; y < last_row; y++)
+    {
+        const auto up = std::max(y - 1, 0) * width;
+        const auto row = y * width;
+        const auto down = std::min(y + 1, height - 1) * width;
+
+        for (auto x = 0; x < width; x++)
+        {
+            const auto left = std::max(x - 1, 0);
+            const auto right = std::min(x + 1, width - 1);
+
+            const auto luma_x = luma(pixels[row + right]) - luma(pixels[row + left]);
+            const auto luma_y = luma(pixels[down + x]) - luma(pixels[up + x]);
+            const auto luma_length = std::sqrt(luma_x * luma_x + luma_y * luma_y);
+
+            const auto depth_x = depth[row + right] - depth[row + left];
+            const auto depth_y = depth[down + x] - depth[up + x];
+            const auto depth_length = std::sqrt(depth_x * depth_x + depth_y * depth_y);
+
+            const auto luma_strength = std::min(1.0f, luma_length * 2);
+            const auto depth_strength = std::min(1.0f, depth_length / upscaler.depth_edge_range);
+
+            auto& edge = upscaler.edges[row + x];
+
+            if (depth_strength > luma_strength)
+            {
+                edge = { depth_x / depth_length, depth_y / depth_length, depth_strength };
+            }
+            else if (luma_length > 0)
+            {
+                edge = { luma_x / luma_length, luma_y / luma_length, luma_strength };
+            }
+            else
+            {
+                edge = { 1, 0, 0 };
+            }
+        }
+    }
+}
+
+/*
+ * Resamples one output pixel from the 12 source pixels around it, with a
+ * windowed lanczos-like kernel. The kernel is rotated to the edge direction,
+ * squeezed across the edge and stretched along it by the edge strength, and
+ * the result is clamped to the nearest 4 pixels so it can't ring.
+ */
+static rgba resample_pixel(const upscaler& upscaler, const rgba* pixels, const int width, const int height, const float src_x, const float src_y)
+{
+    const auto x0 = static_cast<int>(std::floor(src_x));
+    const auto y0 = static_cast<int>(std::floor(src_y));
+    const auto frac_x = src_x - static_cast<float>(x0);
+    const auto frac_y = src_y - static_cast<float>(y0);
+
+    int columns[4], rows[4];
+    for (auto i = 0; i < 4; i++)
+    {
+        columns[i] = std::max(0, std::min(x0 - 1 + i, width - 1));
+        rows[i] = std::max(0, std::min(y0 - 1 + i, height - 1)) * width;
+    }
+
+    //the clamp to the nearest 4 leaves nothing to filter where they match, which is most of a frame's background
+    const auto& nearest = pixels[rows[1] + columns[1]];
+    if (
+        same_pixel(nearest, pixels[rows[1] + columns[2]]) &&
+        same_pixel(nearest, pixels[rows[2] + columns[1]]) &&
+        same_pixel(nearest, pixels[rows[2] + columns[2]])
+    )
+    {
+        return nearest;
+    }
+
+    //blend the analysis of the 4 nearest pixels, weighting directions by how strong their edges are
+    const float bilinear[4] = {
+        (1 - frac_x) * (1 - frac_y), frac_x * (1 - frac_y),
+        (1 - frac_x) * frac_y, frac_x * frac_y
+    };
+
+    auto dir_x = 0.0f, dir_y = 0.0f, strength = 0.0f;
+    for (auto i = 0; i < 4; i++)
+    {
+        const auto& edge = upscaler.edges[rows[1 + i / 2] + columns[1 + i % 2]];
+        const auto weight = bilinear[i] * edge.strength;
+
+        dir_x += edge.dir_x * weight;
+        dir_y += edge.dir_y * weight;
+        strength += weight;
+    }
+
+    const auto dir_length = std::sqrt(dir_x * dir_x + dir_y * dir_y);
+    if (dir_length < 1e-5f)
+    {
+        dir_x = 1;
+        dir_y = 0;
+    }
+    else
+    {
+        dir_x /= dir_length;
+        dir_y /= dir_length;
+    }
+
+    //diagonal edges need a longer reach to cover the same footprint
+    const auto stretch = 1.0f / std::max(std::abs(dir_x), std::abs(dir_y));
+    const auto scale_across = 1.0f + (stretch - 1.0f) * strength;
+    const auto scale_along = 1.0f - 0.5f * strength;
+
+    //the window's negative lobe shrinks on strong edges
+    const auto lobe = 0.5f - 0.29f * strength;
+    const auto clip = 1.0f / lobe;
+
+    auto sum = splat(0);
+    auto weight_sum = 0.0f;
+    auto low = splat(255);
+    auto high = splat(0);
+
+    for (auto ty = 0; ty < 4; ty++)
+    {
+        for (auto tx = 0; tx < 4; tx++)
+        {
+            const auto corner = (tx == 0 || tx == 3) && (ty == 0 || ty == 3);
+            if (corner) continue;
+
+            const auto offset_x = static_cast<float>(tx - 1) - frac_x;
+            const auto offset_y = static_cast<float>(ty - 1) - frac_y;
+
+            const auto across = (offset_x * dir_x + offset_y * dir_y) * scale_across;
+            const auto along = (offset_y * dir_x - offset_x * dir_y) * scale_along;
+            const auto distance2 = std::min(across * across + along * along, clip);
+
+            auto base = 0.4f * distance2 - 1.0f;
+            base = 25.0f / 16.0f * base * base - (25.0f / 16.0f - 1.0f);
+
+            auto window = lobe * distance2 - 1.0f;
+            window *= window;
+
+            const auto weight = base * window;
+            const auto texel = load_pixel(pixels[rows[ty] + columns[tx]]);
+
+            sum = sum + texel * splat(weight);
+            weight_sum += weight;
+
+            if (tx >= 1 && tx <= 2 && ty >= 1 && ty <= 2)
+            {
+                low = min4(low, texel);
+                high = max4(high, texel);
+            }
+        }
+    }
+
+    const auto result = sum * splat(1.0f / weight_sum);
+    return store_pixel(min4(max4(result, low), high));
+}
+
+static void resample_rows(
+    const upscaler& upscaler, const output_buffers& source,
+    rgba* target, const int width, const int height, const int stride,
+    const int first_row, const int last_row
+)
+{
+    const auto& frame_buffer = source.frame_buffer;
+    const auto* pixels = reinterpret_cast<const rgba*>(frame_buffer.data);
+
+    const auto scale_x = static_cast<float>(frame_buffer.width) / static_cast<float>(width);
+    const auto scale_y = static_cast<float>(frame_buffer.height) / static_cast<float>(height);
+
+    for (auto y = first_row; y < last_row; y++)
+    {
+        //pixel centres line up between the two sizes
+        const auto src_y = (static_cast<float>(y) + 0.5f) * scale_y - 0.5f;
+        auto* out = target + y * stride;
+
+        for (auto x = 0; x < width; x++)
+        {
+            const auto src_x = (static_cast<float>(x) + 0.5f) * scale_x - 0.5f;
+            out[x] = resample_pixel(upscaler, pixels, frame_buffer.width, frame_buffer.height, src_x, src_y);
+        }
+    }
+}
+
+/*
+ * Contrast adaptive sharpening over the 4 neighbours of each pixel. The
+ * negative lobe is as strong as it can be without pushing any channel past
+ * the neighbourhood's min or max, scaled by the sharpness setting.
+ */
+static void sharpen_rows(
+    const upscaler& upscaler, const rgba* source,
+    rgba* target, const int width, const int height, const int stride,
+    const int first_row, const int last_row
+)
+{
+    //above this the filter stops being a sharpen and starts ringing
+    const auto max_lobe = 0.25f - 1.0f / 16.0f;
+
+    const auto peak = splat(255);
+    const auto four = splat(4);
+    const auto epsilon = splat(1.0f / 1024);
+
+    for (auto y = first_row; y < last_row; y++)
+    {
+        const auto* up = source + std::max(y - 1, 0) * width;
+        const auto* row = source + y * width;
+        const auto* down = source + std::min(y + 1, height - 1) * width;
+
+        auto* out = target + y * stride;
+
+        for (auto x = 0; x < width; x++)
+        {
+            const auto& centre_pixel = row[x];
+            const auto& west_pixel = row[std::max(x - 1, 0)];
+            const auto& east_pixel = row[std::min(x + 1, width - 1)];
+
+            //flat neighbourhoods have nothing to sharpen
+            if (
+                same_pixel(centre_pixel, up[x]) && same_pixel(centre_pixel, down[x]) &&
+                same_pixel(centre_pixel, west_pixel) && same_pixel(centre_pixel, east_pixel)
+            )
+            {
+                out[x] = centre_pixel;
+                continue;
+            }
+
+            const auto centre = load_pixel(centre_pixel);
+            const auto north = load_pixel(up[x]);
+            const auto south = load_pixel(down[x]);
+            const auto west = load_pixel(west_pixel);
+            const auto east = load_pixel(east_pixel);
+
+            const auto low = min4(min4(min4(north, south), min4(west, east)), centre);
+            const auto high = max4(max4(max4(north, south), max4(west, east)), centre);
+
+            //how far the lobe can go before the darkest or brightest channel clips
+            const auto hit_low = low / (four * high + epsilon);
+            const auto hit_high = (peak - high) / (four * low - four * peak - epsilon);
+
+            float lobes[4];
+            unpack_pixel(max4(splat(0) - hit_low, hit_high), lobes);
+
+            //alpha is last in both rgba and bgra, and doesn't get a say
+            auto lobe = std::max(lobes[0], std::max(lobes[1], lobes[2]));
+            lobe = std::max(-max_lobe, std::min(lobe, 0.0f)) * upscaler.sharpness;
+
+            const auto sharpened = (splat(lobe) * (north + south + west + east) + centre) * splat(1.0f / (4 * lobe + 1));
+            out[x] = store_pixel(sharpened);
+        }
+    }
+}
+
+void upscale_frame(upscaler& upscaler, output_buffers& source, rgba* target, const int width, const int height, const int stride)
+{
+    const auto& frame_buffer = source.frame_buffer;
+
+    assert(target != nullptr);
+    assert(stride >= width);
+
+    //every source pixel can end up in the output, so clear whatever nothing drew to
+    resolve_output_buffers(source);
+
+    upscaler.edges.resize(static_cast<size_t>(frame_buffer.width) * frame_buffer.height);
+
+    for_each_row_band(frame_buffer.height, [&](const int first_row, const int last_row)
+    {
+        analyse_edges(upscaler, source, first_row, last_row);
+    });
+
+    if (upscaler.sharpness <= 0)
+    {
+        for_each_row_band(height, [&](const int first_row, const int last_row)
+        {
+            resample_rows(upscaler, source, target, width, height, stride, first_row, last_row);
+        });
+
+        return;
+    }
+
+    upscaler.scaled.resize(static_cast<size_t>(width) * height);
+    auto* scaled = upscaler.scaled.data();
+
+    for_each_row_band(height, [&](const int first_row, const int last_row)
+    {
+        resample_rows(upscaler, source, scaled, width, height, width, first_row, last_row);
+    });
+
+    for_each_row_band(height, [&](const int first_row, const int last_row)
+    {
+        sharpen_rows(upscaler, scaled, target, width, height, stride, first_row, last_row);
+    });
+}
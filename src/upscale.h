@@ -0,0 +1,45 @@
+#ifndef UPSCALE_H
+#define UPSCALE_H
+
+#include <vector>
+
+#include "render.h"
+
+/*
+ * Per source pixel edge analysis. The direction is the normalised gradient,
+ * so it points across the edge.
+ */
+struct upscale_edge
+{
+    float dir_x, dir_y;
+    float strength;
+};
+
+/*
+ * Edge aware upscaling of a finished frame, in the spirit of FSR1. A first
+ * pass works out an edge direction and strength for every source pixel from
+ * its luminance and depth, then resamples with a kernel stretched along
+ * edges and squeezed across them. A second pass sharpens the result with a
+ * contrast adaptive filter. Both passes run over bands of rows in parallel.
+ */
+struct upscaler
+{
+    //0 turns sharpening off, 1 is the strongest the limiter allows
+    float sharpness = 0.85f;
+
+    //depth differences larger than this count as a full strength edge
+    float depth_edge_range = 0.05f;
+
+    //scratch buffers, sized on demand
+    std::vector<upscale_edge> edges;
+    std::vector<rgba> scaled;
+};
+
+/*
+ * Upscales the frame in source (resolving any tiles still pending a clear)
+ * into target, whose rows are stride pixels apart. Pixels keep the byte
+ * order of the source buffers.
+ */
+void upscale_frame(upscaler& upscaler, output_buffers& source, rgba* target, int width, int height, int stride);
+
+#endif
@@ -0,0 +1,341 @@
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#include "video.h"
+
+/*
+ * BT.601 limited range, in 8.8 fixed point. The u and v sums stay inside a
+ * signed 16 bit lane for any input, and y inside an unsigned one.
+ */
+static inline unsigned char rgb_to_y(const int r, const int g, const int b)
+{
+    return static_cast<unsigned char>(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+}
+
+static inline unsigned char rgb_to_u(const int r, const int g, const int b)
+{
+    return static_cast<unsigned char>(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+}
+
+static inline unsigned char rgb_to_v(const int r, const int g, const int b)
+{
+    return static_cast<unsigned char>(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+}
+
+/*
+ * One chroma sample from the average of a 2x2 block, columns x0 and x1 of
+ * rows top and bottom.
+ */
+static void chroma_block(
+    const unsigned char* top, const unsigned char* bottom, const int x0, const int x1,
+    const int r_index, const int b_index, unsigned char& u, unsigned char& v
+)
+{
+    const auto r = (top[x0 * 4 + r_index] + top[x1 * 4 + r_index] + bottom[x0 * 4 + r_index] + bottom[x1 * 4 + r_index] + 2) >> 2;
+    const auto g = (top[x0 * 4 + 1] + top[x1 * 4 + 1] + bottom[x0 * 4 + 1] + bottom[x1 * 4 + 1] + 2) >> 2;
+    const auto b = (top[x0 * 4 + b_index] + top[x1 * 4 + b_index] + bottom[x0 * 4 + b_index] + bottom[x1 * 4 + b_index] + 2) >> 2;
+
+    u = rgb_to_u(r, g, b);
+    v = rgb_to_v(r, g, b);
+}
+
+#if HAS_SSE2
+/*
+ * One channel of 8 pixels as 16 bit lanes.
+ */
+static inline __m128i channel8(const __m128i first, const __m128i second, const __m128i shift)
+{
+    const auto byte_mask = _mm_set1_epi32(0xFF);
+
+    return _mm_packs_epi32(
+        _mm_and_si128(_mm_srl_epi32(first, shift), byte_mask),
+        _mm_and_si128(_mm_srl_epi32(second, shift), byte_mask)
+    );
+}
+
+static inline __m128i luma8(const __m128i r, const __m128i g, const __m128i b)
+{
+    //the sum can pass 32767, the logical shift treats it as unsigned
+    const auto sum = _mm_add_epi16(
+        _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(66)), _mm_mullo_epi16(g, _mm_set1_epi16(129))),
+        _mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(25)), _mm_set1_epi16(128))
+    );
+
+    return _mm_add_epi16(_mm_srli_epi16(sum, 8), _mm_set1_epi16(16));
+}
+
+/*
+ * Averages the 2x2 blocks of two rows of 8 pixels of one channel, giving 4
+ * values in the low lanes.
+ */
+static inline __m128i average_blocks(const __m128i top, const __m128i bottom)
+{
+    const auto pairs = _mm_madd_epi16(_mm_add_epi16(top, bottom), _mm_set1_epi16(1));
+    const auto average = _mm_srli_epi32(_mm_add_epi32(pairs, _mm_set1_epi32(2)), 2);
+
+    return _mm_packs_epi32(average, average);
+}
+
+static inline __m128i chroma4(const __m128i r, const __m128i g, const __m128i b, const short cr, const short cg, const short cb)
+{
+    const auto sum = _mm_add_epi16(
+        _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(cr)), _mm_mullo_epi16(g, _mm_set1_epi16(cg))),
+        _mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(cb)), _mm_set1_epi16(128))
+    );
+
+    return _mm_add_epi16(_mm_srai_epi16(sum, 8), _mm_set1_epi16(128));
+}
+#endif
+
+/*
+ * Converts rgba or bgra pixels to the three planes of a 4:2:0 frame. Chroma
+ * is the average of each 2x2 block, odd sizes repeat the last row or column.
+ */
+static void rgba_to_yuv420(
+    const unsigned char* pixels, const int width, const int height, const pixel_order order,
+    unsigned char* y_plane, unsigned char* u_plane, unsigned char* v_plane
+)
+{
+    const auto r_index = order == pixel_order::rgba ? 0 : 2;
+    const auto b_index = 2 - r_index;
+    const auto chroma_width = (width + 1) / 2;
+
+#if HAS_SSE2
+    const auto r_shift = _mm_cvtsi32_si128(r_index * 8);
+    const auto g_shift = _mm_cvtsi32_si128(8);
+    const auto b_shift = _mm_cvtsi32_si128(b_index * 8);
+#endif
+
+    for (auto y = 0; y < height; y += 2)
+    {
+        const auto has_bottom = y + 1 < height;
+
+        const auto* top = pixels + static_cast<size_t>(y) * width * 4;
+        const auto* bottom = has_bottom ? top + static_cast<size_t>(width) * 4 : top;
+
+        auto* y_top = y_plane + static_cast<size_t>(y) * width;
+        auto* y_bottom = y_top + width;
+        auto* u_row = u_plane + static_cast<size_t>(y / 2) * chroma_width;
+        auto* v_row = v_plane + static_cast<size_t>(y / 2) * chroma_width;
+
+        auto x = 0;
+
+#if HAS_SSE2
+        for (; x + 8 <= width; x += 8)
+        {
+            const auto* top_pixels = reinterpret_cast<const __m128i*>(top + x * 4);
+            const auto* bottom_pixels = reinterpret_cast<const __m128i*>(bottom + x * 4);
+
+            const auto top_first = _mm_loadu_si128(top_pixels);
+            const auto top_second = _mm_loadu_si128(top_pixels + 1);
+            const auto bottom_first = _mm_loadu_si128(bottom_pixels);
+            const auto bottom_second = _mm_loadu_si128(bottom_pixels + 1);
+
+            const auto r_top = channel8(top_first, top_second, r_shift);
+            const auto g_top = channel8(top_first, top_second, g_shift);
+            const auto b_top = channel8(top_first, top_second, b_shift);
+
+            const auto r_bottom = channel8(bottom_first, bottom_second, r_shift);
+            const auto g_bottom = channel8(bottom_first, bottom_second, g_shift);
+            const auto b_bottom = channel8(bottom_first, bottom_second, b_shift);
+
+            const auto luma_top = luma8(r_top, g_top, b_top);
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(y_top + x), _mm_packus_epi16(luma_top, luma_top));
+
+            if (has_bottom)
+            {
+                const auto luma_bottom = luma8(r_bottom, g_bottom, b_bottom);
+                _mm_storel_epi64(reinterpret_cast<__m128i*>(y_bottom + x), _mm_packus_epi16(luma_bottom, luma_bottom));
+            }
+
+            const auto r = average_blocks(r_top, r_bottom);
+            const auto g = average_blocks(g_top, g_bottom);
+            const auto b = average_blocks(b_top, b_bottom);
+
+            const auto u = chroma4(r, g, b, -38, -74, 112);
+            const auto v = chroma4(r, g, b, 112, -94, -18);
+
+            const auto u_bytes = _mm_cvtsi128_si32(_mm_packus_epi16(u, u));
+            const auto v_bytes = _mm_cvtsi128_si32(_mm_packus_epi16(v, v));
+            memcpy(u_row + x / 2, &u_bytes, 4);
+            memcpy(v_row + x / 2, &v_bytes, 4);
+        }
+#endif
+
+        for (; x < width; x += 2)
+        {
+            const auto x1 = std::min(x + 1, width - 1);
+
+            for (auto column = x; column <= x1; column++)
+            {
+                const auto* p = top + column * 4;
+                y_top[column] = rgb_to_y(p[r_index], p[1], p[b_index]);
+
+                if (has_bottom)
+                {
+                    const auto* q = bottom + column * 4;
+                    y_bottom[column] = rgb_to_y(q[r_index], q[1], q[b_index]);
+                }
+            }
+
+            chroma_block(top, bottom, x, x1, r_index, b_index, u_row[x / 2], v_row[x / 2]);
+        }
+    }
+}
+
+/*
+ * Converts and writes the oldest queued frame.
+ */
+static void write_video_frame(video_sink& sink, const int slot)
+{
+    const auto luma_size = static_cast<size_t>(sink.width) * sink.height;
+    const auto chroma_size = static_cast<size_t>((sink.width + 1) / 2) * ((sink.height + 1) / 2);
+
+    auto* y_plane = sink.yuv.data();
+    auto* u_plane = y_plane + luma_size;
+    auto* v_plane = u_plane + chroma_size;
+
+    rgba_to_yuv420(sink.frames[slot].data(), sink.width, sink.height, sink.frame_order[slot], y_plane, u_plane, v_plane);
+
+    fputs("FRAME\n", sink.file);
+    fwrite(sink.yuv.data(), 1, sink.yuv.size(), sink.file);
+
+    sink.frames_written++;
+}
+
+#if HAS_THREADS
+static void run_video_converter(video_sink& sink)
+{
+    for (;;)
+    {
+        int slot;
+
+        {
+            std::unique_lock<std::mutex> lock(sink.lock);
+            sink.frame_queued.wait(lock, [&] { return sink.queue_count > 0 || sink.closing; });
+
+            //closing still drains whatever is queued
+            if (sink.queue_count == 0) return;
+
+            slot = sink.queue_head;
+        }
+
+        //the submitting thread never writes to a queued slot, so this runs unlocked
+        write_video_frame(sink, slot);
+
+        {
+            std::lock_guard<std::mutex> lock(sink.lock);
+            sink.queue_head = (sink.queue_head + 1) % video_queue_frames;
+            sink.queue_count--;
+        }
+
+        sink.slot_freed.notify_one();
+    }
+}
+#endif
+
+bool open_video_sink(video_sink& sink, const char* path, const int width, const int height, const int frames_per_second, const bool drop_when_full)
+{
+    assert(sink.file == nullptr);
+
+    FILE* f = nullptr;
+
+    if (strcmp(path, "-") == 0)
+    {
+        f = claim_stdout();
+    }
+    else
+    {
+        create_binary_file(path, f);
+    }
+
+    if (f == nullptr)
+    {
+        return false;
+    }
+
+    sink.file = f;
+    sink.width = width;
+    sink.height = height;
+    sink.drop_when_full = drop_when_full;
+
+    for (auto& frame : sink.frames)
+    {
+        frame.resize(static_cast<size_t>(width) * height * 4);
+    }
+
+    const auto chroma_size = static_cast<size_t>((width + 1) / 2) * ((height + 1) / 2);
+    sink.yuv.resize(static_cast<size_t>(width) * height + chroma_size * 2);
+
+    //chroma sits in the middle of each 2x2 block, as our averages do
+    fprintf(f, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n", width, height, frames_per_second);
+
+#if HAS_THREADS
+    sink.converter = std::thread(run_video_converter, std::ref(sink));
+#endif
+
+    return true;
+}
+
+void submit_video_frame(video_sink& sink, output_buffers& buffers)
+{
+    if (sink.file == nullptr) return;
+
+    const auto& frame_buffer = buffers.frame_buffer;
+    assert(frame_buffer.width == sink.width && frame_buffer.height == sink.height);
+
+    resolve_output_buffers(buffers);
+
+#if HAS_THREADS
+    int slot;
+
+    {
+        std::unique_lock<std::mutex> lock(sink.lock);
+
+        if (sink.queue_count == video_queue_frames && sink.drop_when_full)
+        {
+            sink.frames_dropped++;
+            return;
+        }
+
+        sink.slot_freed.wait(lock, [&] { return sink.queue_count < video_queue_frames; });
+        slot = (sink.queue_head + sink.queue_count) % video_queue_frames;
+    }
+
+    memcpy(sink.frames[slot].data(), frame_buffer.data, sink.frames[slot].size());
+    sink.frame_order[slot] = buffers.order;
+
+    {
+        std::lock_guard<std::mutex> lock(sink.lock);
+        sink.queue_count++;
+    }
+
+    sink.frame_queued.notify_one();
+#else
+    memcpy(sink.frames[0].data(), frame_buffer.data, sink.frames[0].size());
+    sink.frame_order[0] = buffers.order;
+
+    write_video_frame(sink, 0);
+#endif
+}
+
+void close_video_sink(video_sink& sink)
+{
+    if (sink.file == nullptr) return;
+
+#if HAS_THREADS
+    {
+        std::lock_guard<std::mutex> lock(sink.lock);
+        sink.closing = true;
+    }
+
+    sink.frame_queued.notify_one();
+    sink.converter.join();
+#endif
+
+    fclose(sink.file);
+    sink.file = nullptr;
+
+    fprintf(stderr, "Video: %d frames written, %d dropped\n", sink.frames_written, sink.frames_dropped);
+}
@@ -0,0 +1,76 @@
+#ifndef VIDEO_H
+#define VIDEO_H
+
+#include <cstdio>
+#include <vector>
+
+#include "platform_specific.h"
+#include "render.h"
+
+#if HAS_THREADS
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#endif
+
+/*
+ * Number of frames that can wait for conversion before the sink drops or
+ * waits, see video_sink::drop_when_full.
+ */
+static const int video_queue_frames = 4;
+
+/*
+ * Streams frames to a file or pipe as uncompressed Y4M, 4:2:0 with BT.601
+ * limited range colours, for previews that any video tool can read.
+ *
+ * Submitting a frame only copies it into a ring of preallocated buffers. A
+ * conversion thread turns each queued frame into YUV and writes it out, so
+ * the renderer never waits on the conversion or the disk. Builds without
+ * threads convert on submit.
+ */
+struct video_sink
+{
+    FILE* file{};
+    int width{}, height{};
+
+    //interactive runs drop frames when the queue is full, offline ones wait for a free slot
+    bool drop_when_full{};
+
+    //rgba copies of queued frames, slot queue_head is the oldest
+    std::vector<unsigned char> frames[video_queue_frames];
+    pixel_order frame_order[video_queue_frames]{};
+    int queue_head{};
+    int queue_count{};
+    bool closing{};
+
+    //planes of the frame being written, only touched by the conversion thread
+    std::vector<unsigned char> yuv;
+
+    int frames_written{};
+    int frames_dropped{};
+
+#if HAS_THREADS
+    std::mutex lock;
+    std::condition_variable frame_queued;
+    std::condition_variable slot_freed;
+    std::thread converter;
+#endif
+};
+
+/*
+ * Opens path for writing, "-" writes to stdout and moves everything printed
+ * afterwards to stderr. Frames must be width by height.
+ */
+bool open_video_sink(video_sink& sink, const char* path, int width, int height, int frames_per_second, bool drop_when_full);
+
+/*
+ * Queues a copy of the frame, resolving any tiles still pending a clear.
+ */
+void submit_video_frame(video_sink& sink, output_buffers& buffers);
+
+/*
+ * Writes out every queued frame, then closes the file.
+ */
+void close_video_sink(video_sink& sink);
+
+#endif
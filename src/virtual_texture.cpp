@@ -0,0 +1,496 @@
+#include <cassert>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <sys/stat.h>
+
+#include "virtual_texture.h"
+#include "platform_specific.h"
+
+struct page_file_header
+{
+    char magic[4];
+    int version;
+    int width, height;
+    int page_size;
+    int mip_count;
+    int tail_width, tail_height;
+};
+
+static const int page_file_version = 1;
+
+void init_page_cache(page_cache& cache, const int slot_count)
+{
+    assert(slot_count > 0);
+
+    cache.slot_count = slot_count;
+
+    cache.pages = static_cast<unsigned char*>(malloc(static_cast<size_t>(slot_count) * virtual_page_bytes));
+    assert(cache.pages != nullptr);
+
+    cache.slots = new page_slot[slot_count];
+    assert(cache.slots != nullptr);
+}
+
+/*
+ * Fills in the page layout of every mip above the tail. Returns the tail's
+ * size through tail_width/tail_height.
+ */
+static void layout_mips(virtual_texture& tex, int& tail_width, int& tail_height)
+{
+    auto width = tex.width;
+    auto height = tex.height;
+
+    tex.mip_count = 0;
+    tex.page_count = 0;
+
+    while ((width > virtual_page_size || height > virtual_page_size) && tex.mip_count < virtual_max_mips)
+    {
+        auto& mip = tex.mips[tex.mip_count++];
+        mip.width = width;
+        mip.height = height;
+        mip.pages_x = (width + virtual_page_size - 1) / virtual_page_size;
+        mip.pages_y = (height + virtual_page_size - 1) / virtual_page_size;
+        mip.first_page = tex.page_count;
+
+        tex.page_count += mip.pages_x * mip.pages_y;
+
+        width = std::max(1, (width + 1) / 2);
+        height = std::max(1, (height + 1) / 2);
+    }
+
+    tail_width = width;
+    tail_height = height;
+}
+
+/*
+ * Halves a linear rgba image with a 2x2 box filter, into a new malloc'd buffer.
+ */
+static rgba* downsample(const rgba* source, const int width, const int height, const int out_width, const int out_height)
+{
+    auto* out = static_cast<rgba*>(malloc(sizeof(rgba) * out_width * out_height));
+    assert(out != nullptr);
+
+    for (auto y = 0; y < out_height; y++)
+    {
+        for (auto x = 0; x < out_width; x++)
+        {
+            const auto x0 = std::min(x * 2, width - 1);
+            const auto x1 = std::min(x * 2 + 1, width - 1);
+            const auto y0 = std::min(y * 2, height - 1);
+            const auto y1 = std::min(y * 2 + 1, height - 1);
+
+            const auto& a = source[y0 * width + x0];
+            const auto& b = source[y0 * width + x1];
+            const auto& c = source[y1 * width + x0];
+            const auto& d = source[y1 * width + x1];
+
+            auto& texel = out[y * out_width + x];
+            for (auto ch = 0; ch < 4; ch++)
+            {
+                texel.e[ch] = static_cast<unsigned char>((a.e[ch] + b.e[ch] + c.e[ch] + d.e[ch] + 2) / 4);
+            }
+        }
+    }
+
+    return out;
+}
+
+/*
+ * Writes one mip as pages. Texels past the edge of the mip repeat the last
+ * row/column, so partial pages don't need special casing when sampled.
+ */
+static bool write_mip_pages(FILE* f, const rgba* pixels, const virtual_mip& mip)
+{
+    rgba page[virtual_page_texels];
+
+    for (auto py = 0; py < mip.pages_y; py++)
+    {
+        for (auto px = 0; px < mip.pages_x; px++)
+        {
+            for (auto y = 0; y < virtual_page_size; y++)
+            {
+                const auto src_y = std::min(py * virtual_page_size + y, mip.height - 1);
+
+                for (auto x = 0; x < virtual_page_size; x++)
+                {
+                    const auto src_x = std::min(px * virtual_page_size + x, mip.width - 1);
+                    page[y * virtual_page_size + x] = pixels[src_y * mip.width + src_x];
+                }
+            }
+
+            if (fwrite(page, sizeof(page), 1, f) != 1) return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Decodes the source image and writes its paged mip chain and tail to the
+ * page file. The full image is only in memory while this runs.
+ */
+static bool build_page_file(const char* source_path, const char* page_path)
+{
+    image source{};
+    if (!load_image(source_path, source))
+    {
+        return false;
+    }
+
+    virtual_texture layout{};
+    layout.width = source.width;
+    layout.height = source.height;
+
+    page_file_header header{ { 'V', 'T', 'E', 'X' }, page_file_version, source.width, source.height, virtual_page_size };
+    layout_mips(layout, header.tail_width, header.tail_height);
+    header.mip_count = layout.mip_count;
+
+    //written under a name of its own and renamed, so a crash or a full disk never leaves half a page file
+    char temp_path[1024 + 32];
+    snprintf(temp_path, sizeof(temp_path), "%s.%p.tmp", page_path, static_cast<const void*>(source.data));
+
+    FILE* f = nullptr;
+    create_binary_file(temp_path, f);
+    if (f == nullptr)
+    {
+        printf("Could not open %s for writing.\n", temp_path);
+        free_image(source);
+        return false;
+    }
+
+    auto written = fwrite(&header, sizeof(header), 1, f) == 1;
+
+    auto* level = reinterpret_cast<rgba*>(source.data);
+    source.data = nullptr;
+
+    for (auto i = 0; i < layout.mip_count; i++)
+    {
+        const auto& mip = layout.mips[i];
+        written = written && write_mip_pages(f, level, mip);
+
+        const auto next_width = i + 1 < layout.mip_count ? layout.mips[i + 1].width : header.tail_width;
+        const auto next_height = i + 1 < layout.mip_count ? layout.mips[i + 1].height : header.tail_height;
+
+        auto* next = downsample(level, mip.width, mip.height, next_width, next_height);
+        free(level);
+        level = next;
+    }
+
+    const auto tail_texels = static_cast<size_t>(header.tail_width) * header.tail_height;
+    written = written && fwrite(level, sizeof(rgba), tail_texels, f) == tail_texels;
+    free(level);
+
+    if (fclose(f) != 0 || !written)
+    {
+        printf("Could not write %s.\n", page_path);
+        remove(temp_path);
+        return false;
+    }
+
+#if defined(_MSC_VER)
+    //windows won't rename over an existing file
+    remove(page_path);
+#endif
+
+    if (rename(temp_path, page_path) != 0)
+    {
+        printf("Could not write %s.\n", page_path);
+        remove(temp_path);
+        return false;
+    }
+
+    return true;
+}
+
+static bool page_file_is_current(const char* source_path, const char* page_path)
+{
+    struct stat source_stat{};
+    struct stat page_stat{};
+
+    if (stat(page_path, &page_stat) != 0) return false;
+    if (stat(source_path, &source_stat) != 0) return true;
+
+    return page_stat.st_mtime >= source_stat.st_mtime;
+}
+
+/*
+ * Opens a page file and checks its header, and its size against the layout
+ * the header describes, so a file cut short is never streamed from. Fills
+ * in out's size and mip layout, and returns the tail's size.
+ */
+static FILE* open_page_file(const char* page_path, virtual_texture& out, int& tail_width, int& tail_height)
+{
+    FILE* f = nullptr;
+    open_binary_file(page_path, f);
+    if (f == nullptr)
+    {
+        return nullptr;
+    }
+
+    page_file_header header{};
+
+    if (
+        fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, "VTEX", 4) != 0 ||
+        header.version != page_file_version || header.page_size != virtual_page_size ||
+        header.width <= 0 || header.height <= 0
+    )
+    {
+        fclose(f);
+        return nullptr;
+    }
+
+    out.width = header.width;
+    out.height = header.height;
+    layout_mips(out, tail_width, tail_height);
+
+    const auto expected_size =
+        sizeof(header) + static_cast<size_t>(out.page_count) * virtual_page_bytes +
+        sizeof(rgba) * static_cast<size_t>(tail_width) * tail_height;
+
+    const auto matches_layout =
+        out.mip_count == header.mip_count && tail_width == header.tail_width && tail_height == header.tail_height;
+
+    if (!matches_layout || fseek(f, 0, SEEK_END) != 0 || static_cast<size_t>(ftell(f)) != expected_size)
+    {
+        fclose(f);
+        return nullptr;
+    }
+
+    return f;
+}
+
+bool load_virtual_texture(const char* path, page_cache& cache, virtual_texture& out)
+{
+    char page_path[1024];
+    snprintf(page_path, sizeof(page_path), "%s.vt", path);
+
+    auto built = false;
+
+    if (!page_file_is_current(path, page_path))
+    {
+        if (!build_page_file(path, page_path)) return false;
+        built = true;
+    }
+
+    out = virtual_texture{};
+
+    auto tail_width = 0, tail_height = 0;
+    auto* f = open_page_file(page_path, out, tail_width, tail_height);
+
+    //a page file broken by an earlier run gets one rebuild
+    if (f == nullptr && !built && build_page_file(path, page_path))
+    {
+        f = open_page_file(page_path, out, tail_width, tail_height);
+    }
+
+    if (f == nullptr)
+    {
+        printf("Could not read %s.\n", page_path);
+        out = virtual_texture{};
+        return false;
+    }
+
+    //the tail follows the pages and stays resident
+    out.tail.width = tail_width;
+    out.tail.height = tail_height;
+    out.tail.n_channels = 4;
+    out.tail.data = static_cast<unsigned char*>(malloc(sizeof(rgba) * tail_width * tail_height));
+    assert(out.tail.data != nullptr);
+
+    const auto tail_texels = static_cast<size_t>(tail_width) * tail_height;
+
+    if (
+        fseek(f, static_cast<long>(sizeof(page_file_header) + static_cast<size_t>(out.page_count) * virtual_page_bytes), SEEK_SET) != 0 ||
+        fread(out.tail.data, sizeof(rgba), tail_texels, f) != tail_texels
+    )
+    {
+        printf("Could not read %s.\n", page_path);
+        fclose(f);
+        free_image(out.tail);
+        out = virtual_texture{};
+        return false;
+    }
+
+    out.cache = &cache;
+    out.page_file = f;
+    out.log2_size = 0.5f * std::log2(static_cast<float>(out.width) * static_cast<float>(out.height));
+
+    out.page_table = new int[out.page_count];
+    assert(out.page_table != nullptr);
+    for (auto i = 0; i < out.page_count; i++) out.page_table[i] = -1;
+
+    out.requested = new unsigned char[out.page_count];
+    assert(out.requested != nullptr);
+    memset(out.requested, 0, out.page_count);
+
+    cache.textures.push_back(&out);
+
+    printf(
+        "Virtual texture %s: %dx%d, %d mips in %d pages, %dx%d tail\n",
+        path, out.width, out.height, out.mip_count, out.page_count, tail_width, tail_height
+    );
+
+    return true;
+}
+
+/*
+ * Closes the page file, hands the texture's cache slots back and frees
+ * everything but the struct itself.
+ */
+void unload_virtual_texture(virtual_texture& tex)
+{
+    auto& cache = *tex.cache;
+
+    for (auto i = 0; i < cache.slot_count; i++)
+    {
+        if (cache.slots[i].owner == &tex)
+        {
+            cache.slots[i] = page_slot{};
+        }
+    }
+
+    for (size_t i = 0; i < cache.textures.size(); i++)
+    {
+        if (cache.textures[i] == &tex)
+        {
+            cache.textures.erase(cache.textures.begin() + i);
+            break;
+        }
+    }
+
+    fclose(tex.page_file);
+    delete[] tex.page_table;
+    delete[] tex.requested;
+    free_image(tex.tail);
+
+    tex = virtual_texture{};
+}
+
+/*
+ * Picks the least recently used slot that wasn't used this frame, or -1 if
+ * every slot is in use.
+ */
+static int find_victim_slot(const page_cache& cache)
+{
+    auto victim = -1;
+
+    for (auto i = 0; i < cache.slot_count; i++)
+    {
+        const auto& slot = cache.slots[i];
+
+        if (slot.owner == nullptr) return i;
+        if (slot.last_used == cache.frame) continue;
+
+        if (victim < 0 || slot.last_used < cache.slots[victim].last_used)
+        {
+            victim = i;
+        }
+    }
+
+    return victim;
+}
+
+/*
+ * Streams a page into a slot. A page that can't be read leaves the slot
+ * free, and sampling keeps falling back to coarser mips and the tail.
+ */
+static void load_page(page_cache& cache, virtual_texture& tex, const int page, const int slot_idx)
+{
+    auto& slot = cache.slots[slot_idx];
+
+    if (slot.owner != nullptr)
+    {
+        slot.owner->page_table[slot.page] = -1;
+        cache.pages_evicted++;
+    }
+
+    auto* dest = cache.pages + static_cast<size_t>(slot_idx) * virtual_page_bytes;
+
+    const auto offset = sizeof(page_file_header) + static_cast<size_t>(page) * virtual_page_bytes;
+
+    if (fseek(tex.page_file, static_cast<long>(offset), SEEK_SET) != 0 || fread(dest, virtual_page_bytes, 1, tex.page_file) != 1)
+    {
+        slot = page_slot{};
+        return;
+    }
+
+    slot.owner = &tex;
+    slot.page = page;
+    slot.last_used = cache.frame;
+
+    tex.page_table[page] = slot_idx;
+    cache.pages_loaded++;
+}
+
+void update_page_cache(page_cache& cache)
+{
+    cache.frame++;
+
+    //mark every requested resident page as used first, so loads can't evict them
+    for (auto* tex : cache.textures)
+    {
+        for (auto page = 0; page < tex->page_count; page++)
+        {
+            const auto slot = tex->page_table[page];
+
+            if (tex->requested[page] && slot >= 0)
+            {
+                cache.slots[slot].last_used = cache.frame;
+            }
+        }
+    }
+
+    auto loads = 0;
+
+    for (auto* tex : cache.textures)
+    {
+        for (auto page = 0; page < tex->page_count; page++)
+        {
+            if (!tex->requested[page]) continue;
+            tex->requested[page] = 0;
+
+            if (tex->page_table[page] >= 0 || loads >= cache.max_loads_per_frame) continue;
+
+            const auto slot = find_victim_slot(cache);
+
+            //the frame's working set fills the cache, keep what we have
+            if (slot < 0) continue;
+
+            load_page(cache, *tex, page, slot);
+            loads++;
+        }
+    }
+}
+
+inline rgba sample_virtual(const sampler& s, virtual_texture& tex, const uv_fixed& uv, const float lod)
+{
+    auto mip = lod > 0 ? static_cast<int>(lod) : 0;
+
+    for (auto requested = true; mip < tex.mip_count; mip++, requested = false)
+    {
+        const auto& level = tex.mips[mip];
+
+        const auto x = wrap_coord(scale_fixed_coord(uv.u, level.width) >> 8, level.width, s.wrap);
+
+        //read from bottom up
+        const auto y = level.height - wrap_coord(scale_fixed_coord(uv.v, level.height) >> 8, level.height, s.wrap) - 1;
+
+        const auto page = level.first_page + (y / virtual_page_size) * level.pages_x + x / virtual_page_size;
+
+        //only the mip we wanted goes in the feedback, fallbacks are just stand-ins
+        if (requested)
+        {
+            tex.requested[page] = 1;
+        }
+
+        const auto slot = tex.page_table[page];
+        if (slot >= 0)
+        {
+            const auto* texels = reinterpret_cast<const rgba*>(tex.cache->pages + static_cast<size_t>(slot) * virtual_page_bytes);
+            return texels[(y % virtual_page_size) * virtual_page_size + x % virtual_page_size];
+        }
+    }
+
+    return sample(s, tex.tail, uv);
+}
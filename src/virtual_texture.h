@@ -0,0 +1,102 @@
+#ifndef VIRTUAL_TEXTURE_H
+#define VIRTUAL_TEXTURE_H
+
+#include <cstdio>
+#include <vector>
+
+#include "image.h"
+#include "sampler.h"
+
+/*
+ * Virtual textures keep only the parts of a texture the renderer is using in
+ * memory.
+ *
+ * Each texture and its mip chain are cut into fixed size pages and written to
+ * a page file next to the source image. Pages are streamed from that file
+ * into a page_cache, a fixed pool of page slots shared by every virtual
+ * texture, so memory use doesn't depend on how large the assets are.
+ *
+ * While rasterizing, every sample marks the page it wanted in the texture's
+ * feedback buffer. Samples that miss fall back to the closest coarser mip that
+ * is resident, down to the tail: the first mip small enough to fit in one
+ * page, which is always kept in memory. update_page_cache() then reads the
+ * feedback once per frame, streams in missing pages and evicts the least
+ * recently used ones.
+ *
+ * Virtual textures are point sampled, only the sampler's wrap mode applies.
+ */
+static const int virtual_page_size = 64;
+static const int virtual_page_texels = virtual_page_size * virtual_page_size;
+static const int virtual_page_bytes = virtual_page_texels * static_cast<int>(sizeof(rgba));
+static const int virtual_max_mips = 16;
+
+struct page_cache;
+
+struct virtual_mip
+{
+    int width{}, height{};
+    int pages_x{}, pages_y{};
+    int first_page{};
+};
+
+struct virtual_texture
+{
+    page_cache* cache{};
+    FILE* page_file{};
+
+    int width{}, height{};
+
+    //mips cut into pages, the tail is stored separately
+    int mip_count{};
+    virtual_mip mips[virtual_max_mips];
+    int page_count{};
+
+    //page to cache slot, -1 when the page isn't resident
+    int* page_table{};
+
+    //feedback buffer, non zero for every page sampled since the last update
+    unsigned char* requested{};
+
+    image tail;
+
+    //half the log2 of the texel count, added to the shader's uv lod to pick a mip
+    float log2_size{};
+};
+
+struct page_slot
+{
+    virtual_texture* owner{};
+    int page = -1;
+    unsigned last_used{};
+};
+
+struct page_cache
+{
+    int slot_count{};
+    unsigned char* pages{};
+    page_slot* slots{};
+
+    //caps disk reads per frame, so a big camera move can't stall a frame
+    int max_loads_per_frame = 32;
+
+    unsigned frame{};
+    std::vector<virtual_texture*> textures;
+
+    size_t pages_loaded{};
+    size_t pages_evicted{};
+};
+
+void init_page_cache(page_cache& cache, int slot_count);
+void update_page_cache(page_cache& cache);
+
+/*
+ * Creates a virtual texture for the image at path. The page file is built on
+ * first use (decoding the full image once) and reused while it is newer
+ * than the source.
+ */
+bool load_virtual_texture(const char* path, page_cache& cache, virtual_texture& out);
+void unload_virtual_texture(virtual_texture& tex);
+
+inline rgba sample_virtual(const sampler& s, virtual_texture& tex, const uv_fixed& uv, float lod);
+
+#endif